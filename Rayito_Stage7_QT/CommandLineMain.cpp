@@ -0,0 +1,263 @@
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "rayito.h"
+
+
+using namespace Rayito;
+
+
+//
+// Headless renderer: renders one of the example scenes with no display at all,
+// and writes the result to a PFM (floating point) or PPM (8-bit) file.
+//
+
+
+namespace
+{
+
+
+void printUsage(const char* program)
+{
+    std::cerr << "Usage: " << program << " [options]\n"
+              << "    -scene <n>          Scene to render, 1 or 2 (default 1)\n"
+              << "    -o <file>           Output file, .pfm or .ppm (default out.pfm)\n"
+              << "    -res <w> <h>        Image resolution (default 640 480)\n"
+              << "    -samples <n>        Pixel samples hint (default 1)\n"
+              << "    -spp <n>            Exact pixel samples, any count (Sobol sampler only)\n"
+              << "    -maxsamples <n>     Adaptive sampling: max pixel samples hint (default off)\n"
+              << "    -noise <t>          Adaptive sampling: relative noise to stop at (default 0.02)\n"
+              << "    -lightsamples <n>   Light samples hint (default 1)\n"
+              << "    -depth <n>          Max ray depth (default 3)\n"
+              << "    -roulette <n>       Bounces before Russian roulette starts (default 3)\n"
+              << "    -integrator <name>  separate: own BRDF ray per light sample (default)\n"
+              << "                        shared: the path's next leg is the BRDF ray\n"
+              << "                        onesample: light or BRDF ray per light sample\n"
+              << "    -sampler <name>     cmj: correlated multi-jitter patterns (default)\n"
+              << "                        sobol: Owen-scrambled Sobol sequence\n"
+              << "    -wavefront          Trace each tile's paths together, a stage at a time\n"
+              << "    -fov <degrees>      Camera field of view (default 30)\n"
+              << "    -focus <dist>       Camera focal distance (default 16)\n"
+              << "    -lens <radius>      Camera lens radius (default 0)\n"
+              << "    -shutter <o> <c>    Shutter open and close times (default 0 1)\n"
+              << "    -exposure <stops>   Exposure for .ppm output (default 0)\n"
+              << "    -gamma <g>          Gamma for .ppm output (default 2.2)\n"
+              << "    -models <dir>       Directory with the OBJ models (default ../models)\n"
+              << "    -meshcache <dir>    Directory to cache parsed OBJs in (default\n"
+              << "                        ~/.cache/rayito; give the models directory to\n"
+              << "                        keep them next to the OBJs)\n"
+              << "    -nomeshcache        Parse the OBJs every time, writing no caches\n";
+}
+
+
+bool endsWith(const std::string& str, const char* suffix)
+{
+    size_t len = std::strlen(suffix);
+    return str.size() >= len && str.compare(str.size() - len, len, suffix) == 0;
+}
+
+
+bool writePFM(Image& image, const std::string& filename)
+{
+    std::ofstream fileStream(filename.c_str(), std::ios::out | std::ios::binary);
+    if (!fileStream.good())
+        return false;
+    
+    // Negative scale means little-endian.  PFMs are bottom-up, and images are
+    // top-down, so write the rows out backwards.
+    std::ostringstream headerStream;
+    headerStream << "PF\n";
+    headerStream << image.width() << ' ' << image.height() << '\n';
+    headerStream << "-1.0\n";
+    fileStream << headerStream.str();
+    for (size_t y = image.height(); y-- > 0; )
+    {
+        for (size_t x = 0; x < image.width(); ++x)
+        {
+            Color color = image.pixel(x, y);
+            fileStream.write(reinterpret_cast<const char*>(&color.m_r), sizeof(float));
+            fileStream.write(reinterpret_cast<const char*>(&color.m_g), sizeof(float));
+            fileStream.write(reinterpret_cast<const char*>(&color.m_b), sizeof(float));
+        }
+    }
+    return fileStream.good();
+}
+
+
+bool writePPM(Image& image, const std::string& filename, float exposureStops, float gamma)
+{
+    std::ofstream fileStream(filename.c_str(), std::ios::out | std::ios::binary);
+    if (!fileStream.good())
+        return false;
+    
+    std::ostringstream headerStream;
+    headerStream << "P6\n";
+    headerStream << image.width() << ' ' << image.height() << '\n';
+    headerStream << "255\n";
+    fileStream << headerStream.str();
+    
+    // Same conversion as the GUI does for display: result = (value*(2^exposure))^(1/gamma)
+    float gammaExponent = 1.0f / gamma;
+    float exposure = std::pow(2.0f, exposureStops);
+    for (size_t y = 0; y < image.height(); ++y)
+    {
+        for (size_t x = 0; x < image.width(); ++x)
+        {
+            Color color = image.pixel(x, y);
+            // Negative values are made green, NaNs are made blue
+            if (color.m_r < 0.0f || color.m_g < 0.0f || color.m_b < 0.0f)
+            {
+                color = Color(0.0f, 1.0f, 0.0f);
+            }
+            else
+            {
+                color.m_r = std::pow(color.m_r * exposure, gammaExponent);
+                color.m_g = std::pow(color.m_g * exposure, gammaExponent);
+                color.m_b = std::pow(color.m_b * exposure, gammaExponent);
+                if (color.m_r != color.m_r || color.m_g != color.m_g || color.m_b != color.m_b)
+                {
+                    color = Color(0.0f, 0.0f, 1.0f);
+                }
+            }
+            color.clamp();
+            unsigned char rgb[3];
+            rgb[0] = static_cast<unsigned char>(color.m_r * 255.0f);
+            rgb[1] = static_cast<unsigned char>(color.m_g * 255.0f);
+            rgb[2] = static_cast<unsigned char>(color.m_b * 255.0f);
+            fileStream.write(reinterpret_cast<const char*>(rgb), 3);
+        }
+    }
+    return fileStream.good();
+}
+
+
+} // namespace
+
+
+int main(int argc, char **argv)
+{
+    RenderSettings settings;
+    unsigned int scene = 1;
+    std::string outputFilename = "out.pfm";
+    float exposure = 0.0f;
+    float gamma = 2.2f;
+    
+    // Parse the commandline; every option takes one or two values after it
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        int valuesLeft = argc - i - 1;
+        if (arg == "-scene" && valuesLeft >= 1)
+            scene = std::atoi(argv[++i]);
+        else if (arg == "-o" && valuesLeft >= 1)
+            outputFilename = argv[++i];
+        else if (arg == "-res" && valuesLeft >= 2)
+        {
+            settings.m_width = std::atoi(argv[++i]);
+            settings.m_height = std::atoi(argv[++i]);
+        }
+        else if (arg == "-samples" && valuesLeft >= 1)
+            settings.m_pixelSamplesHint = std::atoi(argv[++i]);
+        else if (arg == "-spp" && valuesLeft >= 1)
+            settings.m_pixelSamples = std::atoi(argv[++i]);
+        else if (arg == "-maxsamples" && valuesLeft >= 1)
+            settings.m_maxPixelSamplesHint = std::atoi(argv[++i]);
+        else if (arg == "-noise" && valuesLeft >= 1)
+            settings.m_noiseThreshold = (float)std::atof(argv[++i]);
+        else if (arg == "-lightsamples" && valuesLeft >= 1)
+            settings.m_lightSamplesHint = std::atoi(argv[++i]);
+        else if (arg == "-depth" && valuesLeft >= 1)
+            settings.m_maxRayDepth = std::atoi(argv[++i]);
+        else if (arg == "-roulette" && valuesLeft >= 1)
+            settings.m_rouletteMinBounces = std::atoi(argv[++i]);
+        else if (arg == "-integrator" && valuesLeft >= 1 && std::strcmp(argv[i + 1], "separate") == 0)
+        {
+            settings.m_integrator = kIntegratorSeparateBrdfRays;
+            ++i;
+        }
+        else if (arg == "-integrator" && valuesLeft >= 1 && std::strcmp(argv[i + 1], "shared") == 0)
+        {
+            settings.m_integrator = kIntegratorSharedBrdfRay;
+            ++i;
+        }
+        else if (arg == "-integrator" && valuesLeft >= 1 && std::strcmp(argv[i + 1], "onesample") == 0)
+        {
+            settings.m_integrator = kIntegratorOneSampleMIS;
+            ++i;
+        }
+        else if (arg == "-sampler" && valuesLeft >= 1 && std::strcmp(argv[i + 1], "cmj") == 0)
+        {
+            settings.m_sampler = kSamplerCorrelatedMultiJitter;
+            ++i;
+        }
+        else if (arg == "-sampler" && valuesLeft >= 1 && std::strcmp(argv[i + 1], "sobol") == 0)
+        {
+            settings.m_sampler = kSamplerSobol;
+            ++i;
+        }
+        else if (arg == "-wavefront")
+            settings.m_wavefront = true;
+        else if (arg == "-fov" && valuesLeft >= 1)
+            settings.m_fieldOfView = (float)std::atof(argv[++i]);
+        else if (arg == "-focus" && valuesLeft >= 1)
+            settings.m_focalDistance = (float)std::atof(argv[++i]);
+        else if (arg == "-lens" && valuesLeft >= 1)
+            settings.m_lensRadius = (float)std::atof(argv[++i]);
+        else if (arg == "-shutter" && valuesLeft >= 2)
+        {
+            settings.m_shutterOpen = (float)std::atof(argv[++i]);
+            settings.m_shutterClose = (float)std::atof(argv[++i]);
+        }
+        else if (arg == "-exposure" && valuesLeft >= 1)
+            exposure = (float)std::atof(argv[++i]);
+        else if (arg == "-gamma" && valuesLeft >= 1)
+            gamma = (float)std::atof(argv[++i]);
+        else if (arg == "-models" && valuesLeft >= 1)
+            settings.m_modelDirectory = argv[++i];
+        else if (arg == "-meshcache" && valuesLeft >= 1)
+            settings.m_meshCacheDirectory = argv[++i];
+        else if (arg == "-nomeshcache")
+            settings.m_meshCache = false;
+        else
+        {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (settings.m_width == 0 || settings.m_height == 0 ||
+        settings.m_pixelSamplesHint == 0 || settings.m_lightSamplesHint == 0 ||
+        gamma <= 0.0f || (scene != 1 && scene != 2) ||
+        !(endsWith(outputFilename, ".pfm") || endsWith(outputFilename, ".ppm")))
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+    
+    // Ray trace!
+    RenderStats stats;
+    Image *pImage = scene == 1 ? renderExampleScene(settings, NULL, &stats)
+                               : renderBouncingScene(settings, NULL, &stats);
+    
+    // Report what it cost and how clean it came out, so renders can be compared
+    size_t numPixels = settings.m_width * settings.m_height;
+    std::cout << "Prepare: " << stats.m_prepareTime << " s" << std::endl;
+    std::cout << "Samples: " << stats.m_samplesSpent << " ("
+              << double(stats.m_samplesSpent) / numPixels << " per pixel)" << std::endl;
+    std::cout << "Noise: " << stats.m_averageNoise << " average, " << stats.m_maxNoise << " max" << std::endl;
+    if (settings.m_maxPixelSamplesHint > settings.m_pixelSamplesHint)
+        std::cout << "Converged pixels: " << stats.m_convergedPixels << " of " << numPixels << std::endl;
+    
+    bool written = endsWith(outputFilename, ".pfm") ? writePFM(*pImage, outputFilename)
+                                                    : writePPM(*pImage, outputFilename, exposure, gamma);
+    delete pImage;
+    if (!written)
+    {
+        std::cerr << "Could not write image: " << outputFilename << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -2,8 +2,8 @@
 #include "ui_MainWindow.h"
 
 #include "rayito.h"
-#include "RMesh.h"
 
+#include <QCloseEvent>
 #include <QGraphicsScene>
 
 
@@ -11,7 +11,7 @@ using namespace Rayito;
 
 
 MainWindow::MainWindow(QWidget *pParent)
-    : QMainWindow(pParent), ui(new Ui::MainWindow)
+    : QMainWindow(pParent), ui(new Ui::MainWindow), m_rendering(false), m_cancelRequested(false)
 {
     ui->setupUi(this);
     
@@ -30,11 +30,20 @@ MainWindow::~MainWindow()
 
 void MainWindow::on_actionQuit_triggered()
 {
+    // Don't leave a progressive render going
+    m_cancelRequested = true;
     qApp->quit();
 }
 
 
-void MainWindow::displayImage(Image *pImage)
+void MainWindow::closeEvent(QCloseEvent *pEvent)
+{
+    m_cancelRequested = true;
+    QMainWindow::closeEvent(pEvent);
+}
+
+
+void MainWindow::displayImage(const Image& image, const std::vector<unsigned int> *pPixelSamples)
 {
     // Convert from floating-point RGB to 32-bit ARGB format,
     // applying exposure and gamma along the way
@@ -43,13 +52,20 @@ void MainWindow::displayImage(Image *pImage)
     float gammaExponent = 1.0f / (float)ui->gammaSpinBox->value();
     // An exposure'd value is value*2^exposure (applied before gamma)
     float exposure = std::pow(2.0f, (float)ui->exposureSpinBox->value());
-    uchar *argbPixels = new uchar[pImage->width() * pImage->height() * 4];
-    for (size_t y = 0; y < pImage->height(); ++y)
+    uchar *argbPixels = new uchar[image.width() * image.height() * 4];
+    for (size_t y = 0; y < image.height(); ++y)
     {
-        for (size_t x = 0; x < pImage->width(); ++x)
+        for (size_t x = 0; x < image.width(); ++x)
         {
-            size_t pixelOffset = (y * pImage->width() + x) * 4;
-            Color color = pImage->pixel(x, y);
+            size_t pixelOffset = (y * image.width() + x) * 4;
+            Color color = image.pixel(x, y);
+            // Sums of samples become averages (dividing rides along with exposure)
+            float pixelExposure = exposure;
+            if (pPixelSamples != NULL)
+            {
+                unsigned int numSamples = (*pPixelSamples)[y * image.width() + x];
+                pixelExposure = numSamples > 0 ? exposure / numSamples : 0.0f;
+            }
             // Check for negative values (we don't like those).  Make them green.
             if (color.m_r < 0.0f || color.m_g < 0.0f || color.m_b < 0.0f)
             {
@@ -58,9 +74,9 @@ void MainWindow::displayImage(Image *pImage)
             else
             {
                 // Combined gamma and exposure: result = (value*(2^exposure))^(1/gamma)
-                color.m_r = std::pow(color.m_r * exposure, gammaExponent);
-                color.m_g = std::pow(color.m_g * exposure, gammaExponent);
-                color.m_b = std::pow(color.m_b * exposure, gammaExponent);
+                color.m_r = std::pow(color.m_r * pixelExposure, gammaExponent);
+                color.m_g = std::pow(color.m_g * pixelExposure, gammaExponent);
+                color.m_b = std::pow(color.m_b * pixelExposure, gammaExponent);
                 // Check for NaNs (not-a-number), we HATE those.  Make them blue.
                 if (color.m_r != color.m_r || color.m_g != color.m_g || color.m_b != color.m_b)
                 {
@@ -78,315 +94,98 @@ void MainWindow::displayImage(Image *pImage)
     }
     
     // Make an image, then make a pixmap for the graphics scene
-    QImage image(argbPixels,
-                 static_cast<int>(pImage->width()),
-                 static_cast<int>(pImage->height()),
-                 QImage::Format_ARGB32_Premultiplied);
+    QImage qimage(argbPixels,
+                  static_cast<int>(image.width()),
+                  static_cast<int>(image.height()),
+                  QImage::Format_ARGB32_Premultiplied);
     
     ui->renderGraphicsView->scene()->clear();
-    ui->renderGraphicsView->scene()->addPixmap(QPixmap::fromImage(image));
+    ui->renderGraphicsView->scene()->addPixmap(QPixmap::fromImage(qimage));
     
     // Clean up the image and pixel conversion buffers
     delete[] argbPixels;
 }
 
-inline Mesh* makeCube()
+bool MainWindow::passFinished(const Image& sampleSums,
+                              const std::vector<unsigned int>& pixelSamples,
+                              unsigned int samplesSoFar,
+                              unsigned int maxSamples)
 {
-    std::vector<Face> faces;
-    std::vector<Vector> normals;
-    std::vector<Point> vertices;
-    vertices.push_back(Point(0.0f, 0.0f, 0.0f));
-    vertices.push_back(Point(1.0f, 0.0f, 0.0f));
-    vertices.push_back(Point(1.0f, 1.0f, 0.0f));
-    vertices.push_back(Point(0.0f, 1.0f, 0.0f));
-    vertices.push_back(Point(0.0f, 0.0f, 1.0f));
-    vertices.push_back(Point(1.0f, 0.0f, 1.0f));
-    vertices.push_back(Point(1.0f, 1.0f, 1.0f));
-    vertices.push_back(Point(0.0f, 1.0f, 1.0f));
-    faces.push_back(Face());
-    faces.back().m_vertexIndices.push_back(0);
-    faces.back().m_vertexIndices.push_back(1);
-    faces.back().m_vertexIndices.push_back(2);
-    faces.back().m_vertexIndices.push_back(3);
-    faces.push_back(Face());
-    faces.back().m_vertexIndices.push_back(1);
-    faces.back().m_vertexIndices.push_back(5);
-    faces.back().m_vertexIndices.push_back(6);
-    faces.back().m_vertexIndices.push_back(2);
-    faces.push_back(Face());
-    faces.back().m_vertexIndices.push_back(5);
-    faces.back().m_vertexIndices.push_back(4);
-    faces.back().m_vertexIndices.push_back(7);
-    faces.back().m_vertexIndices.push_back(6);
-    faces.push_back(Face());
-    faces.back().m_vertexIndices.push_back(4);
-    faces.back().m_vertexIndices.push_back(0);
-    faces.back().m_vertexIndices.push_back(3);
-    faces.back().m_vertexIndices.push_back(7);
-    faces.push_back(Face());
-    faces.back().m_vertexIndices.push_back(3);
-    faces.back().m_vertexIndices.push_back(2);
-    faces.back().m_vertexIndices.push_back(6);
-    faces.back().m_vertexIndices.push_back(7);
-    faces.push_back(Face());
-    faces.back().m_vertexIndices.push_back(3);
-    faces.back().m_vertexIndices.push_back(2);
-    faces.back().m_vertexIndices.push_back(6);
-    faces.back().m_vertexIndices.push_back(7);
-    return new Mesh(vertices, normals, faces, NULL);
+    displayImage(sampleSums, &pixelSamples);
+    statusBar()->showMessage(QString("Rendered %1 of %2 samples per pixel").arg(samplesSoFar).arg(maxSamples));
+    
+    // Let the view redraw, and let the user hit cancel
+    qApp->processEvents();
+    return !m_cancelRequested;
 }
 
-void MainWindow::on_renderButton_clicked()
+void MainWindow::renderProgressively(SceneRenderer renderer)
 {
-    // Make a picture...
-    
-    // Available materials
-    DiffuseMaterial blueishLambert(Color(0.6f, 0.6f, 0.9f));
-    DiffuseMaterial purplishLambert(Color(0.8f, 0.3f, 0.7f));
-    DiffuseMaterial reddishLambert(Color(0.8f, 0.3f, 0.1f));
-    GlossyMaterial bluishGlossy(Color(0.5f, 0.3f, 0.8f), 0.3);
-    GlossyMaterial greenishGlossy(Color(0.3f, 0.9f, 0.3f), 0.1f);
-    GlossyMaterial reddishGlossy(Color(0.8f, 0.1f, 0.1f), 0.3f);
-    ReflectionMaterial reflective(Color(0.7f, 0.7f, 0.2f));
-    
-    // The 'scene'
-    ShapeSet masterSet;
-    
-    // Put a ground plane in (with bullseye texture!)
-    // Last parameter is whether to do the bullseye texture or not
-    Plane plane(Point(), Vector(0.0f, 1.0f, 0.0f), &blueishLambert, true);
-    plane.transform().translate(0.0f, Vector(0.0f, -2.0f, 0.0f));
-    masterSet.addShape(&plane);
-    
-    // Add a pile-o-spheres with a few interesting materials
-    
-    Sphere sphere1(Point(), 1.0f, &purplishLambert);
-    sphere1.transform().setTranslation(0.0f, Vector(2.0f, -1.0f, 0.0f));
-    sphere1.transform().setTranslation(1.0f, Vector(3.0f, -1.0f, 0.0f));
-    masterSet.addShape(&sphere1);
-    
-    Sphere sphere2(Point(), 2.0f, &greenishGlossy);
-    sphere2.transform().translate(0.0f, Vector(-3.0f, 0.0f, -2.0f));
-    masterSet.addShape(&sphere2);
-    
-    Sphere sphere3(Point(), 0.5f, &bluishGlossy);
-    sphere3.transform().translate(0.0f, Vector(1.5f, -1.5f, 2.5f));
-    masterSet.addShape(&sphere3);
-    
-    Sphere sphere4(Point(), 0.5f, &reflective);
-    sphere4.transform().translate(0.0f, Vector(-2.0, -1.5f, 1.0f));
-    masterSet.addShape(&sphere4);
-    
-    // Add a manually created mesh (a box), and read an OBJ file into a mesh
-    
-    Mesh *cubeMesh = makeCube();
-    cubeMesh->setMaterial(&reddishLambert);
-    cubeMesh->transform().translate(0.0f, Vector(0.0f, -2.0f, -2.0f));
-    cubeMesh->transform().rotate(1.0f, Quaternion(Vector(0.0f, 1.0f, 0.0f), M_PI / 4.0f));
-    masterSet.addShape(cubeMesh);
-
-    Mesh* pOBJMesh = createFromOBJFile("../models/bumpy.obj");
-    pOBJMesh->setMaterial(&reddishGlossy);
-    pOBJMesh->transform().setTranslation(0.0f, Vector(0.2f, 0.0f, 0.0f));
-    pOBJMesh->transform().rotate(0.5f, Quaternion(Vector(0.0f, 1.0f, 0.0f), M_PI / 4.0f));
-    pOBJMesh->transform().rotate(1.0f, Quaternion(Vector(0.0f, 1.0f, 0.0f), M_PI / 2.0f));
-#if MAKE_OBJ_A_MESH_LIGHT
-    // For some fun, you can turn the OBJ mesh into a light (it's a bit noisy, though)
-    ShapeLight meshLight(pOBJMesh, Color(1.0f, 1.0f, 1.0f), 10.0f);
-    masterSet.addShape(&meshLight);
-#else
-    masterSet.addShape(pOBJMesh);
-#endif
-
-    // Add an area light
-    RectangleLight areaLight(Point(),
-                             Vector(3.0f, 0.0f, 0.0f),
-                             Vector(0.0f, 0.0f, 3.0f),
-                             Color(1.0f, 1.0f, 1.0f),
-                             5.0f);
-    areaLight.transform().setTranslation(0.0f, Vector(-1.5f, 4.0f, -1.5f));
-    // Uncomment this to have the rect light hinge-swing downward
-//    areaLight.transform().setRotation(1.0f, Quaternion(Vector(0.0f, 0.0f, 1.0f), -M_PI / 4.0f));
-    masterSet.addShape(&areaLight);
-
-    // Add an area light based on a shape (a sphere)
-    Sphere sphereForLight(Point(), 0.1f, &blueishLambert);
-    sphereForLight.transform().setTranslation(0.0f, Vector(0.0f, 0.5f, 4.0f));
-    sphereForLight.transform().setTranslation(0.33f, Vector(0.0f, 1.5f, 4.0f));
-    sphereForLight.transform().setTranslation(0.67f, Vector(1.0f, 1.5f, 4.0f));
-    sphereForLight.transform().setTranslation(1.0f, Vector(1.0f, 0.5f, 4.0f));
-    ShapeLight sphereLight(&sphereForLight, Color(1.0f, 1.0f, 0.3f), 100.0f);
-    masterSet.addShape(&sphereLight);
-    
-    // Create the camera based on user settings
-    PerspectiveCamera cam((float)ui->camFovSpinBox->value(),
-                          Point(-4.0f, 5.0f, 15.0f),
-                          Point(0.0f, 0.0f, 0.0f),
-                          Point(0.0f, 1.0f, 0.0f),
-                          (float)ui->focalDistanceSpinBox->value(),
-                          (float)ui->lensRadiusSpinBox->value(),
-                          (float)ui->shutterOpenSpinBox->value(),
-                          (float)ui->shutterCloseSpinBox->value());
-    
-    // Ray trace!
-    Image *pImage = raytrace(masterSet,
-                             cam,
-                             (size_t)ui->widthSpinBox->value(),
-                             (size_t)ui->heightSpinBox->value(),
-                             (unsigned int)ui->pixelSamplesSpinBox->value(),
-                             (unsigned int)ui->lightSamplesSpinBox->value(),
-                             (unsigned int)ui->rayDepthSpinBox->value());
-    
-    displayImage(pImage);
+    // While a render is going, the render buttons cancel it instead
+    if (m_rendering)
+    {
+        m_cancelRequested = true;
+        return;
+    }
+    m_rendering = true;
+    m_cancelRequested = false;
+    QString renderText = ui->renderButton->text();
+    QString renderText2 = ui->renderButton2->text();
+    ui->renderButton->setText("Cancel");
+    ui->renderButton2->setText("Cancel");
     
-    // Clean up the scene and render
+    // Make a picture...
+    RenderSettings settings = renderSettings();
+    RenderStats stats;
+    Image *pImage = renderer(settings, this, &stats);
+    displayImage(*pImage);
     delete pImage;
-    delete pOBJMesh;
+    
+    // Report what the render cost and how clean it is
+    double samplesPerPixel = double(stats.m_samplesSpent) / (settings.m_width * settings.m_height);
+    statusBar()->showMessage(QString("Render %1: prepared in %2 s, %3 samples per pixel, noise %4 average, %5 max")
+                             .arg(m_cancelRequested ? "cancelled" : "finished")
+                             .arg(stats.m_prepareTime, 0, 'f', 3)
+                             .arg(samplesPerPixel, 0, 'f', 1)
+                             .arg(stats.m_averageNoise, 0, 'f', 3)
+                             .arg(stats.m_maxNoise, 0, 'f', 3));
+    ui->renderButton->setText(renderText);
+    ui->renderButton2->setText(renderText2);
+    m_rendering = false;
 }
 
-// Let's have some fun, and make a scene where objects fall and bounce off the
-// ground using real physics kinematics.
-inline Point kinematicPosition(const Point& start,
-                               const Vector& velocity,
-                               float time,
-                               const Vector& gravity = Vector(0.0f, -9.8f, 0.0f),
-                               float groundHeight = 0.0f)
+void MainWindow::on_renderButton_clicked()
 {
-    // Kinematic equations:
-    //     p = p0 + v*t
-    //     p = t*(vi + vf)/2
-    //     vf = v0 + a*t
-    //     p = p0 + (v0 + v0 + a*t)*t/2 = p0 + v0*t + a*t*t/2
-    // Solving for time to find when we smack the plane:
-    //     t = (-v0 + sqrt(v0*v0 - 4*a*p0/2))/(2*a/2) = (-v0 + sqrt(v0*v0 - 2*a*p0))/a
-    
-    // Gravity direction
-    Vector up = -gravity.normalized();
-    float vUp = dot(velocity, up);
-    float pUp = dot(start, up);
-    float aUp = -gravity.length();
-    
-    float discriminant = vUp * vUp - 2.0f * aUp * pUp;
-    if (discriminant > 0.0f)
-    {
-        float intersectionTime = (-vUp - std::sqrt(discriminant)) / aUp;
-        if (intersectionTime < time)
-        {
-            // Find intersection position
-            Point isect = start + velocity * intersectionTime +
-                          gravity * intersectionTime * intersectionTime * 0.5f;
-            Vector isectVelocity = (velocity + gravity * intersectionTime);
-            Vector reboundVelocity = isectVelocity - 2.0f * up * dot(isectVelocity, up);
-            float reboundTime = time - intersectionTime;
-            return isect + reboundVelocity * reboundTime +
-                   gravity * reboundTime * reboundTime * 0.5f;
-        }
-    }
-    // Do the usual kinematic result
-    return start + velocity * time + gravity * time * time * 0.5f;
+    renderProgressively(renderExampleScene);
 }
 
 void MainWindow::on_renderButton2_clicked()
 {
-    // Make a picture...
-    
-    // Available materials
-    DiffuseMaterial blueishLambert(Color(0.6f, 0.6f, 0.9f));
-    GlossyMaterial yellowishGlossy(Color(0.9f, 0.9f, 0.3f), 0.3f);
-    DiffuseMaterial redLambert(Color(1.0f, 0.2f, 0.2f));
-    
-    // The 'scene'
-    ShapeSet masterSet;
-    
-    // Put a ground plane in (with bullseye texture!)
-    // Last parameter is whether to do the bullseye texture or not
-    Plane plane(Point(), Vector(0.0f, 1.0f, 0.0f), &redLambert, true);
-    masterSet.addShape(&plane);
-    
-    // Add a pile-o-spheres at various stages of falling/bouncing
-    
-    Sphere spheres[10];
-    Point start(-10.0f, 10.0f, 0.0f);
-    Vector velocity(4.5f, 0.0f, 0.0f);
-    float timeOffset = 0.0f;
-    const float timeDelta = 0.2f;
-    for (unsigned int i = 0; i < 10; ++i)
-    {
-        Point position0 = kinematicPosition(start, velocity, timeOffset);
-        Point position1 = kinematicPosition(start, velocity, timeOffset + timeDelta);
-        
-        spheres[i].transform().setTranslation(0.0f, position0);
-        spheres[i].transform().setTranslation(1.0f, position1);
-        spheres[i].setMaterial(&blueishLambert);
-        
-        masterSet.addShape(&spheres[i]);
-        
-        timeOffset += timeDelta * 2.0f;
-    }
-    
-    // Add a pile-o-cubes at various stages of falling/bouncing, and rotating
-    
-    Mesh* cubes[10];
-    start = Point(10.0f, 10.0f, 2.0f);
-    velocity = Vector(-4.5f, 0.0f, 0.0f);
-    timeOffset = 0.0f;
-    for (unsigned int i = 0; i < 10; ++i)
-    {
-        Point position0 = kinematicPosition(start, velocity, timeOffset);
-        Point position1 = kinematicPosition(start, velocity, timeOffset + timeDelta);
-        float rotation0 = timeOffset * M_PI * 0.5;
-        if (rotation0 > M_PI * 2.0f)
-            rotation0 -= M_PI * 2.0f;
-        float rotation1 = rotation0 + timeDelta * M_PI * 0.5;
-        
-        cubes[i] = makeCube();
-        cubes[i]->transform().setTranslation(0.0f, position0);
-        cubes[i]->transform().setRotation(0.0f, Quaternion(Vector(1.0f, 0.0f, 1.0f).normalized(), rotation0));
-        cubes[i]->transform().setTranslation(1.0f, position1);
-        cubes[i]->transform().setRotation(1.0f, Quaternion(Vector(1.0f, 0.0f, 1.0f).normalized(), rotation1));
-        cubes[i]->setMaterial(&yellowishGlossy);
-        
-        masterSet.addShape(cubes[i]);
-        
-        timeOffset += timeDelta * 2.0f;
-    }
-    
-    // Add an area light
-    RectangleLight areaLight(Point(),
-                             Vector(2.0f, 0.0f, 0.0f),
-                             Vector(0.0f, 0.0f, 2.0f),
-                             Color(1.0f, 1.0f, 1.0f),
-                             50.0f);
-    areaLight.transform().setTranslation(0.0f, Vector(-1.0f, 15.0f, 1.0f));
-    masterSet.addShape(&areaLight);
+    renderProgressively(renderBouncingScene);
+}
 
-    // Create the camera based on user settings
-    PerspectiveCamera cam((float)ui->camFovSpinBox->value(),
-                          Point(-4.0f, 10.0f, 30.0f),
-                          Point(0.0f, 5.0f, 0.0f),
-                          Point(0.0f, 1.0f, 0.0f),
-                          (float)ui->focalDistanceSpinBox->value(),
-                          (float)ui->lensRadiusSpinBox->value(),
-                          (float)ui->shutterOpenSpinBox->value(),
-                          (float)ui->shutterCloseSpinBox->value());
-    
-    // Ray trace!
-    Image *pImage = raytrace(masterSet,
-                             cam,
-                             (size_t)ui->widthSpinBox->value(),
-                             (size_t)ui->heightSpinBox->value(),
-                             (unsigned int)ui->pixelSamplesSpinBox->value(),
-                             (unsigned int)ui->lightSamplesSpinBox->value(),
-                             (unsigned int)ui->rayDepthSpinBox->value());
-    
-    displayImage(pImage);
-    
-    // Clean up the scene and render
-    delete pImage;
-    for (unsigned int i = 0; i < 10; ++i)
-    {
-        delete cubes[i];
-    }
+RenderSettings MainWindow::renderSettings() const
+{
+    // Gather up the user settings
+    RenderSettings settings;
+    settings.m_width = (size_t)ui->widthSpinBox->value();
+    settings.m_height = (size_t)ui->heightSpinBox->value();
+    settings.m_pixelSamplesHint = (unsigned int)ui->pixelSamplesSpinBox->value();
+    settings.m_lightSamplesHint = (unsigned int)ui->lightSamplesSpinBox->value();
+    settings.m_maxRayDepth = (unsigned int)ui->rayDepthSpinBox->value();
+    settings.m_rouletteMinBounces = (unsigned int)ui->rouletteDepthSpinBox->value();
+    settings.m_integrator = (IntegratorMode)ui->integratorComboBox->currentIndex();
+    settings.m_sampler = (SamplerMode)ui->samplerComboBox->currentIndex();
+    settings.m_pixelSamples = (unsigned int)ui->sobolPixelSamplesSpinBox->value();
+    settings.m_wavefront = ui->wavefrontCheckBox->isChecked();
+    settings.m_maxPixelSamplesHint = (unsigned int)ui->maxPixelSamplesSpinBox->value();
+    settings.m_noiseThreshold = (float)ui->noiseThresholdSpinBox->value();
+    settings.m_fieldOfView = (float)ui->camFovSpinBox->value();
+    settings.m_focalDistance = (float)ui->focalDistanceSpinBox->value();
+    settings.m_lensRadius = (float)ui->lensRadiusSpinBox->value();
+    settings.m_shutterOpen = (float)ui->shutterOpenSpinBox->value();
+    settings.m_shutterClose = (float)ui->shutterCloseSpinBox->value();
+    return settings;
 }
 
 void MainWindow::on_actionRender_Scene_triggered()
@@ -3,19 +3,15 @@
 
 #include <QMainWindow>
 
+#include "rayito.h"
+
 
 namespace Ui {
 class MainWindow;
 }
 
 
-namespace Rayito
-{
-    class Image;
-}
-
-
-class MainWindow : public QMainWindow
+class MainWindow : public QMainWindow, public Rayito::RenderProgress
 {
    Q_OBJECT
    
@@ -23,7 +19,19 @@ public:
    explicit MainWindow(QWidget *pParent = NULL);
    ~MainWindow();
    
-    void displayImage(Rayito::Image *pImage);
+    // The image can hold sums of samples; pass the per-pixel sample counts
+    // to turn them into averages
+    void displayImage(const Rayito::Image& image,
+                      const std::vector<unsigned int> *pPixelSamples = NULL);
+    
+    // Shows each pass of a progressive render as it finishes
+    virtual bool passFinished(const Rayito::Image& sampleSums,
+                              const std::vector<unsigned int>& pixelSamples,
+                              unsigned int samplesSoFar,
+                              unsigned int maxSamples);
+    
+protected:
+    virtual void closeEvent(QCloseEvent *pEvent);
     
 private slots:
    void on_actionQuit_triggered();
@@ -34,7 +42,16 @@ private slots:
    void on_actionRender_Scene_triggered();
    
 private:
+   typedef Rayito::Image* (*SceneRenderer)(const Rayito::RenderSettings&,
+                                           Rayito::RenderProgress*,
+                                           Rayito::RenderStats*);
+   
+   Rayito::RenderSettings renderSettings() const;
+   void renderProgressively(SceneRenderer renderer);
+   
    Ui::MainWindow *ui;
+   bool m_rendering;
+   bool m_cancelRequested;
 };
 
 
@@ -0,0 +1,482 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+    #define WIN32_LEAN_AND_MEAN
+    #define NOMINMAX
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+#include "RMesh.h"
+
+
+namespace Rayito
+{
+
+/*
+ * Mesh cache file layout.  Everything is stored in the native byte order of
+ * the machine that wrote it (the header has a marker to check that), one
+ * array after another right after the header:
+ *     vertices            numVertices x 3 floats
+ *     normals             numNormals x 3 floats
+ *     face vertex counts  numFaces uint32s
+ *     face normal counts  numFaces uint32s (each 0 or same as vertex count)
+ *     vertex indices      numVertexIndices uint32s (all faces, in order)
+ *     normal indices      numNormalIndices uint32s (all faces, in order)
+ *     BVH nodes           numNodes BvhNodes, exactly as they are in memory
+ *     BVH prim list       numPrims uint32s (the mesh's triangles, in BVH order)
+ * The file is memory-mapped for loading, and checked over carefully before we
+ * believe any of it (including a hash of everything after the header, to
+ * catch damaged files); anything off and we just pretend there was no cache.
+ */
+
+// Bump this whenever the layout (or the BVH build) changes
+const uint32_t kMeshCacheVersion = 3;
+const char kMeshCacheMagic[8] = { 'R', 'A', 'Y', 'M', 'B', 'V', 'H', '\0' };
+const uint32_t kMeshCacheByteOrder = 0x01020304;
+
+struct MeshCacheHeader
+{
+    char m_magic[8];
+    uint32_t m_version;
+    uint32_t m_byteOrder;
+    uint32_t m_nodeSize;
+    uint32_t m_buildMode;
+    uint32_t m_maxLeafSize;
+    uint32_t m_leafBlockSize;
+    uint32_t m_numVertices;
+    uint32_t m_numNormals;
+    uint32_t m_numFaces;
+    uint32_t m_numVertexIndices;
+    uint32_t m_numNormalIndices;
+    uint32_t m_numNodes;
+    uint32_t m_numPrims;
+    uint32_t m_padding;
+    uint64_t m_sourceHash;
+    uint64_t m_payloadHash;
+};
+
+
+// Read-only view of a whole file, mapped into memory
+class MappedFile
+{
+public:
+    MappedFile(const char* filename) : m_data(NULL), m_size(0)
+    {
+#if defined(_WIN32)
+        m_file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+                             OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        m_mapping = NULL;
+        if (m_file == INVALID_HANDLE_VALUE)
+            return;
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0)
+            return;
+        m_mapping = CreateFileMappingA(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (m_mapping == NULL)
+            return;
+        void *data = MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+        if (data == NULL)
+            return;
+        m_data = static_cast<const unsigned char*>(data);
+        m_size = static_cast<size_t>(size.QuadPart);
+#else
+        int fd = open(filename, O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0)
+        {
+            void *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED)
+            {
+                m_data = static_cast<const unsigned char*>(data);
+                m_size = static_cast<size_t>(info.st_size);
+            }
+        }
+        // The mapping stays valid after the file is closed
+        close(fd);
+#endif
+    }
+    
+    ~MappedFile()
+    {
+#if defined(_WIN32)
+        if (m_data != NULL)
+            UnmapViewOfFile(m_data);
+        if (m_mapping != NULL)
+            CloseHandle(m_mapping);
+        if (m_file != INVALID_HANDLE_VALUE)
+            CloseHandle(m_file);
+#else
+        if (m_data != NULL)
+            munmap(const_cast<unsigned char*>(m_data), m_size);
+#endif
+    }
+    
+    bool valid() const { return m_data != NULL; }
+    const unsigned char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+    
+private:
+    const unsigned char *m_data;
+    size_t m_size;
+#if defined(_WIN32)
+    HANDLE m_file;
+    HANDLE m_mapping;
+#endif
+    
+    // No copying (it would unmap twice)
+    MappedFile(const MappedFile&);
+    MappedFile& operator =(const MappedFile&);
+};
+
+
+// Hands out arrays from the mapped file one after another, in place, keeping
+// track of whether we ran off the end.  The mapping starts on a page boundary
+// and every array in the layout is a multiple of 4 bytes long, so they all
+// come out aligned; if one somehow doesn't, that counts as a bad file.
+class CacheReader
+{
+public:
+    CacheReader(const unsigned char* data, size_t size) : m_data(data), m_size(size), m_offset(0), m_ok(true) { }
+    
+    template<typename T>
+    const T* view(size_t count)
+    {
+        size_t bytes = count * sizeof(T);
+        if (!m_ok || count > m_size / sizeof(T) || bytes > m_size - m_offset ||
+            reinterpret_cast<uintptr_t>(m_data + m_offset) % alignof(T) != 0)
+        {
+            m_ok = false;
+            return NULL;
+        }
+        const T *result = reinterpret_cast<const T*>(m_data + m_offset);
+        m_offset += bytes;
+        return result;
+    }
+    
+    // Did everything get read, with nothing left over?
+    bool finished() const { return m_ok && m_offset == m_size; }
+    
+private:
+    const unsigned char *m_data;
+    size_t m_size, m_offset;
+    bool m_ok;
+};
+
+
+// 64-bit FNV-1a; not cryptographic, but plenty to notice a changed file
+static uint64_t hashBytes(const unsigned char* data, size_t size)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= data[i];
+        hash *= 1099511628211ull;
+    }
+    // Mix in the size too, for good measure
+    return hash ^ (uint64_t)size;
+}
+
+
+// Tells concurrent writers' temp files apart
+static unsigned long processId()
+{
+#if defined(_WIN32)
+    return GetCurrentProcessId();
+#else
+    return (unsigned long)getpid();
+#endif
+}
+
+
+// Tacks arrays onto the end of a byte buffer
+template<typename T>
+static void appendBytes(std::vector<unsigned char>& buffer, const T* data, size_t count)
+{
+    const unsigned char *bytes = reinterpret_cast<const unsigned char*>(data);
+    buffer.insert(buffer.end(), bytes, bytes + count * sizeof(T));
+}
+
+
+bool hashFileContents(const char* filename, uint64_t& outHash)
+{
+    MappedFile file(filename);
+    if (!file.valid())
+        return false;
+    outHash = hashBytes(file.data(), file.size());
+    return true;
+}
+
+
+std::string meshCacheFilename(const char* filename, const std::string& cacheDirectory)
+{
+    // Hash where the OBJ lives (made absolute, so every way of getting to it
+    // gives the same name); fall back on the path as given if that fails
+    std::string path(filename);
+#if defined(_WIN32)
+    char fullPath[MAX_PATH];
+    DWORD length = GetFullPathNameA(filename, MAX_PATH, fullPath, NULL);
+    if (length > 0 && length < MAX_PATH)
+        path = fullPath;
+#else
+    char *fullPath = realpath(filename, NULL);
+    if (fullPath != NULL)
+    {
+        path = fullPath;
+        std::free(fullPath);
+    }
+#endif
+    uint64_t pathHash = hashBytes(reinterpret_cast<const unsigned char*>(path.data()), path.size());
+    
+    std::string objName(filename);
+    size_t slash = objName.find_last_of("/\\");
+    if (slash != std::string::npos)
+        objName = objName.substr(slash + 1);
+    char hashText[17];
+    std::snprintf(hashText, sizeof(hashText), "%016llx", (unsigned long long)pathHash);
+    return cacheDirectory + "/" + objName + "." + hashText + ".rbvh";
+}
+
+
+Mesh* readMeshCache(const char* cacheFilename, uint64_t sourceHash)
+{
+    MappedFile file(cacheFilename);
+    if (!file.valid() || file.size() < sizeof(MeshCacheHeader))
+        return NULL;
+    CacheReader reader(file.data(), file.size());
+    const MeshCacheHeader& header = *reader.view<MeshCacheHeader>(1);
+    if (std::memcmp(header.m_magic, kMeshCacheMagic, sizeof(kMeshCacheMagic)) != 0 ||
+        header.m_version != kMeshCacheVersion ||
+        header.m_byteOrder != kMeshCacheByteOrder ||
+        header.m_nodeSize != sizeof(BvhNode) ||
+        header.m_sourceHash != sourceHash)
+    {
+        return NULL;
+    }
+    
+    // Make sure the file is the size the header says before trusting the
+    // counts enough to allocate anything with them
+    uint64_t expectedSize = sizeof(MeshCacheHeader) +
+                            (uint64_t)header.m_numVertices * 3 * sizeof(float) +
+                            (uint64_t)header.m_numNormals * 3 * sizeof(float) +
+                            (uint64_t)header.m_numFaces * 2 * sizeof(uint32_t) +
+                            (uint64_t)header.m_numVertexIndices * sizeof(uint32_t) +
+                            (uint64_t)header.m_numNormalIndices * sizeof(uint32_t) +
+                            (uint64_t)header.m_numNodes * sizeof(BvhNode) +
+                            (uint64_t)header.m_numPrims * sizeof(uint32_t);
+    if (expectedSize != file.size() ||
+        hashBytes(file.data() + sizeof(MeshCacheHeader), file.size() - sizeof(MeshCacheHeader)) != header.m_payloadHash)
+        return NULL;
+    
+    // Find everything in the mapping; the index arrays, BVH nodes and prim
+    // list are used right where they sit in the file
+    const float *vertexData = reader.view<float>((size_t)header.m_numVertices * 3);
+    const float *normalData = reader.view<float>((size_t)header.m_numNormals * 3);
+    const uint32_t *vertexCounts = reader.view<uint32_t>(header.m_numFaces);
+    const uint32_t *normalCounts = reader.view<uint32_t>(header.m_numFaces);
+    const uint32_t *vertexIndices = reader.view<uint32_t>(header.m_numVertexIndices);
+    const uint32_t *normalIndices = reader.view<uint32_t>(header.m_numNormalIndices);
+    const BvhNode *nodes = reader.view<BvhNode>(header.m_numNodes);
+    const unsigned int *primIndices = reader.view<unsigned int>(header.m_numPrims);
+    if (!reader.finished() || header.m_numVertices == 0 || header.m_numFaces == 0)
+        return NULL;
+    
+    std::vector<Point> verts(header.m_numVertices);
+    for (size_t i = 0; i < verts.size(); ++i)
+    {
+        verts[i] = Point(vertexData[i * 3], vertexData[i * 3 + 1], vertexData[i * 3 + 2]);
+    }
+    std::vector<Vector> normals(header.m_numNormals);
+    for (size_t i = 0; i < normals.size(); ++i)
+    {
+        normals[i] = Vector(normalData[i * 3], normalData[i * 3 + 1], normalData[i * 3 + 2]);
+    }
+    
+    // Rebuild the faces, making sure they all make sense
+    std::vector<Face> faces(header.m_numFaces);
+    size_t vertexOffset = 0, normalOffset = 0;
+    for (size_t f = 0; f < faces.size(); ++f)
+    {
+        uint32_t numVerts = vertexCounts[f];
+        uint32_t numNormals = normalCounts[f];
+        if (numVerts < 3 || numVerts > header.m_numVertexIndices - vertexOffset ||
+            (numNormals != 0 && numNormals != numVerts) ||
+            numNormals > header.m_numNormalIndices - normalOffset)
+        {
+            return NULL;
+        }
+        for (uint32_t i = 0; i < numVerts; ++i)
+        {
+            if (vertexIndices[vertexOffset + i] >= verts.size())
+                return NULL;
+        }
+        for (uint32_t i = 0; i < numNormals; ++i)
+        {
+            if (normalIndices[normalOffset + i] >= normals.size())
+                return NULL;
+        }
+        faces[f].m_vertexIndices.assign(vertexIndices + vertexOffset,
+                                        vertexIndices + vertexOffset + numVerts);
+        faces[f].m_normalIndices.assign(normalIndices + normalOffset,
+                                        normalIndices + normalOffset + numNormals);
+        vertexOffset += numVerts;
+        normalOffset += numNormals;
+    }
+    if (vertexOffset != header.m_numVertexIndices || normalOffset != header.m_numNormalIndices)
+        return NULL;
+    
+    // The cached BVH is only good if it was built the way this mesh would
+    // build it, and it has to survive the BVH's own sanity checks too
+    Mesh *pMesh = new Mesh(verts, normals, faces, NULL);
+    if (header.m_numPrims != pMesh->numElements() ||
+        header.m_buildMode != (uint32_t)pMesh->bvh().buildMode() ||
+        header.m_maxLeafSize != pMesh->bvh().maxLeafSize() ||
+        header.m_leafBlockSize != pMesh->bvh().leafBlockSize() ||
+        !pMesh->bvh().setTree(nodes, header.m_numNodes, primIndices))
+    {
+        delete pMesh;
+        return NULL;
+    }
+    return pMesh;
+}
+
+
+bool writeMeshCache(const char* cacheFilename, Mesh& mesh, uint64_t sourceHash)
+{
+    const Bvh<Mesh>& bvh = mesh.bvh().binary();
+    if (bvh.numNodes() == 0)
+        mesh.prepare();
+    if (bvh.numNodes() == 0)
+        return false;
+    
+    const std::vector<Point>& verts = mesh.vertices();
+    const std::vector<Vector>& normals = mesh.normals();
+    const std::vector<Face>& faces = mesh.faces();
+    
+    MeshCacheHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.m_magic, kMeshCacheMagic, sizeof(kMeshCacheMagic));
+    header.m_version = kMeshCacheVersion;
+    header.m_byteOrder = kMeshCacheByteOrder;
+    header.m_nodeSize = sizeof(BvhNode);
+    header.m_buildMode = (uint32_t)mesh.bvh().buildMode();
+    header.m_maxLeafSize = mesh.bvh().maxLeafSize();
+    header.m_leafBlockSize = mesh.bvh().leafBlockSize();
+    header.m_numVertices = verts.size();
+    header.m_numNormals = normals.size();
+    header.m_numFaces = faces.size();
+    header.m_numNodes = bvh.numNodes();
+    header.m_numPrims = mesh.numElements();
+    header.m_sourceHash = sourceHash;
+    
+    // Flatten the faces
+    std::vector<uint32_t> vertexCounts, normalCounts, vertexIndices, normalIndices;
+    for (size_t f = 0; f < faces.size(); ++f)
+    {
+        vertexCounts.push_back(faces[f].m_vertexIndices.size());
+        normalCounts.push_back(faces[f].m_normalIndices.size());
+        vertexIndices.insert(vertexIndices.end(), faces[f].m_vertexIndices.begin(), faces[f].m_vertexIndices.end());
+        normalIndices.insert(normalIndices.end(), faces[f].m_normalIndices.begin(), faces[f].m_normalIndices.end());
+    }
+    header.m_numVertexIndices = vertexIndices.size();
+    header.m_numNormalIndices = normalIndices.size();
+    
+    // Lay out everything after the header, so we can hash it
+    std::vector<unsigned char> payload;
+    for (size_t i = 0; i < verts.size(); ++i)
+    {
+        float v[3] = { verts[i].m_x, verts[i].m_y, verts[i].m_z };
+        appendBytes(payload, v, 3);
+    }
+    for (size_t i = 0; i < normals.size(); ++i)
+    {
+        float n[3] = { normals[i].m_x, normals[i].m_y, normals[i].m_z };
+        appendBytes(payload, n, 3);
+    }
+    appendBytes(payload, vertexCounts.data(), vertexCounts.size());
+    appendBytes(payload, normalCounts.data(), normalCounts.size());
+    appendBytes(payload, vertexIndices.data(), vertexIndices.size());
+    appendBytes(payload, normalIndices.data(), normalIndices.size());
+    appendBytes(payload, bvh.nodes(), bvh.numNodes());
+    appendBytes(payload, bvh.primIndices(), mesh.numElements());
+    header.m_payloadHash = hashBytes(payload.data(), payload.size());
+    
+    // Write to a temp file and move it into place once it's complete, so
+    // nobody ever maps a half-written cache.  The temp file is named for this
+    // process, so renders sharing a cache directory don't write over each
+    // other's; whoever finishes last wins, and both wrote the same thing.
+    std::string tempFilename = std::string(cacheFilename) + "." + std::to_string(processId()) + ".tmp";
+    FILE *output = std::fopen(tempFilename.c_str(), "wb");
+    if (output == NULL)
+        return false;
+    bool ok = std::fwrite(&header, sizeof(header), 1, output) == 1 &&
+              std::fwrite(payload.data(), 1, payload.size(), output) == payload.size();
+    ok = (std::fclose(output) == 0) && ok;
+    if (ok)
+    {
+#if defined(_WIN32)
+        ok = MoveFileExA(tempFilename.c_str(), cacheFilename, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+        ok = std::rename(tempFilename.c_str(), cacheFilename) == 0;
+#endif
+    }
+    if (!ok)
+        std::remove(tempFilename.c_str());
+    return ok;
+}
+
+
+std::string defaultMeshCacheDirectory()
+{
+#if defined(_WIN32)
+    const char *base = std::getenv("LOCALAPPDATA");
+    if (base != NULL && base[0] != '\0')
+        return std::string(base) + "\\rayito";
+#else
+    const char *base = std::getenv("XDG_CACHE_HOME");
+    if (base != NULL && base[0] != '\0')
+        return std::string(base) + "/rayito";
+    base = std::getenv("HOME");
+    if (base != NULL && base[0] != '\0')
+        return std::string(base) + "/.cache/rayito";
+#endif
+    return std::string();
+}
+
+
+bool makeDirectories(const char* path)
+{
+    // Make each directory along the way, not minding the ones that are there
+    std::string dir(path);
+    for (size_t i = 1; i <= dir.size(); ++i)
+    {
+        if (i < dir.size() && dir[i] != '/' && dir[i] != '\\')
+            continue;
+        std::string parent = dir.substr(0, i);
+#if defined(_WIN32)
+        CreateDirectoryA(parent.c_str(), NULL);
+#else
+        mkdir(parent.c_str(), 0777);
+#endif
+    }
+    
+#if defined(_WIN32)
+    DWORD attributes = GetFileAttributesA(path);
+    return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+#else
+    struct stat info;
+    return stat(path, &info) == 0 && S_ISDIR(info.st_mode);
+#endif
+}
+
+} // namespace Rayito
@@ -0,0 +1,104 @@
+#include <cmath>
+#include <iostream>
+
+#include "rayito.h"
+#include "RMesh.h"
+
+
+using namespace Rayito;
+
+
+//
+// Checks that motion blurred shapes are found by the ShapeSet BVH at every
+// time in the shutter: rays fired at a rotating rod have to hit the set
+// wherever they hit the rod itself.  Run it with "make check".
+//
+
+
+namespace
+{
+
+
+// A box centered on the origin, with the given half-widths
+Mesh* makeBox(const Vector& halfSize)
+{
+    std::vector<Point> vertices;
+    for (unsigned int i = 0; i < 8; ++i)
+    {
+        vertices.push_back(Point(i & 1 ? halfSize.m_x : -halfSize.m_x,
+                                 i & 2 ? halfSize.m_y : -halfSize.m_y,
+                                 i & 4 ? halfSize.m_z : -halfSize.m_z));
+    }
+    const unsigned int quads[6][4] = { { 0, 2, 3, 1 }, { 4, 5, 7, 6 },
+                                       { 0, 1, 5, 4 }, { 2, 6, 7, 3 },
+                                       { 0, 4, 6, 2 }, { 1, 3, 7, 5 } };
+    std::vector<Face> faces(6);
+    for (unsigned int f = 0; f < 6; ++f)
+    {
+        faces[f].m_vertexIndices.assign(quads[f], quads[f] + 4);
+    }
+    return new Mesh(vertices, std::vector<Vector>(), faces, NULL);
+}
+
+
+} // namespace
+
+
+int main()
+{
+    // A long rod spinning a quarter turn over the shutter, next to a couple
+    // of spheres that sit still (enough shapes for the set to build a BVH)
+    Mesh *pRod = makeBox(Vector(2.0f, 0.1f, 0.1f));
+    pRod->transform().setRotation(0.0f, Quaternion(Vector(0.0f, 1.0f, 0.0f), 0.0f));
+    pRod->transform().setRotation(1.0f, Quaternion(Vector(0.0f, 1.0f, 0.0f), M_PI / 2.0f));
+    Sphere sphere1(Point(3.0f, 0.0f, 3.0f), 0.5f);
+    Sphere sphere2(Point(-3.0f, 0.0f, -3.0f), 0.5f);
+
+    ShapeSet masterSet;
+    masterSet.addShape(pRod);
+    masterSet.addShape(&sphere1);
+    masterSet.addShape(&sphere2);
+    masterSet.prepare();
+
+    // Fire a grid of rays straight down at the rod at a few times
+    const unsigned int kGridSize = 201;
+    const float times[] = { 0.25f, 0.5f, 0.75f };
+    unsigned int failures = 0;
+    for (unsigned int ti = 0; ti < sizeof(times) / sizeof(times[0]); ++ti)
+    {
+        unsigned int rodHits = 0;
+        unsigned int missed = 0;
+        for (unsigned int j = 0; j < kGridSize; ++j)
+        {
+            for (unsigned int i = 0; i < kGridSize; ++i)
+            {
+                Point origin(-2.5f + 5.0f * i / (kGridSize - 1), 5.0f, -2.5f + 5.0f * j / (kGridSize - 1));
+                Ray ray(origin, Vector(0.0f, -1.0f, 0.0f), kRayTMax, times[ti]);
+                Intersection rodIntersection(ray);
+                if (!pRod->intersect(rodIntersection))
+                    continue;
+                ++rodHits;
+                Intersection setIntersection(ray);
+                if (!masterSet.intersect(setIntersection) ||
+                    setIntersection.m_t > rodIntersection.m_t * 1.0001f ||
+                    !masterSet.doesIntersect(ray))
+                {
+                    ++missed;
+                }
+            }
+        }
+        std::cout << "Time " << times[ti] << ": " << missed << " of " << rodHits
+                  << " rod hits missed by the set" << std::endl;
+        if (missed > 0 || rodHits == 0)
+            ++failures;
+    }
+
+    delete pRod;
+    if (failures > 0)
+    {
+        std::cout << "FAILED" << std::endl;
+        return 1;
+    }
+    std::cout << "Passed" << std::endl;
+    return 0;
+}
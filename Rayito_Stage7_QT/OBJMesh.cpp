@@ -46,7 +46,7 @@ namespace Rayito
  * directive is also effectively ignored.  But the code is in there, so it
  * should be easy to enable it in the future.
  */
-Mesh* createFromOBJFile(const char* filename)
+static Mesh* parseOBJFile(const char* filename)
 {
     std::ifstream input(filename);
     
@@ -181,4 +181,36 @@ Mesh* createFromOBJFile(const char* filename)
 }
 
 
+Mesh* createFromOBJFile(const char* filename, const char* cacheDirectory)
+{
+    // Try the cache first, as long as we have somewhere to keep it and can
+    // tell what's in the OBJ
+    std::string directory = cacheDirectory != NULL ? cacheDirectory : "";
+    if (cacheDirectory != NULL && directory.empty())
+        directory = defaultMeshCacheDirectory();
+    uint64_t sourceHash = 0;
+    bool useCache = !directory.empty() && hashFileContents(filename, sourceHash);
+    std::string cacheFilename;
+    if (useCache)
+    {
+        cacheFilename = meshCacheFilename(filename, directory);
+        Mesh *pMesh = readMeshCache(cacheFilename.c_str(), sourceHash);
+        if (pMesh != NULL)
+            return pMesh;
+    }
+    
+    // No luck, do it the slow way (and save the results for next time; if the
+    // cache can't be written, oh well, we still have the mesh)
+    Mesh *pMesh = parseOBJFile(filename);
+    if (pMesh != NULL && useCache)
+    {
+        if (!makeDirectories(directory.c_str()) ||
+            !writeMeshCache(cacheFilename.c_str(), *pMesh, sourceHash))
+        {
+            std::cerr << "Could not write mesh cache: " << cacheFilename << std::endl;
+        }
+    }
+    return pMesh;
+}
+
 } // namespace Rayito
@@ -7,8 +7,24 @@
 #ifndef __RACCEL_H__
 #define __RACCEL_H__
 
+#include <cstddef>
+#include <cstdint>
+#include <new>
 #include <limits>
 #include <algorithm>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+// SSE is available on pretty much every x86 compiler we care about; the 4-wide
+// BVH falls back on plain floats everywhere else.
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+    #define RAYITO_USE_SSE 1
+    #include <xmmintrin.h>
+#else
+    #define RAYITO_USE_SSE 0
+#endif
 
 #include "RMath.h"
 #include "RRay.h"
@@ -90,7 +106,19 @@ struct BBox
         return BBox(max(m_min, bbox.m_min), min(m_max, bbox.m_max));
     }
     
-    BBox transformFromLocal(float time, const Transform& txform)
+    Point centroid() const { return (m_min + m_max) * 0.5f; }
+    
+    float surfaceArea() const
+    {
+        // Flat boxes (a triangle lying in an axis plane) still have area, so
+        // only a box that is inverted in some dimension counts as having none
+        Vector extents = m_max - m_min;
+        if (extents.m_x < 0.0f || extents.m_y < 0.0f || extents.m_z < 0.0f)
+            return 0.0f;
+        return 2.0f * (extents.m_x * extents.m_y + extents.m_y * extents.m_z + extents.m_z * extents.m_x);
+    }
+    
+    BBox transformFromLocal(float time, const Transform& txform) const
     {
         // Transform each corner of the local box, and then put a box around
         // those points.  This is the best we can do with an axis-aligned bbox.
@@ -115,6 +143,62 @@ struct BBox
 };
 
 
+// Blend between two bboxes; if the contents of each box move in straight lines
+// from one to the other, the blended box holds them at the in-between time
+inline BBox lerp(const BBox& b1, const BBox& b2, float t)
+{
+    return BBox(b1.m_min * (1.0f - t) + b2.m_min * t,
+                b1.m_max * (1.0f - t) + b2.m_max * t);
+}
+
+
+// Acceleration structure nodes get laid out to fit neatly in cache lines
+const size_t kCacheLineSize = 64;
+
+// Allocate memory aligned to the given (power of two) boundary.  Plain new
+// only promises alignment good enough for the basic types, so we grab a little
+// extra, round up, and stash the original pointer just before the block.
+inline void* alignedAlloc(size_t size, size_t alignment)
+{
+    char *raw = new char[size + alignment + sizeof(void*)];
+    uintptr_t start = reinterpret_cast<uintptr_t>(raw) + sizeof(void*);
+    uintptr_t aligned = (start + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    reinterpret_cast<void**>(aligned)[-1] = raw;
+    return reinterpret_cast<void*>(aligned);
+}
+
+inline void alignedFree(void* ptr)
+{
+    if (ptr != NULL)
+        delete[] reinterpret_cast<char*>(reinterpret_cast<void**>(ptr)[-1]);
+}
+
+// Allocator for standard containers that hands out aligned memory
+template<typename T, size_t Alignment = kCacheLineSize>
+class AlignedAllocator
+{
+public:
+    typedef T value_type;
+    
+    template<typename U> struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+    
+    AlignedAllocator() { }
+    template<typename U> AlignedAllocator(const AlignedAllocator<U, Alignment>&) { }
+    
+    T* allocate(size_t n)
+    {
+        if (n > std::numeric_limits<size_t>::max() / sizeof(T))
+            throw std::bad_alloc();
+        return static_cast<T*>(alignedAlloc(n * sizeof(T), Alignment));
+    }
+    
+    void deallocate(T* ptr, size_t) { alignedFree(ptr); }
+    
+    template<typename U> bool operator ==(const AlignedAllocator<U, Alignment>&) const { return true; }
+    template<typename U> bool operator !=(const AlignedAllocator<U, Alignment>&) const { return false; }
+};
+
+
 // BVH node flags: split axis takes up the first two bits, and the leaf vs interior takes the 3rd bit
 typedef unsigned int BvhNodeFlags;
 const BvhNodeFlags kSplitX = 0;
@@ -122,38 +206,88 @@ const BvhNodeFlags kSplitY = 1;
 const BvhNodeFlags kSplitZ = 2;
 const BvhNodeFlags kSplitFlags = 0x3;
 const BvhNodeFlags kLeafNode = 0x4;
-// 29 bits left over for # of prims if we ever get around to that
+// The 29 bits left over hold the # of prims in a leaf node
+const unsigned int kLeafPrimCountShift = 3;
+const unsigned int kMaxLeafPrims = (1u << 29) - 1;
+
+// Leaves hold up to this many prims unless the BVH is told otherwise
+const unsigned int kBvhDefaultMaxLeafSize = 4;
+
+// Grab the coordinate of a point/vector along a BVH split axis
+inline float splitAxisComponent(const Vector& v, BvhNodeFlags split)
+{
+    return split == kSplitX ? v.m_x : (split == kSplitY ? v.m_y : v.m_z);
+}
+
+
+// How the BVH decides where to split each node while building
+enum BvhBuildMode
+{
+    // Split the longest axis of the node at its spatial midpoint (fast to build)
+    kBvhBuildSpatialMedian,
+    // Binned surface-area heuristic (slower to build, faster to trace)
+    kBvhBuildBinnedSAH
+};
+
+// Number of buckets per axis the binned SAH build sorts primitive centroids into
+const unsigned int kBvhSahBins = 16;
+// Relative costs the SAH uses: stepping through an interior node vs. intersecting a primitive
+const float kBvhTraversalCost = 1.0f;
+const float kBvhIntersectionCost = 1.0f;
+
+// Parallel builds don't bother handing out subtrees smaller than this to threads
+const unsigned int kBvhParallelBuildMinPrims = 4096;
+
+// Most time keys the BVH will keep separate node bounds for (past this, the
+// bounds over the whole shutter get used for every ray)
+const unsigned int kBvhMaxTimeKeys = 16;
+
+// Once refitting has made the tree's SAH cost this many times worse than it
+// was right after the last full build, update() rebuilds it instead
+const float kBvhMaxRefitSahGrowth = 1.5f;
 
 
 // BVH node: it has a bounding box around the contents of the node, flags that
-// indicate if it's a leaf node (has no child nodes, holds a primitive) or is an
-// interior node (has two child nodes, and has a splitting axis).  Note that the
-// children nodes will always be stored consecutively, so we only have to store
-// the index to the first child node.  Also note that leaf nodes will store the
-// primitive index, but don't need the child node index (and vice-versa), so we
-// stick them in a union because the node uses either the child index or the
-// primitive index, but not both at the same time (ever).
+// indicate if it's a leaf node (has no child nodes, holds a run of primitives)
+// or is an interior node (has two child nodes, and has a splitting axis).  Note
+// that the children nodes will always be stored consecutively, so we only have
+// to store the index to the first child node.  Similarly, the primitives of a
+// leaf are stored consecutively in the BVH's primitive list, so a leaf stores
+// where its run starts, and the flags say how long the run is.  Leaf nodes
+// don't need the child node index (and vice-versa), so we stick them in a
+// union because the node uses either the child index or the primitive index,
+// but not both at the same time (ever).
+// 
+// That all packs into 32 bytes, so with the node array aligned to a cache line
+// and sibling pairs starting at even indices, both children of a node always
+// sit in the same cache line.
 struct BvhNode
 {
     BBox m_bbox;
     union
     {
         unsigned int m_firstChild;
-        unsigned int m_prim;
+        unsigned int m_firstPrim;
     };
     BvhNodeFlags m_flags;
     
     BvhNode() { }
-    BvhNode(const BvhNode& n) : m_bbox(n.m_bbox), m_prim(n.m_prim), m_flags(n.m_flags) { }
+    BvhNode(const BvhNode& n) : m_bbox(n.m_bbox), m_firstPrim(n.m_firstPrim), m_flags(n.m_flags) { }
     
     BvhNode& operator =(const BvhNode& n)
     {
         m_bbox = n.m_bbox;
-        m_prim = n.m_prim;
+        m_firstPrim = n.m_firstPrim;
         m_flags = n.m_flags;
         return *this;
     }
     
+    void makeLeaf(unsigned int firstPrim, unsigned int numPrims)
+    {
+        m_flags = kLeafNode | (numPrims << kLeafPrimCountShift);
+        m_firstPrim = firstPrim;
+    }
+    
     bool leafNode()     const { return (m_flags & kLeafNode) != 0; }
     bool interiorNode() const { return (m_flags & kLeafNode) == 0; }
     
@@ -164,51 +298,171 @@ struct BvhNode
     unsigned int leftChildIndex()  const { return m_firstChild; }
     unsigned int rightChildIndex() const { return m_firstChild + 1; }
     
-    unsigned int prim() const { return m_prim; }
+    // Run of primitives in a leaf (indices into the BVH's primitive list)
+    unsigned int firstPrim() const { return m_firstPrim; }
+    unsigned int numPrims()  const { return m_flags >> kLeafPrimCountShift; }
 };
 
+static_assert(sizeof(BvhNode) == 32, "BVH nodes should be 32 bytes, two to a cache line");
+
 
 /*
  * BVH (bounding volume hierarchy).  This is a binary tree data spatial data
  * structure used to find ray intersections much more quickly (algorithmically
  * it does so in O(log N) time, instead of O(N) time if we didn't have a BVH).
- * Each node in the tree either stores a primitive (a leaf node) or a pointer
- * to two child BVH nodes.  Each node has a bounding box, which *may* overlap
- * with its sibling node.
+ * Each node in the tree either stores a few primitives (a leaf node) or a
+ * pointer to two child BVH nodes.  Each node has a bounding box, which *may*
+ * overlap with its sibling node.  Letting leaves hold a handful of primitives
+ * instead of just one roughly halves the number of nodes, and makes the tree
+ * shallower to walk.
+ * 
+ * By default this BVH uses spatial splits, so the trees it generates are not
+ * amazingly efficient, but they're way, WAY better than nothing.  It can
+ * optionally use a binned SAH (surface-area hueristic) build to pick better
+ * splitting axis locations.  Those trees take longer to build, but the time to
+ * actually trace rays through them is faster.  The SAH estimates the cost of a
+ * split as the chance a ray passing through the node hits each child (the
+ * ratio of their surface areas) times the number of primitives in the child.
+ * Rather than trying every possible split, primitive centroids get dropped into
+ * a fixed number of bins along each axis, and only the bin boundaries are tried.
+ * 
+ * Large trees are built in parallel: the top few levels get split as usual,
+ * and the subtrees below them become independent tasks handed out to a pool of
+ * threads.  To keep the tree identical no matter which thread finishes first,
+ * each subtree of N prims builds into its own reserved block of node slots (it
+ * can never need more than 2N-1), and the unused slots get squeezed out after.
+ * 
+ * That squeezing is done by a final pass that copies the tree into its real
+ * (cache-line aligned) home in depth-first order: each sibling pair is followed
+ * by the subtree of the bigger sibling (the one rays are more likely to enter),
+ * then the smaller.  Rays mostly walk down the tree, so keeping each path close
+ * together in memory means fewer cache lines touched per ray, especially for
+ * shadow rays that bail out early.
  * 
- * This particular BVH uses spatial splits, so the trees it generates are not
- * amazingly efficient, but they're way, WAY better than nothing.  A more
- * advanced implementation would use SAH (surface-area hueristic) to pick better
- * splitting axis locations.  Those trees generally take longer to build, but
- * the time to actually trace rays through them is faster.
+ * For motion blur, the object can hand out the bboxes of its elements at a
+ * few key times.  The BVH then keeps bounds for each node at each of those
+ * times (besides the bbox over the whole shutter), and traversal blends
+ * between the keys around the ray's time.  A ray only has to deal with where
+ * things are when it's fired, so fast-moving objects don't make every ray pay
+ * for the whole streak they sweep out.  Blending is only right for things
+ * moving in straight lines between keys (translating and scaling); anything
+ * rotating can swing out of the blended box, so nodes holding something that
+ * rotates over a segment use their shutter bbox for that segment instead.
  * 
  * The template param type for the BVH must have the following methods:
  *     unsigned int numElements() const;
  *     BBox elementBBox(unsigned int index) const;
  *     float elementArea(unsigned int index) const;
+ *     unsigned int numTimeKeys() const;
+ *     float timeKey(unsigned int key) const;
+ *     BBox elementBBox(unsigned int index, unsigned int key) const;
+ *     bool elementMovesLinearly(unsigned int index, unsigned int key) const;
  *     bool intersect(Intersection& intersection, unsigned int elementIndex);
  *     bool doesIntersect(const Ray& ray, unsigned int elementIndex);
- * The first two methods are used during building, the second two during tracing.
+ * The first seven methods are used during building (the time key methods only
+ * matter if there is more than one key, and key times must increase), the
+ * last two during tracing.
  */
 template<typename T>
 class Bvh
 {
 public:
-    Bvh(T& object);
+    Bvh(T& object,
+        BvhBuildMode buildMode = kBvhBuildSpatialMedian,
+        unsigned int maxLeafSize = kBvhDefaultMaxLeafSize);
     
     ~Bvh();
     
+    BvhBuildMode buildMode() const               { return m_buildMode; }
+    void         setBuildMode(BvhBuildMode mode) { m_buildMode = mode; m_settingsChanged = true; }
+    
+    // Max # of prims per leaf (takes effect at the next build)
+    unsigned int maxLeafSize() const { return m_maxLeafSize; }
+    void setMaxLeafSize(unsigned int maxLeafSize)
+    {
+        m_maxLeafSize = std::max(1u, std::min(maxLeafSize, kMaxLeafPrims));
+        m_settingsChanged = true;
+    }
+    
+    // How many of a leaf's prims the object tests at once (say, 4 for SSE).
+    // The SAH then charges leaves by the block rather than by the prim, so it
+    // fills the blocks up instead of splitting them (takes effect at the next
+    // build).
+    unsigned int leafBlockSize() const { return m_leafBlockSize; }
+    void setLeafBlockSize(unsigned int leafBlockSize)
+    {
+        m_leafBlockSize = std::max(1u, leafBlockSize);
+        m_settingsChanged = true;
+    }
+    
+    unsigned int numNodes() const { return m_numNodes; }
+    
+    // Number of threads to build with (0 means one per hardware thread)
+    unsigned int buildThreads() const               { return m_buildThreads; }
+    void         setBuildThreads(unsigned int num)  { m_buildThreads = num; }
+    
     // Call this before tracing any rays through the BVH!
     bool build();
     
+    // For when the elements have moved or changed shape, but there are still
+    // the same number of them: recompute the node bboxes from the bottom up,
+    // keeping the tree as-is.  Much faster than a build, but the tree gets
+    // worse the further things move.  Returns false (and does nothing) if
+    // there is no tree that matches the object to refit.
+    bool refit();
+    
+    // Refit if we can, and do a full build instead if we can't or if the tree
+    // has gotten too much worse than it was when last built.  Use this rather
+    // than build() when preparing the same object over and over (animation).
+    bool update();
+    
+    // Take a tree built earlier (say, loaded from a cache file) instead of
+    // building one.  The nodes and primitive list are copied, and must be laid
+    // out like build() lays them out, for the object as it is now with the
+    // current build settings.  Returns false (leaving no tree) if they don't
+    // make a sensible tree for the object.
+    bool setTree(const BvhNode *nodes, unsigned int numNodes, const unsigned int *primIndices);
+    
+    // Has refitting made the tree enough worse that it should be rebuilt?
+    bool refitDegraded() const { return m_sahCost > m_builtSahCost * kBvhMaxRefitSahGrowth; }
+    
+    // Wall-clock time the last build() or refit() took, in seconds
+    float buildTime() const { return m_buildTime; }
+    
+    // Expected cost of tracing a ray through the finished tree, according to
+    // the SAH (lower is better; valid after build(), regardless of build mode)
+    float sahCost() const { return m_sahCost; }
+    
     // Trace rays, forwarding final ray intersection logic to the object
     bool intersect(Intersection& intersection);
     bool doesIntersect(const Ray& ray);
     
+    // Raw access to the finished tree (for building other layouts from it)
+    const BvhNode*      nodes()       const { return m_nodes; }
+    const unsigned int* primIndices() const { return m_primIndices; }
+    
 private:
     T& m_object;
     BvhNode *m_nodes;
     unsigned int m_numNodes;
+    // Object element indices, ordered so that each leaf's prims are consecutive
+    unsigned int *m_primIndices;
+    // Node bounds at each time key (all keys for node 0, then node 1, etc.),
+    // empty if the object doesn't move
+    std::vector<float> m_timeKeys;
+    std::vector<BBox> m_timeBounds;
+    // Whether each node's bounds can be blended over each segment between
+    // keys (all segments for node 0, then node 1, etc.)
+    std::vector<unsigned char> m_timeBlendable;
+    BvhBuildMode m_buildMode;
+    unsigned int m_maxLeafSize;
+    unsigned int m_leafBlockSize;
+    unsigned int m_buildThreads;
+    // What the tree was built for, so we know when it can't be refit
+    unsigned int m_builtNumElements;
+    bool m_settingsChanged;
+    float m_sahCost, m_builtSahCost;
+    float m_buildTime;
     
     // A couple of helper structs for building the BVH
     
@@ -239,35 +493,148 @@ private:
         }
     };
     
-    // At each step of the build, this is called recursively to fill out a BVH node
+    // The SAH build partitions primitives by which bin their centroid lands in
+    struct SahBinPredicate
+    {
+        float m_axisMin, m_binScale;
+        BvhNodeFlags m_split;
+        unsigned int m_splitBin;
+        
+        SahBinPredicate(float axisMin, float binScale, BvhNodeFlags split, unsigned int splitBin)
+            : m_axisMin(axisMin), m_binScale(binScale), m_split(split), m_splitBin(splitBin) { }
+        
+        unsigned int bin(const BuildElement& elem) const
+        {
+            float centroid = splitAxisComponent(elem.m_bbox.centroid(), m_split);
+            unsigned int b = (unsigned int)((centroid - m_axisMin) * m_binScale);
+            return b < kBvhSahBins ? b : kBvhSahBins - 1;
+        }
+        
+        // Like the spatial split, the upper side of the split goes first in
+        // the list (the left child), which traversal relies on for ordering
+        bool operator ()(const BuildElement& elem) const
+        {
+            return bin(elem) >= m_splitBin;
+        }
+    };
+    
+    // A subtree to be built on its own by one of the build threads
+    struct BuildTask
+    {
+        unsigned int m_begin, m_end;
+        unsigned int m_nodeIndex, m_descendantsIndex;
+        BBox m_bbox;
+    };
+    
+    // At each step of the build, this is called recursively to fill out a BVH
+    // node.  The node's descendants go in the block of slots starting at
+    // descendantsIndex.  If a task list is passed in, subtrees at or below
+    // the task depth are put on the list instead of being built.
     bool buildRange(BuildElement *permutedElements,
+                    BvhNode *buildSlots,
                     unsigned int begin, unsigned int end,
-                    unsigned int nodeIndex, const BBox& nodeBBox);
+                    unsigned int nodeIndex, unsigned int descendantsIndex,
+                    const BBox& nodeBBox,
+                    std::vector<BuildTask> *pTasks, unsigned int taskDepth);
+    
+    // Build threads pull tasks off the list until there are none left
+    void runBuildTasks(BuildElement *permutedElements,
+                       BvhNode *buildSlots,
+                       const std::vector<BuildTask> *pTasks,
+                       std::atomic<unsigned int> *pNextTask,
+                       std::atomic<bool> *pFailed);
+    
+    // Copy the tree from the build slots into the final node array in
+    // depth-first order, leaving out the unused slots
+    void reorderNodes(const BvhNode *buildSlots);
+    
+    // Split selection for each build mode; each one partitions the elements and
+    // outputs the split axis and the index of the first element on the right.
+    void partitionSpatialMedian(BuildElement *permutedElements,
+                                unsigned int begin, unsigned int end,
+                                const BBox& nodeBBox,
+                                BvhNodeFlags& outSplit, unsigned int& outSplitIndex);
+    bool partitionBinnedSAH(BuildElement *permutedElements,
+                            unsigned int begin, unsigned int end,
+                            const BBox& nodeBBox,
+                            BvhNodeFlags& outSplit, unsigned int& outSplitIndex,
+                            float& outSplitCost);
+    
+    // Walk the finished tree and total up its SAH cost
+    float computeSahCost() const;
+    
+    // SAH cost of testing this many prims in a leaf
+    float leafCost(unsigned int numPrims) const
+    {
+        return kBvhIntersectionCost * ((numPrims + m_leafBlockSize - 1) / m_leafBlockSize);
+    }
+    
+    // Fill out the per-time-key node bounds (if the object moves)
+    void computeTimeBounds();
+    
+    // Find the time key at or just before the given time, and how far along
+    // it is to the next key
+    unsigned int findTimeKey(float time, float& outT) const;
+    
+    // Node bbox at the time found by findTimeKey()
+    BBox timeBBox(unsigned int nodeIndex, unsigned int key, float t) const
+    {
+        const BBox *keyBounds = &m_timeBounds[nodeIndex * m_timeKeys.size() + key];
+        if (t <= 0.0f)
+            return keyBounds[0];
+        if (!m_timeBlendable[nodeIndex * (m_timeKeys.size() - 1) + key])
+            return m_nodes[nodeIndex].m_bbox;
+        return lerp(keyBounds[0], keyBounds[1], t);
+    }
 };
 
 
 template<typename T>
-Bvh<T>::Bvh(T& object)
-    : m_object(object), m_nodes(NULL), m_numNodes(0)
+Bvh<T>::Bvh(T& object, BvhBuildMode buildMode, unsigned int maxLeafSize)
+    : m_object(object), m_nodes(NULL), m_numNodes(0), m_primIndices(NULL),
+      m_timeKeys(), m_timeBounds(), m_timeBlendable(), m_buildMode(buildMode), m_maxLeafSize(1), m_leafBlockSize(1), m_buildThreads(0),
+      m_builtNumElements(0), m_settingsChanged(true),
+      m_sahCost(0.0f), m_builtSahCost(0.0f), m_buildTime(0.0f)
 {
-    
+    setMaxLeafSize(maxLeafSize);
 }
 
 template<typename T>
 Bvh<T>::~Bvh()
 {
-    if (m_nodes != NULL) delete[] m_nodes;
+    alignedFree(m_nodes);
+    if (m_primIndices != NULL) delete[] m_primIndices;
 }
 
 template<typename T>
 bool Bvh<T>::build()
 {
-    // Prep for the build: get primitive bboxes, indices, and set up the actual
-    // BVH node storage so we can start filling it out.
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+    
+    // Toss out any tree from a previous build
+    alignedFree(m_nodes);
+    if (m_primIndices != NULL)
+        delete[] m_primIndices;
+    m_nodes = NULL;
+    m_primIndices = NULL;
+    m_numNodes = 0;
+    m_timeKeys.clear();
+    m_timeBounds.clear();
+    m_timeBlendable.clear();
+    m_sahCost = 0.0f;
+    m_builtSahCost = 0.0f;
+    
     unsigned int numElems = m_object.numElements();
+    m_builtNumElements = numElems;
+    m_settingsChanged = false;
     if (numElems == 0)
+    {
+        m_buildTime = 0.0f;
         return true;
+    }
     
+    // Prep for the build: get primitive bboxes, indices, and set up the actual
+    // BVH node storage so we can start filling it out.
     BuildElement *elems = new BuildElement[numElems];
     BBox totalBBox;
     for (unsigned int i = 0; i < numElems; ++i)
@@ -276,67 +643,411 @@ bool Bvh<T>::build()
         elems[i].m_bbox = m_object.elementBBox(i);
         totalBBox = totalBBox.combined(elems[i].m_bbox);
     }
-    // There can be exactly this many BVH nodes total.  It just works.
-    m_nodes = new BvhNode[numElems * 2 - 1];
-    // We start with one node already set aside (the root node)
-    m_numNodes = 1;
-    // Start building (with the root node)
-    bool built = buildRange(elems, 0, numElems, 0, totalBBox);
+    // There can be at most this many BVH nodes total (exactly this many if
+    // every leaf holds one prim).  It just works.
+    unsigned int numSlots = numElems * 2 - 1;
+    BvhNode *buildSlots = new BvhNode[numSlots];
+    
+    // Figure out how many threads to build with, and how deep to go before
+    // handing subtrees off to them (aiming for a few tasks per thread, so
+    // lopsided subtrees even out).
+    unsigned int numThreads = m_buildThreads;
+    if (numThreads == 0)
+        numThreads = std::max(1u, std::thread::hardware_concurrency());
+    if (numElems < kBvhParallelBuildMinPrims * 2)
+        numThreads = 1;
+    unsigned int taskDepth = 2;
+    while ((1u << taskDepth) < numThreads * 4 && taskDepth < 16)
+        taskDepth++;
+    
+    // Start building (with the root node, and its descendants right after it)
+    std::vector<BuildTask> tasks;
+    bool built = buildRange(elems, buildSlots, 0, numElems, 0, 1, totalBBox,
+                            numThreads > 1 ? &tasks : NULL, taskDepth);
+    
+    // Build the subtrees in parallel
+    if (built && !tasks.empty())
+    {
+        std::atomic<unsigned int> nextTask(0);
+        std::atomic<bool> failed(false);
+        std::vector<std::thread> threads;
+        for (unsigned int i = 1; i < numThreads; ++i)
+        {
+            threads.push_back(std::thread(&Bvh<T>::runBuildTasks, this,
+                                          elems, buildSlots, &tasks, &nextTask, &failed));
+        }
+        // This thread pitches in too
+        runBuildTasks(elems, buildSlots, &tasks, &nextTask, &failed);
+        for (size_t i = 0; i < threads.size(); ++i)
+        {
+            threads[i].join();
+        }
+        built = !failed;
+    }
+    
+    // Lay the tree out for tracing, closing up the gaps left by subtrees
+    // using fewer slots than they had reserved
+    if (built)
+        reorderNodes(buildSlots);
+    delete[] buildSlots;
+    
+    // The build leaves the elements ordered so each leaf's prims are in a
+    // consecutive run, so that order is our primitive list.
+    m_primIndices = new unsigned int[numElems];
+    for (unsigned int i = 0; i < numElems; ++i)
+    {
+        m_primIndices[i] = elems[i].m_prim;
+    }
     // Clean up temp help for building and get outta here
     delete[] elems;
+    m_sahCost = built ? computeSahCost() : 0.0f;
+    m_builtSahCost = m_sahCost;
+    computeTimeBounds();
+    if (!built)
+        m_settingsChanged = true; // Make sure nobody refits a half-built tree
+    m_buildTime = std::chrono::duration<float>(std::chrono::steady_clock::now() - startTime).count();
     return built;
 }
 
+template<typename T>
+bool Bvh<T>::refit()
+{
+    if (m_settingsChanged || m_builtNumElements != m_object.numElements())
+        return false;
+    
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+    
+    // Children always come after their parents in the node array, so walking
+    // it backwards updates every child before its parent needs it.  (The
+    // padding node is a leaf without prims, so it stays inside-out.)
+    for (unsigned int i = m_numNodes; i-- > 0; )
+    {
+        BvhNode& node = m_nodes[i];
+        BBox bbox;
+        if (node.leafNode())
+        {
+            unsigned int primEnd = node.firstPrim() + node.numPrims();
+            for (unsigned int p = node.firstPrim(); p < primEnd; ++p)
+            {
+                bbox = bbox.combined(m_object.elementBBox(m_primIndices[p]));
+            }
+        }
+        else
+        {
+            bbox = m_nodes[node.leftChildIndex()].m_bbox.combined(m_nodes[node.rightChildIndex()].m_bbox);
+        }
+        node.m_bbox = bbox;
+    }
+    
+    m_sahCost = computeSahCost();
+    computeTimeBounds();
+    m_buildTime = std::chrono::duration<float>(std::chrono::steady_clock::now() - startTime).count();
+    return true;
+}
+
+template<typename T>
+void Bvh<T>::computeTimeBounds()
+{
+    m_timeKeys.clear();
+    m_timeBounds.clear();
+    m_timeBlendable.clear();
+    unsigned int numKeys = m_object.numTimeKeys();
+    if (m_nodes == NULL || numKeys < 2 || numKeys > kBvhMaxTimeKeys)
+        return;
+    for (unsigned int k = 0; k < numKeys; ++k)
+    {
+        m_timeKeys.push_back(m_object.timeKey(k));
+    }
+    
+    // Same bottom-up walk as refitting, one box per key for each node
+    // (and whether everything under the node moves in straight lines over
+    // each segment, so its bounds there can be blended)
+    unsigned int numSegments = numKeys - 1;
+    m_timeBounds.resize(m_numNodes * numKeys);
+    m_timeBlendable.assign(m_numNodes * numSegments, 1);
+    for (unsigned int i = m_numNodes; i-- > 0; )
+    {
+        const BvhNode& node = m_nodes[i];
+        BBox *keyBounds = &m_timeBounds[i * numKeys];
+        unsigned char *blendable = &m_timeBlendable[i * numSegments];
+        for (unsigned int k = 0; k < numKeys; ++k)
+        {
+            if (node.leafNode())
+            {
+                unsigned int primEnd = node.firstPrim() + node.numPrims();
+                for (unsigned int p = node.firstPrim(); p < primEnd; ++p)
+                {
+                    keyBounds[k] = keyBounds[k].combined(m_object.elementBBox(m_primIndices[p], k));
+                    if (k < numSegments && !m_object.elementMovesLinearly(m_primIndices[p], k))
+                        blendable[k] = 0;
+                }
+            }
+            else
+            {
+                keyBounds[k] = m_timeBounds[node.leftChildIndex() * numKeys + k].combined(
+                               m_timeBounds[node.rightChildIndex() * numKeys + k]);
+                if (k < numSegments)
+                {
+                    blendable[k] = m_timeBlendable[node.leftChildIndex() * numSegments + k] &
+                                   m_timeBlendable[node.rightChildIndex() * numSegments + k];
+                }
+            }
+        }
+    }
+    
+    // Keys where nothing actually moved aren't worth blending bounds for
+    bool moved = false;
+    for (unsigned int i = 0; i < m_numNodes * numKeys && !moved; ++i)
+    {
+        const BBox& nodeBBox = m_nodes[i / numKeys].m_bbox;
+        const BBox& keyBBox = m_timeBounds[i];
+        moved = keyBBox.m_min.m_x != nodeBBox.m_min.m_x || keyBBox.m_max.m_x != nodeBBox.m_max.m_x ||
+                keyBBox.m_min.m_y != nodeBBox.m_min.m_y || keyBBox.m_max.m_y != nodeBBox.m_max.m_y ||
+                keyBBox.m_min.m_z != nodeBBox.m_min.m_z || keyBBox.m_max.m_z != nodeBBox.m_max.m_z;
+    }
+    if (!moved)
+    {
+        m_timeKeys.clear();
+        m_timeBounds.clear();
+        m_timeBlendable.clear();
+    }
+}
+
+template<typename T>
+unsigned int Bvh<T>::findTimeKey(float time, float& outT) const
+{
+    // Only a handful of keys, so just walk them; outside the keys the bounds
+    // stay put at the first/last key, just like transforms do
+    outT = 0.0f;
+    unsigned int lastKey = (unsigned int)m_timeKeys.size() - 1;
+    if (time <= m_timeKeys[0])
+        return 0;
+    if (time >= m_timeKeys[lastKey])
+        return lastKey;
+    unsigned int key = 0;
+    while (time >= m_timeKeys[key + 1])
+        key++;
+    outT = (time - m_timeKeys[key]) / (m_timeKeys[key + 1] - m_timeKeys[key]);
+    return key;
+}
+
+template<typename T>
+bool Bvh<T>::update()
+{
+    if (!refit() || refitDegraded())
+        return build();
+    return true;
+}
+
+template<typename T>
+bool Bvh<T>::setTree(const BvhNode *nodes, unsigned int numNodes, const unsigned int *primIndices)
+{
+    alignedFree(m_nodes);
+    if (m_primIndices != NULL)
+        delete[] m_primIndices;
+    m_nodes = NULL;
+    m_primIndices = NULL;
+    m_numNodes = 0;
+    m_timeKeys.clear();
+    m_timeBounds.clear();
+    m_timeBlendable.clear();
+    m_sahCost = 0.0f;
+    m_builtSahCost = 0.0f;
+    m_buildTime = 0.0f;
+    // Until the tree checks out, nobody should try to refit it
+    m_settingsChanged = true;
+    
+    // Don't trust the tree: children must come after their parents (so the
+    // traversal and refits can't go in circles), leaves must stay inside the
+    // primitive list, and every element must be in the list once.
+    unsigned int numElems = m_object.numElements();
+    if (numElems == 0 || numNodes == 0 || numNodes > numElems * 2)
+        return numElems == 0 && numNodes == 0;
+    for (unsigned int i = 0; i < numNodes; ++i)
+    {
+        if (nodes[i].leafNode())
+        {
+            if (nodes[i].firstPrim() > numElems || nodes[i].numPrims() > numElems - nodes[i].firstPrim())
+                return false;
+        }
+        else if (nodes[i].leftChildIndex() <= i || nodes[i].rightChildIndex() >= numNodes)
+        {
+            return false;
+        }
+    }
+    std::vector<unsigned char> seen(numElems, 0);
+    for (unsigned int i = 0; i < numElems; ++i)
+    {
+        if (primIndices[i] >= numElems || seen[primIndices[i]])
+            return false;
+        seen[primIndices[i]] = 1;
+    }
+    
+    m_numNodes = numNodes;
+    m_nodes = static_cast<BvhNode*>(alignedAlloc(numNodes * sizeof(BvhNode), kCacheLineSize));
+    for (unsigned int i = 0; i < numNodes; ++i)
+    {
+        new (&m_nodes[i]) BvhNode(nodes[i]);
+    }
+    m_primIndices = new unsigned int[numElems];
+    std::copy(primIndices, primIndices + numElems, m_primIndices);
+    
+    m_builtNumElements = numElems;
+    m_settingsChanged = false;
+    m_sahCost = computeSahCost();
+    m_builtSahCost = m_sahCost;
+    computeTimeBounds();
+    return true;
+}
+
+template<typename T>
+void Bvh<T>::runBuildTasks(BuildElement *permutedElements,
+                           BvhNode *buildSlots,
+                           const std::vector<BuildTask> *pTasks,
+                           std::atomic<unsigned int> *pNextTask,
+                           std::atomic<bool> *pFailed)
+{
+    for (unsigned int i = (*pNextTask)++; i < pTasks->size(); i = (*pNextTask)++)
+    {
+        const BuildTask& task = (*pTasks)[i];
+        if (!buildRange(permutedElements, buildSlots, task.m_begin, task.m_end,
+                        task.m_nodeIndex, task.m_descendantsIndex, task.m_bbox,
+                        NULL, 0))
+        {
+            *pFailed = true;
+        }
+    }
+}
+
+template<typename T>
+void Bvh<T>::reorderNodes(const BvhNode *buildSlots)
+{
+    // Count the nodes actually in the tree, so we know how much to allocate
+    std::vector<unsigned int> pending(1, 0);
+    unsigned int numNodes = 0;
+    while (!pending.empty())
+    {
+        const BvhNode& node = buildSlots[pending.back()];
+        pending.pop_back();
+        numNodes++;
+        if (node.interiorNode())
+        {
+            pending.push_back(node.leftChildIndex());
+            pending.push_back(node.rightChildIndex());
+        }
+    }
+    
+    // The root sits alone in slot 0, so slot 1 is padding (a leaf with no
+    // prims and an inside-out bbox) to make every sibling pair start at an
+    // even index, and thus on a cache line boundary.
+    m_numNodes = buildSlots[0].interiorNode() ? numNodes + 1 : 1;
+    m_nodes = static_cast<BvhNode*>(alignedAlloc(m_numNodes * sizeof(BvhNode), kCacheLineSize));
+    new (&m_nodes[0]) BvhNode(buildSlots[0]);
+    if (m_numNodes > 1)
+    {
+        new (&m_nodes[1]) BvhNode();
+        m_nodes[1].m_bbox = BBox();
+        m_nodes[1].makeLeaf(0, 0);
+    }
+    
+    // Walk the tree depth-first, copying in each node's children as a pair
+    // (pending holds slot index / new index pairs of nodes waiting for theirs)
+    unsigned int nextIndex = 2;
+    if (buildSlots[0].interiorNode())
+    {
+        pending.push_back(0);
+        pending.push_back(0);
+    }
+    while (!pending.empty())
+    {
+        unsigned int newIndex = pending.back();
+        pending.pop_back();
+        const BvhNode& node = buildSlots[pending.back()];
+        pending.pop_back();
+        
+        unsigned int left = node.leftChildIndex();
+        unsigned int right = node.rightChildIndex();
+        new (&m_nodes[nextIndex]) BvhNode(buildSlots[left]);
+        new (&m_nodes[nextIndex + 1]) BvhNode(buildSlots[right]);
+        m_nodes[newIndex].m_firstChild = nextIndex;
+        
+        // Visit the bigger child's subtree first (it's pushed last), so it
+        // ends up right after this pair
+        unsigned int bigger = buildSlots[left].m_bbox.surfaceArea() >= buildSlots[right].m_bbox.surfaceArea() ? 0 : 1;
+        unsigned int order[2] = { 1 - bigger, bigger };
+        for (unsigned int c = 0; c < 2; ++c)
+        {
+            if (buildSlots[left + order[c]].interiorNode())
+            {
+                pending.push_back(left + order[c]);
+                pending.push_back(nextIndex + order[c]);
+            }
+        }
+        nextIndex += 2;
+    }
+}
+
 template<typename T>
 bool Bvh<T>::buildRange(BuildElement *permutedElements,
+                        BvhNode *buildSlots,
                         unsigned int begin, unsigned int end,
-                        unsigned int nodeIndex, const BBox& nodeBBox)
+                        unsigned int nodeIndex, unsigned int descendantsIndex,
+                        const BBox& nodeBBox,
+                        std::vector<BuildTask> *pTasks, unsigned int taskDepth)
 {
-    // Is there only one primitive?  If so, make this a leaf node.
-    if (end - begin <= 1)
+    unsigned int numPrims = end - begin;
+    
+    // Deep enough (or small enough) to hand the rest of this subtree off?
+    if (pTasks != NULL && (taskDepth == 0 || numPrims < kBvhParallelBuildMinPrims))
     {
-        m_nodes[nodeIndex].m_flags = kLeafNode;
-        m_nodes[nodeIndex].m_bbox = nodeBBox;
-        m_nodes[nodeIndex].m_prim = permutedElements[begin].m_prim;
+        BuildTask task;
+        task.m_begin = begin;
+        task.m_end = end;
+        task.m_nodeIndex = nodeIndex;
+        task.m_descendantsIndex = descendantsIndex;
+        task.m_bbox = nodeBBox;
+        pTasks->push_back(task);
         return true;
     }
     
-    // Interior node...
+    buildSlots[nodeIndex].m_bbox = nodeBBox;
     
-    // Pick split axis
-    Vector extents = nodeBBox.m_max - nodeBBox.m_min;
-    BvhNodeFlags split;
-    if (extents.m_x > extents.m_y)
+    // Is there only one primitive?  If so, make this a leaf node.
+    if (numPrims <= 1)
     {
-        if (extents.m_x > extents.m_z)
-            split = kSplitX;
-        else
-            split = kSplitZ;
+        buildSlots[nodeIndex].makeLeaf(begin, numPrims);
+        return true;
     }
-    else if (extents.m_y > extents.m_z)
-        split = kSplitY;
-    else
-        split = kSplitZ;
     
-    // Pick split axis location (this is a vanilla spatial split, a SAH tree
-    // build would do something more sophisticated here).
-    float splitAxis;
-    if (split == kSplitX)
-        splitAxis = (nodeBBox.m_max.m_x + nodeBBox.m_min.m_x) * 0.5f;
-    else if (split == kSplitY)
-        splitAxis = (nodeBBox.m_max.m_y + nodeBBox.m_min.m_y) * 0.5f;
+    // Pick split axis and location, and partition the primitives accordingly.
+    // If there are few enough primitives to fit in a leaf, the SAH build only
+    // splits when it thinks that will be cheaper than testing them all; the
+    // spatial build always makes the leaf.
+    BvhNodeFlags split;
+    unsigned int splitIndex;
+    float splitCost;
+    if (m_buildMode == kBvhBuildBinnedSAH &&
+        partitionBinnedSAH(permutedElements, begin, end, nodeBBox, split, splitIndex, splitCost))
+    {
+        if (numPrims <= m_maxLeafSize && splitCost >= leafCost(numPrims))
+        {
+            buildSlots[nodeIndex].makeLeaf(begin, numPrims);
+            return true;
+        }
+    }
     else
-        splitAxis = (nodeBBox.m_max.m_z + nodeBBox.m_min.m_z) * 0.5f;
+    {
+        if (numPrims <= m_maxLeafSize)
+        {
+            buildSlots[nodeIndex].makeLeaf(begin, numPrims);
+            return true;
+        }
+        partitionSpatialMedian(permutedElements, begin, end, nodeBBox, split, splitIndex);
+    }
     
-    m_nodes[nodeIndex].m_bbox = nodeBBox;
-    m_nodes[nodeIndex].m_flags = split;
+    // Interior node...
     
-    // Separate primitives such that those on the left of the split are in the
-    // earlier part of the list (for the range we're dealing with) and those on
-    // the right part of the split are later part of the list.
-    BuildElementPredicate pred(splitAxis, split);
-    BuildElement* partitionIter = std::partition(&permutedElements[begin], (&permutedElements[0]) + end, pred);
-    unsigned int splitIndex = (unsigned int)(partitionIter - (&permutedElements[0]));
+    buildSlots[nodeIndex].m_flags = split;
     
     // Peel off half of the elements if one side of the partition was empty
     // Note: doing this makes *crappy* BVH nodes at this part of the tree, but
@@ -362,23 +1073,182 @@ bool Bvh<T>::buildRange(BuildElement *permutedElements,
         rightBBox = rightBBox.combined(permutedElements[i].m_bbox);
     }
     
-    // Create children nodes, recurse to keep building
-    m_nodes[nodeIndex].m_firstChild = m_numNodes;
-    m_numNodes += 2;
-    if (!buildRange(permutedElements, begin, splitIndex, m_nodes[nodeIndex].m_firstChild, leftBBox))
+    // Create children nodes, recurse to keep building.  The children take
+    // the first two slots of our block, the left child's descendants get the
+    // slots after that, and the right child's descendants get the rest.
+    unsigned int leftDescendants = descendantsIndex + 2;
+    unsigned int rightDescendants = leftDescendants + (splitIndex - begin) * 2 - 2;
+    buildSlots[nodeIndex].m_firstChild = descendantsIndex;
+    unsigned int childDepth = taskDepth > 0 ? taskDepth - 1 : 0;
+    if (!buildRange(permutedElements, buildSlots, begin, splitIndex,
+                    descendantsIndex, leftDescendants, leftBBox,
+                    pTasks, childDepth))
         return false;
-    if (!buildRange(permutedElements, splitIndex, end, m_nodes[nodeIndex].m_firstChild + 1, rightBBox))
+    if (!buildRange(permutedElements, buildSlots, splitIndex, end,
+                    descendantsIndex + 1, rightDescendants, rightBBox,
+                    pTasks, childDepth))
         return false;
     
     return true;
 }
 
-// Arbitrary limit on tree depth; there can be 2^32 nodes, or 2^31 prims implying
-// a max depth of 32, but the trees are not perfectly balanced, so we add some
-// slack that hopefully will suffice.
-const unsigned int kMaxTraversalSteps = 50;
-
-// Temporary data used during traversal to remember a node we need to potentially
+template<typename T>
+void Bvh<T>::partitionSpatialMedian(BuildElement *permutedElements,
+                                    unsigned int begin, unsigned int end,
+                                    const BBox& nodeBBox,
+                                    BvhNodeFlags& outSplit, unsigned int& outSplitIndex)
+{
+    // Pick split axis
+    Vector extents = nodeBBox.m_max - nodeBBox.m_min;
+    BvhNodeFlags split;
+    if (extents.m_x > extents.m_y)
+    {
+        if (extents.m_x > extents.m_z)
+            split = kSplitX;
+        else
+            split = kSplitZ;
+    }
+    else if (extents.m_y > extents.m_z)
+        split = kSplitY;
+    else
+        split = kSplitZ;
+    
+    // Pick split axis location (this is a vanilla spatial split, the SAH tree
+    // build does something more sophisticated here).
+    float splitAxis;
+    if (split == kSplitX)
+        splitAxis = (nodeBBox.m_max.m_x + nodeBBox.m_min.m_x) * 0.5f;
+    else if (split == kSplitY)
+        splitAxis = (nodeBBox.m_max.m_y + nodeBBox.m_min.m_y) * 0.5f;
+    else
+        splitAxis = (nodeBBox.m_max.m_z + nodeBBox.m_min.m_z) * 0.5f;
+    
+    // Separate primitives such that those on the left of the split are in the
+    // earlier part of the list (for the range we're dealing with) and those on
+    // the right part of the split are later part of the list.
+    BuildElementPredicate pred(splitAxis, split);
+    BuildElement* partitionIter = std::partition(&permutedElements[begin], (&permutedElements[0]) + end, pred);
+    outSplitIndex = (unsigned int)(partitionIter - (&permutedElements[0]));
+    outSplit = split;
+}
+
+template<typename T>
+bool Bvh<T>::partitionBinnedSAH(BuildElement *permutedElements,
+                                unsigned int begin, unsigned int end,
+                                const BBox& nodeBBox,
+                                BvhNodeFlags& outSplit, unsigned int& outSplitIndex,
+                                float& outSplitCost)
+{
+    // Primitives get binned by their centroids, so find the range they cover
+    BBox centroidBBox;
+    for (unsigned int i = begin; i < end; ++i)
+    {
+        centroidBBox.expand(permutedElements[i].m_bbox.centroid());
+    }
+    
+    float nodeArea = nodeBBox.surfaceArea();
+    float invNodeArea = nodeArea > 0.0f ? 1.0f / nodeArea : 1.0f;
+    
+    // Try every bin boundary on every axis, and keep the cheapest
+    float bestCost = std::numeric_limits<float>::max();
+    BvhNodeFlags bestSplit = kSplitX;
+    unsigned int bestBin = 0;
+    float bestAxisMin = 0.0f, bestBinScale = 0.0f;
+    for (BvhNodeFlags split = kSplitX; split <= kSplitZ; ++split)
+    {
+        float axisMin = splitAxisComponent(centroidBBox.m_min, split);
+        float axisExtent = splitAxisComponent(centroidBBox.m_max, split) - axisMin;
+        if (axisExtent <= 0.0f)
+            continue; // All centroids are in the same spot on this axis
+        float binScale = kBvhSahBins / axisExtent;
+        SahBinPredicate binner(axisMin, binScale, split, 0);
+        
+        // Drop each primitive into its bin
+        BBox binBBoxes[kBvhSahBins];
+        unsigned int binCounts[kBvhSahBins] = { 0 };
+        for (unsigned int i = begin; i < end; ++i)
+        {
+            unsigned int b = binner.bin(permutedElements[i]);
+            binBBoxes[b] = binBBoxes[b].combined(permutedElements[i].m_bbox);
+            binCounts[b]++;
+        }
+        
+        // Sweep from the right, recording area and primitive count for
+        // everything to the right of each bin boundary
+        float rightAreas[kBvhSahBins];
+        unsigned int rightCounts[kBvhSahBins];
+        BBox sweepBBox;
+        unsigned int sweepCount = 0;
+        for (unsigned int b = kBvhSahBins - 1; b > 0; --b)
+        {
+            sweepBBox = sweepBBox.combined(binBBoxes[b]);
+            sweepCount += binCounts[b];
+            rightAreas[b] = sweepBBox.surfaceArea();
+            rightCounts[b] = sweepCount;
+        }
+        
+        // Sweep from the left, evaluating the SAH at each bin boundary
+        sweepBBox = BBox();
+        sweepCount = 0;
+        for (unsigned int b = 1; b < kBvhSahBins; ++b)
+        {
+            sweepBBox = sweepBBox.combined(binBBoxes[b - 1]);
+            sweepCount += binCounts[b - 1];
+            if (sweepCount == 0 || rightCounts[b] == 0)
+                continue;
+            float cost = kBvhTraversalCost +
+                         invNodeArea * (leafCost(sweepCount) * sweepBBox.surfaceArea() +
+                                        leafCost(rightCounts[b]) * rightAreas[b]);
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestSplit = split;
+                bestBin = b;
+                bestAxisMin = axisMin;
+                bestBinScale = binScale;
+            }
+        }
+    }
+    
+    // Everything in one spot?  Let the caller fall back on something else.
+    if (bestBin == 0)
+        return false;
+    
+    SahBinPredicate pred(bestAxisMin, bestBinScale, bestSplit, bestBin);
+    BuildElement* partitionIter = std::partition(&permutedElements[begin], (&permutedElements[0]) + end, pred);
+    outSplitIndex = (unsigned int)(partitionIter - (&permutedElements[0]));
+    outSplit = bestSplit;
+    outSplitCost = bestCost;
+    return true;
+}
+
+template<typename T>
+float Bvh<T>::computeSahCost() const
+{
+    if (m_nodes == NULL || m_numNodes == 0)
+        return 0.0f;
+    float rootArea = m_nodes[0].m_bbox.surfaceArea();
+    if (rootArea <= 0.0f)
+        return kBvhIntersectionCost;
+    // Each node costs its traversal (or intersection) cost, weighted by the
+    // probability that a ray hitting the root also hits the node
+    float cost = 0.0f;
+    for (unsigned int i = 0; i < m_numNodes; ++i)
+    {
+        float nodeCost = m_nodes[i].leafNode() ?
+                         leafCost(m_nodes[i].numPrims()) :
+                         kBvhTraversalCost;
+        cost += nodeCost * m_nodes[i].m_bbox.surfaceArea() / rootArea;
+    }
+    return cost;
+}
+
+// Arbitrary limit on tree depth; there can be 2^32 nodes, or 2^31 prims implying
+// a max depth of 32, but the trees are not perfectly balanced, so we add some
+// slack that hopefully will suffice.
+const unsigned int kMaxTraversalSteps = 50;
+
+// Temporary data used during traversal to remember a node we need to potentially
 // still visit and examine for intersection.
 struct TraversalStep
 {
@@ -401,6 +1271,11 @@ bool Bvh<T>::doesIntersect(const Ray& ray)
         invDir.m_z < 0.0f
     };
     
+    // If things move, find where the ray's time falls among the time keys
+    bool timeBounds = !m_timeBounds.empty();
+    float timeT = 0.0f;
+    unsigned int timeKey = timeBounds ? findTimeKey(ray.m_time, timeT) : 0;
+    
     // Maintain a list of nodes we need to examine, and the enter/exit distances
     // along the ray they live in.
     TraversalStep steps[kMaxTraversalSteps];
@@ -416,29 +1291,36 @@ bool Bvh<T>::doesIntersect(const Ray& ray)
         unsigned int step = numSteps - 1;
         const BvhNode& node = m_nodes[steps[step].m_nodeIndex];
         
-        // Test prim if this is a prim node
-        if (node.leafNode())
-        {
-            if (m_object.doesIntersect(ray, node.m_prim))
-            {
-                return true;
-            }
-            // Done with this prim node
-            numSteps--;
-            continue;
-        }
-        
         // Test ray against node bbox, adjusting ranges back if possible based
         // on previous near intersections
         float t0 = steps[step].m_t0;
         float t1 = steps[step].m_t1;
-        if (!node.m_bbox.intersects(ray.m_origin, invDir, t0, t1))
+        bool hitBBox = timeBounds ?
+                       timeBBox(steps[step].m_nodeIndex, timeKey, timeT).intersects(ray.m_origin, invDir, t0, t1) :
+                       node.m_bbox.intersects(ray.m_origin, invDir, t0, t1);
+        if (!hitBBox)
         {
             // Ray misses the bbox, skip the node
             numSteps--;
             continue;
         }
         
+        // Test prims if this is a prim node
+        if (node.leafNode())
+        {
+            unsigned int primEnd = node.firstPrim() + node.numPrims();
+            for (unsigned int i = node.firstPrim(); i < primEnd; ++i)
+            {
+                if (m_object.doesIntersect(ray, m_primIndices[i]))
+                {
+                    return true;
+                }
+            }
+            // Done with this prim node
+            numSteps--;
+            continue;
+        }
+        
         // Find which child node is closest
         // NOTE: it's not unreasonable to skip this check and just pick
         // an order, since we only care if *something* intersected at all, but
@@ -485,6 +1367,11 @@ bool Bvh<T>::intersect(Intersection& intersection)
         invDir.m_z < 0.0f
     };
     
+    // If things move, find where the ray's time falls among the time keys
+    bool timeBounds = !m_timeBounds.empty();
+    float timeT = 0.0f;
+    unsigned int timeKey = timeBounds ? findTimeKey(intersection.m_ray.m_time, timeT) : 0;
+    
     // Maintain a list of nodes we need to examine, and the enter/exit distances
     // along the ray they live in.  We use the enter/exit information as we go
     // to find out if a node to be examined goes out of range, since a nearer
@@ -504,18 +1391,6 @@ bool Bvh<T>::intersect(Intersection& intersection)
         unsigned int step = numSteps - 1;
         const BvhNode& node = m_nodes[steps[step].m_nodeIndex];
         
-        // Test prim if this is a prim node
-        if (node.leafNode())
-        {
-            if (m_object.intersect(intersection, node.m_prim))
-            {
-                intersected = true;
-            }
-            // Done with this prim node
-            numSteps--;
-            continue;
-        }
-        
         // Test ray against node bbox, adjusting ranges back if possible based
         // on previous near intersections
         float t0 = steps[step].m_t0;
@@ -528,13 +1403,32 @@ bool Bvh<T>::intersect(Intersection& intersection)
         }
         if (t1 > intersection.m_t)
             t1 = intersection.m_t;
-        if (!node.m_bbox.intersects(intersection.m_ray.m_origin, invDir, t0, t1))
+        bool hitBBox = timeBounds ?
+                       timeBBox(steps[step].m_nodeIndex, timeKey, timeT).intersects(intersection.m_ray.m_origin, invDir, t0, t1) :
+                       node.m_bbox.intersects(intersection.m_ray.m_origin, invDir, t0, t1);
+        if (!hitBBox)
         {
             // Ray misses the bbox, skip the node
             numSteps--;
             continue;
         }
         
+        // Test prims if this is a prim node
+        if (node.leafNode())
+        {
+            unsigned int primEnd = node.firstPrim() + node.numPrims();
+            for (unsigned int i = node.firstPrim(); i < primEnd; ++i)
+            {
+                if (m_object.intersect(intersection, m_primIndices[i]))
+                {
+                    intersected = true;
+                }
+            }
+            // Done with this prim node
+            numSteps--;
+            continue;
+        }
+        
         // Find which child node is closest
         unsigned int closestNode, furthestNode;
         if (dirSigns[node.split()] == false)
@@ -563,6 +1457,487 @@ bool Bvh<T>::intersect(Intersection& intersection)
 }
 
 
+// 4-wide BVH node: instead of one bbox, it holds the bboxes of (up to) four
+// children, stored "structure of arrays" style so that all four can be tested
+// against a ray at once with SIMD instructions.  m_bounds[0] is the min
+// corners and m_bounds[1] the max corners, each as four x's, four y's, then
+// four z's.  Each child is either another 4-wide node or a leaf holding a run
+// of prims (flagged the same way as BvhNode leaves).  Unused child slots get an
+// inside-out bbox, which rays can never hit.  Nodes are 128 bytes, exactly two
+// cache lines, and live in cache-line aligned storage so the bounds can be
+// loaded with aligned SIMD loads.
+struct alignas(16) Bvh4Node
+{
+    float m_bounds[2][3][4];
+    unsigned int m_child[4];
+    BvhNodeFlags m_childFlags[4];
+    
+    bool childIsLeaf(unsigned int c) const { return (m_childFlags[c] & kLeafNode) != 0; }
+    unsigned int childNumPrims(unsigned int c) const { return m_childFlags[c] >> kLeafPrimCountShift; }
+    
+    void setChild(unsigned int c, const BBox& bbox, unsigned int child, BvhNodeFlags flags)
+    {
+        m_bounds[0][0][c] = bbox.m_min.m_x;
+        m_bounds[0][1][c] = bbox.m_min.m_y;
+        m_bounds[0][2][c] = bbox.m_min.m_z;
+        m_bounds[1][0][c] = bbox.m_max.m_x;
+        m_bounds[1][1][c] = bbox.m_max.m_y;
+        m_bounds[1][2][c] = bbox.m_max.m_z;
+        m_child[c] = child;
+        m_childFlags[c] = flags;
+    }
+    
+    void setEmptyChild(unsigned int c)
+    {
+        setChild(c,
+                 BBox(Point(std::numeric_limits<float>::infinity()),
+                      Point(-std::numeric_limits<float>::infinity())),
+                 0,
+                 kLeafNode);
+    }
+};
+
+
+// Per-ray data for testing 4-wide nodes, computed once per traversal.  The
+// slab test picks the near/far planes of each axis based on the direction the
+// ray is heading (rather than sorting them with min/max), which is cheaper and
+// also makes inside-out bboxes always miss.
+struct Bvh4Ray
+{
+    unsigned int m_near[3], m_far[3];
+#if RAYITO_USE_SSE
+    __m128 m_origin[3], m_invDir[3];
+#else
+    float m_origin[3], m_invDir[3];
+#endif
+    
+    Bvh4Ray(const Ray& ray)
+    {
+        Vector invDir = 1.0f / ray.m_direction;
+        float origin[3] = { ray.m_origin.m_x, ray.m_origin.m_y, ray.m_origin.m_z };
+        float inv[3] = { invDir.m_x, invDir.m_y, invDir.m_z };
+        for (unsigned int a = 0; a < 3; ++a)
+        {
+            m_near[a] = inv[a] < 0.0f ? 1 : 0;
+            m_far[a] = 1 - m_near[a];
+#if RAYITO_USE_SSE
+            m_origin[a] = _mm_set1_ps(origin[a]);
+            m_invDir[a] = _mm_set1_ps(inv[a]);
+#else
+            m_origin[a] = origin[a];
+            m_invDir[a] = inv[a];
+#endif
+        }
+    }
+    
+    // Test the ray against all four children of the node within [tMin, tMax].
+    // Returns a bitmask of the children hit, and their entry distances.
+    int intersects(const Bvh4Node& node, float tMin, float tMax, float outTNear[4]) const
+    {
+#if RAYITO_USE_SSE
+        __m128 tNear = _mm_set1_ps(tMin);
+        __m128 tFar = _mm_set1_ps(tMax);
+        for (unsigned int a = 0; a < 3; ++a)
+        {
+            __m128 nearPlane = _mm_load_ps(node.m_bounds[m_near[a]][a]);
+            __m128 farPlane = _mm_load_ps(node.m_bounds[m_far[a]][a]);
+            tNear = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(nearPlane, m_origin[a]), m_invDir[a]), tNear);
+            tFar = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(farPlane, m_origin[a]), m_invDir[a]), tFar);
+        }
+        _mm_storeu_ps(outTNear, tNear);
+        return _mm_movemask_ps(_mm_cmple_ps(tNear, tFar));
+#else
+        int mask = 0;
+        for (unsigned int c = 0; c < 4; ++c)
+        {
+            float tNear = tMin, tFar = tMax;
+            for (unsigned int a = 0; a < 3; ++a)
+            {
+                tNear = std::max((node.m_bounds[m_near[a]][a][c] - m_origin[a]) * m_invDir[a], tNear);
+                tFar = std::min((node.m_bounds[m_far[a]][a][c] - m_origin[a]) * m_invDir[a], tFar);
+            }
+            outTNear[c] = tNear;
+            if (tNear <= tFar)
+                mask |= 1 << c;
+        }
+        return mask;
+#endif
+    }
+};
+
+
+/*
+ * 4-wide BVH.  This is built by first building a regular binary BVH, and then
+ * collapsing it: each 4-wide node pulls up the grandchildren of its binary
+ * node (always splitting the biggest child first) until it has four children.
+ * The result is a tree about half as deep, and each step of the traversal
+ * tests four bboxes at once with SIMD instructions instead of one at a time.
+ * 
+ * It has the same requirements on the template param type as the binary BVH,
+ * plus leaf-at-a-time versions of the intersection methods:
+ *     bool intersectLeaf(Intersection& intersection, unsigned int firstPrim, unsigned int numPrims);
+ *     bool doesIntersectLeaf(const Ray& ray, unsigned int firstPrim, unsigned int numPrims);
+ * These are handed a run of the BVH's prim list (see primIndices()) rather
+ * than element indices, so the object can keep its elements in prim list
+ * order and test a whole leaf at once with SIMD instructions.  Otherwise it
+ * has the same interface as the binary BVH.
+ */
+template<typename T>
+class Bvh4
+{
+public:
+    Bvh4(T& object,
+         BvhBuildMode buildMode = kBvhBuildSpatialMedian,
+         unsigned int maxLeafSize = kBvhDefaultMaxLeafSize)
+        : m_object(object), m_binary(object, buildMode, maxLeafSize),
+          m_nodes(), m_primIndices(), m_buildTime(0.0f) { }
+    
+    ~Bvh4() { }
+    
+    // Build settings are those of the binary BVH we collapse
+    BvhBuildMode buildMode() const                  { return m_binary.buildMode(); }
+    void         setBuildMode(BvhBuildMode mode)    { m_binary.setBuildMode(mode); }
+    unsigned int maxLeafSize() const                { return m_binary.maxLeafSize(); }
+    void         setMaxLeafSize(unsigned int size)  { m_binary.setMaxLeafSize(size); }
+    unsigned int leafBlockSize() const              { return m_binary.leafBlockSize(); }
+    void         setLeafBlockSize(unsigned int num) { m_binary.setLeafBlockSize(num); }
+    unsigned int buildThreads() const               { return m_binary.buildThreads(); }
+    void         setBuildThreads(unsigned int num)  { m_binary.setBuildThreads(num); }
+    
+    unsigned int numNodes() const { return (unsigned int)m_nodes.size(); }
+    
+    // Call this before tracing any rays through the BVH!
+    bool build();
+    
+    // Refit/update work just like for the binary BVH; the binary tree is refit
+    // alongside this one, since that's how we keep track of the SAH cost.
+    bool refit();
+    bool update();
+    
+    // Take a binary tree built earlier (see Bvh<T>::setTree()), and collapse it
+    bool setTree(const BvhNode *nodes, unsigned int numNodes, const unsigned int *primIndices);
+    
+    // The binary tree this one was collapsed from
+    const Bvh<T>& binary() const { return m_binary; }
+    
+    // Object element indices, ordered so that each leaf's prims are consecutive
+    const unsigned int* primIndices() const { return m_primIndices.empty() ? NULL : &m_primIndices[0]; }
+    
+    // Wall-clock time the last build() or refit() took (including the
+    // collapse), in seconds
+    float buildTime() const { return m_buildTime; }
+    
+    // SAH cost of the binary tree this one was collapsed from
+    float sahCost() const { return m_binary.sahCost(); }
+    
+    // Trace rays, forwarding final ray intersection logic to the object
+    bool intersect(Intersection& intersection);
+    bool doesIntersect(const Ray& ray);
+    
+private:
+    T& m_object;
+    Bvh<T> m_binary;
+    std::vector<Bvh4Node, AlignedAllocator<Bvh4Node> > m_nodes;
+    std::vector<unsigned int> m_primIndices;
+    float m_buildTime;
+    
+    // Collapse the whole binary tree (after building it, or being handed one)
+    void collapseBinary();
+    
+    // Make a 4-wide node out of a binary node and some of its descendants;
+    // returns the index of the new node.
+    unsigned int collapse(unsigned int binaryIndex);
+    
+    // Bbox around everything under one child of a 4-wide node
+    BBox childBBox(const Bvh4Node& node, unsigned int c) const;
+};
+
+
+// A 4-wide node can push up to three more entries onto the traversal stack
+// than it pops, so leave room for that at every level.
+const unsigned int kMaxTraversalSteps4 = kMaxTraversalSteps * 3 + 1;
+
+// Node (or leaf) we still need to visit, and the distance along the ray it starts
+struct Traversal4Step
+{
+    unsigned int m_index;
+    BvhNodeFlags m_flags;
+    float m_t0;
+};
+
+template<typename T>
+bool Bvh4<T>::build()
+{
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+    
+    bool built = m_binary.build();
+    collapseBinary();
+    
+    m_buildTime = std::chrono::duration<float>(std::chrono::steady_clock::now() - startTime).count();
+    return built;
+}
+
+template<typename T>
+bool Bvh4<T>::setTree(const BvhNode *nodes, unsigned int numNodes, const unsigned int *primIndices)
+{
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+    
+    bool accepted = m_binary.setTree(nodes, numNodes, primIndices);
+    collapseBinary();
+    
+    m_buildTime = std::chrono::duration<float>(std::chrono::steady_clock::now() - startTime).count();
+    return accepted;
+}
+
+template<typename T>
+void Bvh4<T>::collapseBinary()
+{
+    m_nodes.clear();
+    m_primIndices.clear();
+    if (m_binary.numNodes() > 0)
+    {
+        m_primIndices.assign(m_binary.primIndices(), m_binary.primIndices() + m_object.numElements());
+        // Each 4-wide node replaces at least one binary interior node
+        m_nodes.reserve(m_binary.numNodes() / 2 + 1);
+        collapse(0);
+    }
+}
+
+template<typename T>
+bool Bvh4<T>::refit()
+{
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+    
+    if (!m_binary.refit())
+        return false;
+    
+    // Like the binary tree, children come after their parents, so going
+    // backwards updates the bottom of the tree first
+    for (size_t i = m_nodes.size(); i-- > 0; )
+    {
+        Bvh4Node& node = m_nodes[i];
+        for (unsigned int c = 0; c < 4; ++c)
+        {
+            // Empty slots have no prims, so they stay inside-out
+            node.setChild(c, childBBox(node, c), node.m_child[c], node.m_childFlags[c]);
+        }
+    }
+    
+    m_buildTime = std::chrono::duration<float>(std::chrono::steady_clock::now() - startTime).count();
+    return true;
+}
+
+template<typename T>
+bool Bvh4<T>::update()
+{
+    if (!refit() || m_binary.refitDegraded())
+        return build();
+    return true;
+}
+
+template<typename T>
+BBox Bvh4<T>::childBBox(const Bvh4Node& node, unsigned int c) const
+{
+    BBox bbox;
+    if (node.childIsLeaf(c))
+    {
+        unsigned int primEnd = node.m_child[c] + node.childNumPrims(c);
+        for (unsigned int p = node.m_child[c]; p < primEnd; ++p)
+        {
+            bbox = bbox.combined(m_object.elementBBox(m_primIndices[p]));
+        }
+    }
+    else
+    {
+        const Bvh4Node& child = m_nodes[node.m_child[c]];
+        for (unsigned int cc = 0; cc < 4; ++cc)
+        {
+            bbox = bbox.combined(BBox(Point(child.m_bounds[0][0][cc], child.m_bounds[0][1][cc], child.m_bounds[0][2][cc]),
+                                      Point(child.m_bounds[1][0][cc], child.m_bounds[1][1][cc], child.m_bounds[1][2][cc])));
+        }
+    }
+    return bbox;
+}
+
+template<typename T>
+unsigned int Bvh4<T>::collapse(unsigned int binaryIndex)
+{
+    const BvhNode *binaryNodes = m_binary.nodes();
+    
+    // Gather up to four binary nodes to be the children: start with the two
+    // children, and keep opening up the biggest interior one among them.
+    unsigned int children[4];
+    unsigned int numChildren = 0;
+    if (binaryNodes[binaryIndex].leafNode())
+    {
+        // Only happens at the root, when the whole tree is one leaf
+        children[numChildren++] = binaryIndex;
+    }
+    else
+    {
+        children[numChildren++] = binaryNodes[binaryIndex].leftChildIndex();
+        children[numChildren++] = binaryNodes[binaryIndex].rightChildIndex();
+    }
+    while (numChildren < 4)
+    {
+        int biggest = -1;
+        float biggestArea = -1.0f;
+        for (unsigned int c = 0; c < numChildren; ++c)
+        {
+            const BvhNode& child = binaryNodes[children[c]];
+            if (child.interiorNode() && child.m_bbox.surfaceArea() > biggestArea)
+            {
+                biggest = (int)c;
+                biggestArea = child.m_bbox.surfaceArea();
+            }
+        }
+        if (biggest < 0)
+            break; // All leaves, can't open anything up
+        unsigned int opened = children[biggest];
+        children[biggest] = binaryNodes[opened].leftChildIndex();
+        children[numChildren++] = binaryNodes[opened].rightChildIndex();
+    }
+    
+    // Fill out the node; careful, recursing can move the node array around
+    unsigned int nodeIndex = (unsigned int)m_nodes.size();
+    m_nodes.push_back(Bvh4Node());
+    for (unsigned int c = 0; c < 4; ++c)
+    {
+        if (c >= numChildren)
+        {
+            m_nodes[nodeIndex].setEmptyChild(c);
+            continue;
+        }
+        const BvhNode& child = binaryNodes[children[c]];
+        if (child.leafNode())
+        {
+            m_nodes[nodeIndex].setChild(c, child.m_bbox, child.firstPrim(), child.m_flags);
+        }
+        else
+        {
+            unsigned int childIndex = collapse(children[c]);
+            m_nodes[nodeIndex].setChild(c, child.m_bbox, childIndex, 0);
+        }
+    }
+    return nodeIndex;
+}
+
+template<typename T>
+bool Bvh4<T>::doesIntersect(const Ray& ray)
+{
+    Bvh4Ray ray4(ray);
+    
+    // Maintain a list of nodes and leaves we need to examine
+    Traversal4Step steps[kMaxTraversalSteps4];
+    // Start with the root node (if we have one)
+    unsigned int numSteps = m_nodes.empty() ? 0 : 1;
+    steps[0].m_index = 0;
+    steps[0].m_flags = 0;
+    steps[0].m_t0 = kRayTMin;
+    
+    // Process pending nodes until we run out
+    while (numSteps > 0)
+    {
+        const Traversal4Step step = steps[--numSteps];
+        
+        // Test prims if this is a leaf
+        if (step.m_flags & kLeafNode)
+        {
+            if (m_object.doesIntersectLeaf(ray, step.m_index, step.m_flags >> kLeafPrimCountShift))
+            {
+                return true;
+            }
+            continue;
+        }
+        
+        // Test all four children at once, and queue up the ones we hit (in
+        // no particular order, since we only care if *something* is hit)
+        const Bvh4Node& node = m_nodes[step.m_index];
+        float tNear[4];
+        int hitMask = ray4.intersects(node, kRayTMin, ray.m_tMax, tNear);
+        for (unsigned int c = 0; c < 4; ++c)
+        {
+            if ((hitMask & (1 << c)) && numSteps < kMaxTraversalSteps4)
+            {
+                steps[numSteps].m_index = node.m_child[c];
+                steps[numSteps].m_flags = node.m_childFlags[c];
+                steps[numSteps].m_t0 = tNear[c];
+                numSteps++;
+            }
+        }
+    }
+    return false;
+}
+
+template<typename T>
+bool Bvh4<T>::intersect(Intersection& intersection)
+{
+    Bvh4Ray ray4(intersection.m_ray);
+    
+    // Maintain a list of nodes and leaves we need to examine, and the distance
+    // along the ray they start at, so we can skip them quickly once a nearer
+    // intersection has been found.
+    Traversal4Step steps[kMaxTraversalSteps4];
+    // Start with the root node (if we have one)
+    unsigned int numSteps = m_nodes.empty() ? 0 : 1;
+    steps[0].m_index = 0;
+    steps[0].m_flags = 0;
+    steps[0].m_t0 = kRayTMin;
+    
+    // Process pending nodes until we run out
+    bool intersected = false;
+    while (numSteps > 0)
+    {
+        const Traversal4Step step = steps[--numSteps];
+        if (step.m_t0 >= intersection.m_t)
+        {
+            // Previous near intersection was closer than this entire node, skip it
+            continue;
+        }
+        
+        // Test prims if this is a leaf
+        if (step.m_flags & kLeafNode)
+        {
+            if (m_object.intersectLeaf(intersection, step.m_index, step.m_flags >> kLeafPrimCountShift))
+            {
+                intersected = true;
+            }
+            continue;
+        }
+        
+        // Test all four children at once
+        const Bvh4Node& node = m_nodes[step.m_index];
+        float tNear[4];
+        int hitMask = ray4.intersects(node, kRayTMin, intersection.m_t, tNear);
+        
+        // Sort the children we hit from furthest to closest, so the closest
+        // ends up on top of the stack and gets looked at first
+        unsigned int hits[4];
+        unsigned int numHits = 0;
+        for (unsigned int c = 0; c < 4; ++c)
+        {
+            if (!(hitMask & (1 << c)))
+                continue;
+            unsigned int h = numHits++;
+            while (h > 0 && tNear[hits[h - 1]] < tNear[c])
+            {
+                hits[h] = hits[h - 1];
+                h--;
+            }
+            hits[h] = c;
+        }
+        for (unsigned int h = 0; h < numHits && numSteps < kMaxTraversalSteps4; ++h)
+        {
+            steps[numSteps].m_index = node.m_child[hits[h]];
+            steps[numSteps].m_flags = node.m_childFlags[hits[h]];
+            steps[numSteps].m_t0 = tNear[hits[h]];
+            numSteps++;
+        }
+    }
+    return intersected;
+}
+
+
 } // namespace Rayito
 
 
@@ -7,6 +7,10 @@
 #ifndef __RLIGHT_H__
 #define __RLIGHT_H__
 
+#include <map>
+#include <vector>
+#include <algorithm>
+
 #include "RMath.h"
 #include "RMaterial.h"
 #include "RScene.h"
@@ -32,6 +36,22 @@ public:
     
     virtual float intersectPdf(const Intersection& isect) = 0;
     
+    // Area of the emitting surface, for estimating how much light it puts out
+    virtual float emittingArea() const = 0;
+    
+    // Total (luminance) power given off; lights get picked more often the
+    // more they put out
+    float totalPower() const { return emitted().luminance() * emittingArea(); }
+    
+    // Cone that bounds the surface normals of the light: the axis, and the
+    // angle out from it.  Each point emits over the hemisphere around its
+    // normal.  Double-sided lights and closed shapes emit every which way.
+    virtual void normalCone(Vector& outAxis, float& outAngle) const
+    {
+        outAxis = Vector(0.0f, 0.0f, 1.0f);
+        outAngle = M_PI;
+    }
+    
 protected:
     Color m_color;
     float m_power;
@@ -181,6 +201,20 @@ public:
         return result;
     }
     
+    virtual BBox bboxAtTime(float time)
+    {
+        Point corners[] = { m_position,
+                            m_position + m_side1,
+                            m_position + m_side2,
+                            m_position + m_side1 + m_side2 };
+        BBox result;
+        for (int i = 0; i < 4; ++i)
+        {
+            result.expand(m_transform.fromLocalPoint(time, corners[i]));
+        }
+        return result;
+    }
+    
     // Given two random numbers between 0.0 and 1.0, find a location + surface
     // normal on the surface of the *light*.
     virtual bool sampleSurface(const Point& surfPosition,
@@ -238,6 +272,14 @@ public:
         return 0.0f;
     }
     
+    virtual float emittingArea() const
+    {
+        // Sized at the start of the transform, which is plenty for an estimate
+        float time = m_transform.keyTime(0);
+        return cross(m_transform.fromLocalVector(time, m_side1),
+                     m_transform.fromLocalVector(time, m_side2)).length();
+    }
+    
 protected:
     Point m_position;
     Vector m_side1, m_side2;
@@ -283,6 +325,21 @@ public:
         return m_pShape->bbox();
     }
     
+    virtual BBox bboxAtTime(float time)
+    {
+        return m_pShape->bboxAtTime(time);
+    }
+    
+    virtual bool rotatesBetween(float time0, float time1) const
+    {
+        return m_pShape->rotatesBetween(time0, time1);
+    }
+    
+    virtual void motionKeyTimes(std::vector<float>& outTimes) const
+    {
+        m_pShape->motionKeyTimes(outTimes);
+    }
+    
     virtual void prepare()
     {
         m_pShape->prepare();
@@ -327,11 +384,359 @@ public:
         return 0.0f;
     }
     
+    virtual float emittingArea() const
+    {
+        // Shapes that can't tell us their area (and can't be sampled anyway)
+        // still get a fair shot at being picked
+        float pdf = m_pShape->surfaceAreaPdf();
+        return pdf > 0.0f ? 1.0f / pdf : 1.0f;
+    }
+    
 protected:
     Shape *m_pShape;
 };
 
 
+
+//
+// Light tree, for picking among many lights
+//
+// A BVH over the lights, where each node also knows the total power under it
+// and a cone bounding the normals of its lights.  To pick a light for a
+// shading point we walk down from the root, at each node estimating how much
+// light each child could send that way (from its power, distance, and the
+// angles involved) and taking one child at random in proportion.  Lights that
+// are far away, dim, facing away, or behind the shading surface get picked
+// rarely or never, and it only costs a walk down one path of the tree.
+//
+// See "Importance Sampling of Many Lights with Adaptive Tree Splitting",
+// Alejandro Conty Estevez and Christopher Kulla, HPG 2018.
+//
+
+// Largest float below 1.0, to keep rescaled random numbers in [0,1)
+const float kOneMinusEpsilon = 0.99999994f;
+
+
+// Bounds on a group of lights: where they are, which way they face, and how
+// much they put out
+struct LightBounds
+{
+    BBox m_bbox;
+    Vector m_axis;
+    float m_normalAngle;
+    // Kept around to evaluate importance without inverse trig
+    float m_cosNormalAngle, m_sinNormalAngle;
+    float m_power;
+    
+    LightBounds()
+        : m_bbox(), m_axis(0.0f, 0.0f, 1.0f), m_normalAngle(0.0f),
+          m_cosNormalAngle(1.0f), m_sinNormalAngle(0.0f), m_power(0.0f) { }
+    
+    LightBounds(Light *pLight) : m_bbox(pLight->bbox()), m_power(pLight->totalPower())
+    {
+        pLight->normalCone(m_axis, m_normalAngle);
+        setNormalAngle(m_normalAngle);
+    }
+    
+    void setNormalAngle(float angle)
+    {
+        m_normalAngle = std::min(angle, float(M_PI));
+        m_cosNormalAngle = std::cos(m_normalAngle);
+        m_sinNormalAngle = std::sin(m_normalAngle);
+    }
+    
+    LightBounds combined(const LightBounds& bounds) const
+    {
+        if (m_power <= 0.0f)
+            return bounds;
+        if (bounds.m_power <= 0.0f)
+            return *this;
+        LightBounds result;
+        result.m_bbox = m_bbox.combined(bounds.m_bbox);
+        result.m_power = m_power + bounds.m_power;
+        
+        // Find the smallest cone holding both cones.  Start from the wider
+        // one; if it already covers the other, we're done.  Otherwise swing
+        // its axis toward the other cone just far enough to cover both.
+        const LightBounds& wide = m_normalAngle >= bounds.m_normalAngle ? *this : bounds;
+        const LightBounds& narrow = m_normalAngle >= bounds.m_normalAngle ? bounds : *this;
+        float axisAngle = std::acos(std::max(-1.0f, std::min(1.0f, dot(wide.m_axis, narrow.m_axis))));
+        if (std::min(axisAngle + narrow.m_normalAngle, float(M_PI)) <= wide.m_normalAngle)
+        {
+            result.m_axis = wide.m_axis;
+            result.setNormalAngle(wide.m_normalAngle);
+            return result;
+        }
+        float angle = (wide.m_normalAngle + axisAngle + narrow.m_normalAngle) * 0.5f;
+        Vector towardNarrow = narrow.m_axis - wide.m_axis * dot(wide.m_axis, narrow.m_axis);
+        if (angle >= M_PI || towardNarrow.length2() < 1.0e-12f)
+        {
+            result.m_axis = wide.m_axis;
+            result.setNormalAngle(M_PI);
+            return result;
+        }
+        float swing = angle - wide.m_normalAngle;
+        result.m_axis = wide.m_axis * std::cos(swing) + towardNarrow.normalized() * std::sin(swing);
+        result.setNormalAngle(angle);
+        return result;
+    }
+    
+    // Estimate of how much light these lights could send to a shading point;
+    // it is only zero when none of them can possibly light it.  The normal
+    // must face the side of the surface being lit.  All the angle math is
+    // done with cosines and sines, as this runs twice per level of the tree
+    // for every light sample.
+    float importance(const Point& position, const Vector& normal) const
+    {
+        if (m_power <= 0.0f)
+            return 0.0f;
+        
+        // Angle the box takes up as seen from the shading point (all the
+        // way around if we are inside its bounding sphere)
+        Point center = m_bbox.centroid();
+        Vector toLights = center - position;
+        float dist2 = toLights.length2();
+        float radius2 = (m_bbox.m_max - center).length2();
+        float cosBoxAngle = -1.0f, sinBoxAngle = 0.0f;
+        if (dist2 > radius2)
+        {
+            float sinBoxAngle2 = radius2 / dist2;
+            sinBoxAngle = std::sqrt(sinBoxAngle2);
+            cosBoxAngle = std::sqrt(1.0f - sinBoxAngle2);
+        }
+        Vector direction = dist2 > 0.0f ? toLights / std::sqrt(dist2) : normal;
+        // Don't let the falloff blow up for points close to (or inside) the box
+        dist2 = std::max(dist2, radius2);
+        
+        // Closest any light could come to being straight above the surface:
+        // the incident angle less the box angle
+        float cosIncident = dot(normal, direction);
+        float cosIncidentMin = 1.0f;
+        if (cosIncident < cosBoxAngle)
+        {
+            float sinIncident = std::sqrt(std::max(0.0f, 1.0f - cosIncident * cosIncident));
+            cosIncidentMin = cosIncident * cosBoxAngle + sinIncident * sinBoxAngle;
+            if (cosIncidentMin <= 0.0f)
+                return 0.0f;
+        }
+        
+        // Closest any light normal could come to facing the shading point:
+        // the angle off the cone axis, less the cone angle, less the box
+        // angle (lights emit over the hemisphere around their normals)
+        float cosEmit = dot(m_axis, -direction);
+        float cosEmitMin = 1.0f;
+        if (cosEmit < m_cosNormalAngle)
+        {
+            float sinEmit = std::sqrt(std::max(0.0f, 1.0f - cosEmit * cosEmit));
+            float cosOutsideCone = cosEmit * m_cosNormalAngle + sinEmit * m_sinNormalAngle;
+            float sinOutsideCone = sinEmit * m_cosNormalAngle - cosEmit * m_sinNormalAngle;
+            if (cosOutsideCone < cosBoxAngle)
+            {
+                cosEmitMin = cosOutsideCone * cosBoxAngle + sinOutsideCone * sinBoxAngle;
+                if (cosEmitMin <= 0.0f)
+                    return 0.0f;
+            }
+        }
+        
+        return m_power * cosEmitMin * cosIncidentMin / dist2;
+    }
+};
+
+
+class LightTree
+{
+public:
+    LightTree() { }
+    
+    explicit LightTree(const std::vector<Shape*>& lights) { build(lights); }
+    
+    void build(const std::vector<Shape*>& lights)
+    {
+        m_lights.clear();
+        m_nodes.clear();
+        m_lightIndices.clear();
+        for (size_t i = 0; i < lights.size(); ++i)
+        {
+            m_lights.push_back((Light*) lights[i]);
+            m_lightIndices[lights[i]] = i;
+        }
+        m_lightLeaves.assign(m_lights.size(), 0);
+        if (m_lights.empty())
+            return;
+        
+        std::vector<BuildLight> buildLights(m_lights.size());
+        for (size_t i = 0; i < m_lights.size(); ++i)
+        {
+            buildLights[i].m_bounds = LightBounds(m_lights[i]);
+            buildLights[i].m_lightIndex = i;
+        }
+        m_nodes.reserve(m_lights.size() * 2 - 1);
+        buildRange(buildLights, 0, buildLights.size(), 0);
+    }
+    
+    bool empty() const { return m_lights.empty(); }
+    size_t size() const { return m_lights.size(); }
+    Light* light(size_t index) const { return m_lights[index]; }
+    
+    // Pick a light for the shading point with a random number between 0.0 and
+    // 1.0, returning how likely it was to be picked.  The normal must face the
+    // side of the surface being lit.  Fails if no light can light the point.
+    bool sample(const Point& position,
+                const Vector& normal,
+                float u,
+                Light*& outLight,
+                float& outPdf) const
+    {
+        outLight = NULL;
+        outPdf = 0.0f;
+        if (m_nodes.empty() || m_nodes[0].m_bounds.importance(position, normal) <= 0.0f)
+            return false;
+        
+        // Walk down the tree, reusing the random number at each step by
+        // rescaling whichever part of it picked the child
+        size_t nodeIndex = 0;
+        float pdf = 1.0f;
+        while (!m_nodes[nodeIndex].isLeaf())
+        {
+            size_t left = nodeIndex + 1;
+            size_t right = m_nodes[nodeIndex].m_index;
+            float leftImportance = m_nodes[left].m_bounds.importance(position, normal);
+            float rightImportance = m_nodes[right].m_bounds.importance(position, normal);
+            float total = leftImportance + rightImportance;
+            if (total <= 0.0f)
+                return false;
+            float leftProbability = leftImportance / total;
+            if (u < leftProbability)
+            {
+                u = std::min(u / leftProbability, kOneMinusEpsilon);
+                pdf *= leftProbability;
+                nodeIndex = left;
+            }
+            else
+            {
+                u = std::min((u - leftProbability) / (1.0f - leftProbability), kOneMinusEpsilon);
+                pdf *= 1.0f - leftProbability;
+                nodeIndex = right;
+            }
+        }
+        outLight = m_lights[m_nodes[nodeIndex].m_index];
+        outPdf = pdf;
+        return pdf > 0.0f;
+    }
+    
+    // How likely sample() is to pick the given light for the shading point
+    // (zero if it isn't one of ours).  This walks from the light's leaf up to
+    // the root, redoing the choices sample() would have made on the way down.
+    float pdf(const Point& position, const Vector& normal, const Shape* pLight) const
+    {
+        std::map<const Shape*, size_t>::const_iterator found = m_lightIndices.find(pLight);
+        if (found == m_lightIndices.end() || m_nodes[0].m_bounds.importance(position, normal) <= 0.0f)
+            return 0.0f;
+        
+        size_t nodeIndex = m_lightLeaves[found->second];
+        float pdf = 1.0f;
+        while (nodeIndex != 0)
+        {
+            size_t parent = m_nodes[nodeIndex].m_parent;
+            size_t left = parent + 1;
+            size_t right = m_nodes[parent].m_index;
+            float leftImportance = m_nodes[left].m_bounds.importance(position, normal);
+            float rightImportance = m_nodes[right].m_bounds.importance(position, normal);
+            float total = leftImportance + rightImportance;
+            if (total <= 0.0f)
+                return 0.0f;
+            float leftProbability = leftImportance / total;
+            pdf *= nodeIndex == left ? leftProbability : 1.0f - leftProbability;
+            nodeIndex = parent;
+        }
+        return pdf;
+    }
+    
+protected:
+    // Nodes are stored depth-first, so the left child directly follows its
+    // parent; interior nodes hold the index of the right child, and leaves
+    // hold the index of their light.  Nodes also know their parent, so
+    // pdf() can walk up from a leaf.
+    struct Node
+    {
+        LightBounds m_bounds;
+        size_t m_index;
+        size_t m_parent;
+        bool m_leaf;
+        
+        bool isLeaf() const { return m_leaf; }
+    };
+    
+    struct BuildLight
+    {
+        LightBounds m_bounds;
+        size_t m_lightIndex;
+    };
+    
+    // Sorts lights along an axis by their box centers
+    struct CentroidLess
+    {
+        BvhNodeFlags m_axis;
+        
+        explicit CentroidLess(BvhNodeFlags axis) : m_axis(axis) { }
+        
+        bool operator ()(const BuildLight& a, const BuildLight& b) const
+        {
+            return splitAxisComponent(a.m_bounds.m_bbox.centroid(), m_axis) <
+                   splitAxisComponent(b.m_bounds.m_bbox.centroid(), m_axis);
+        }
+    };
+    
+    std::vector<Light*> m_lights;
+    std::vector<Node> m_nodes;
+    // Where each light is: its index, and the leaf it ended up in
+    std::map<const Shape*, size_t> m_lightIndices;
+    std::vector<size_t> m_lightLeaves;
+    
+    // Build the subtree over lights [begin, end), returning its root node.
+    // Splitting in half at the middle of the widest spread of light centers
+    // keeps the tree balanced, so a walk down it takes log(lights) steps.
+    size_t buildRange(std::vector<BuildLight>& buildLights, size_t begin, size_t end, size_t parent)
+    {
+        size_t nodeIndex = m_nodes.size();
+        m_nodes.push_back(Node());
+        m_nodes[nodeIndex].m_parent = parent;
+        if (end - begin == 1)
+        {
+            m_nodes[nodeIndex].m_bounds = buildLights[begin].m_bounds;
+            m_nodes[nodeIndex].m_index = buildLights[begin].m_lightIndex;
+            m_nodes[nodeIndex].m_leaf = true;
+            m_lightLeaves[buildLights[begin].m_lightIndex] = nodeIndex;
+            return nodeIndex;
+        }
+        
+        BBox centroidBounds;
+        for (size_t i = begin; i < end; ++i)
+        {
+            centroidBounds.expand(buildLights[i].m_bounds.m_bbox.centroid());
+        }
+        Vector extents = centroidBounds.m_max - centroidBounds.m_min;
+        BvhNodeFlags axis = kSplitX;
+        if (extents.m_y > splitAxisComponent(extents, axis))
+            axis = kSplitY;
+        if (extents.m_z > splitAxisComponent(extents, axis))
+            axis = kSplitZ;
+        size_t middle = begin + (end - begin) / 2;
+        std::nth_element(buildLights.begin() + begin,
+                         buildLights.begin() + middle,
+                         buildLights.begin() + end,
+                         CentroidLess(axis));
+        
+        buildRange(buildLights, begin, middle, nodeIndex);
+        size_t right = buildRange(buildLights, middle, end, nodeIndex);
+        m_nodes[nodeIndex].m_bounds = m_nodes[nodeIndex + 1].m_bounds.combined(m_nodes[right].m_bounds);
+        m_nodes[nodeIndex].m_index = right;
+        m_nodes[nodeIndex].m_leaf = false;
+        return nodeIndex;
+    }
+};
+
+
 } // namespace Rayito
 
 
@@ -84,6 +84,11 @@ public:
     }
     
     virtual bool isDiracDistribution() const { return false; }
+    
+    // One-sample MIS picks either a light sample or a BRDF sample for each
+    // light sample; this is the chance it should pick the light.  Broad BRDFs
+    // do better with light samples, and narrow ones with their own samples.
+    virtual float lightSampleFraction() const { return 0.5f; }
 };
 
 
@@ -201,6 +206,10 @@ public:
         // Standard projected-solid-angle PDF for diffuse reflectance
         return 1.0f / M_PI;
     }
+    
+    // Cosine sampling spreads over the whole hemisphere, so most lights
+    // are better found by sampling them
+    virtual float lightSampleFraction() const { return 0.8f; }
 };
 
 
@@ -212,6 +221,7 @@ public:
     
     virtual ~Glossy() { }
     
+    float exponent() const { return m_exponent; }
     
     // Note used yet, but it may be in the future (the standard A-S model has this)
     float schlickFresnel(float reflectionIncidentToNormal,
@@ -367,6 +377,14 @@ public:
                (8.0f * M_PI * std::fabs(dot(outgoing, half)) * std::fabs(nDotI));
     }
     
+    // Rough enough and this is as broad as Lambert; as the lobe tightens,
+    // lean toward the BRDF's own samples (but keep some light samples for
+    // small lights that the lobe rarely hits)
+    virtual float lightSampleFraction() const
+    {
+        return 0.2f + 0.6f / (1.0f + m_exponent * (1.0f / 16.0f));
+    }
+    
 protected:
     float m_exponent;
 };
@@ -435,11 +453,27 @@ public:
 // Material
 //
 
+// Which of the built-in materials a material is, so the renderer can shade
+// it without virtual calls (see ShadingRecord below)
+enum ShadingKind
+{
+    // Not a built-in: shade it through the virtual interface
+    kShadingCustom = 0,
+    kShadingEmitter,
+    kShadingLambert,
+    kShadingGlossy,
+    kShadingPerfectReflection
+};
+
 class Material
 {
 public:
+    Material() : m_shadingKind(kShadingCustom) { }
+    
     virtual ~Material() { }
     
+    ShadingKind shadingKind() const { return m_shadingKind; }
+    
     // If the material is emitting, override this
     virtual Color emittance() { return Color(); }
     
@@ -448,6 +482,13 @@ public:
                            const Vector& outgoingRayDirection,
                            Brdf*& pBrdfChosen,
                            float& brdfWeight) = 0;
+    
+protected:
+    // The built-in materials say which one they are.  (A subclass of one of
+    // them that changes how it shades should set this back to kShadingCustom.)
+    explicit Material(ShadingKind kind) : m_shadingKind(kind) { }
+    
+    ShadingKind m_shadingKind;
 };
 
 
@@ -455,7 +496,7 @@ public:
 class DiffuseMaterial : public Material
 {
 public:
-    DiffuseMaterial(const Color& color) : m_color(color), m_lambert() { }
+    DiffuseMaterial(const Color& color) : Material(kShadingLambert), m_color(color), m_lambert() { }
     
     virtual ~DiffuseMaterial() { }
     
@@ -480,7 +521,8 @@ protected:
 class GlossyMaterial : public Material
 {
 public:
-    GlossyMaterial(const Color& color, float roughness) : m_color(color), m_glossy(roughness) { }
+    GlossyMaterial(const Color& color, float roughness)
+        : Material(kShadingGlossy), m_color(color), m_glossy(roughness) { }
     
     virtual ~GlossyMaterial() { }
     
@@ -505,7 +547,7 @@ protected:
 class ReflectionMaterial : public Material
 {
 public:
-    ReflectionMaterial(const Color& color) : m_color(color) { }
+    ReflectionMaterial(const Color& color) : Material(kShadingPerfectReflection), m_color(color) { }
     
     virtual ~ReflectionMaterial() { }
     
@@ -530,7 +572,7 @@ protected:
 class Emitter : public Material
 {
 public:
-    Emitter(const Color& color, float power) : m_color(color), m_power(power) { }
+    Emitter(const Color& color, float power) : Material(kShadingEmitter), m_color(color), m_power(power) { }
     
     virtual ~Emitter() { }
     
@@ -554,6 +596,234 @@ protected:
 };
 
 
+//
+// Shading record: a material boiled down for shading one hit.  The built-in
+// materials become a tag plus the few numbers their BRDFs need, and all the
+// BRDF work at the hit switches on the tag instead of making virtual calls.
+// Things that only depend on the hit (the frame around the normal, which side
+// we're looking from, the glossy lobe's constants) get worked out once here,
+// instead of again for every light sample.  Any other material goes through
+// its virtual Material/Brdf interface, as always.
+//
+
+class ShadingRecord
+{
+public:
+    ShadingRecord() : m_kind(kShadingCustom), m_pBrdf(NULL), m_brdfWeight(1.0f) { }
+    
+    // Emission from a material (no virtual call for the built-ins)
+    static Color emittance(Material *pMaterial)
+    {
+        switch (pMaterial->shadingKind())
+        {
+        case kShadingEmitter:
+            return static_cast<Emitter*>(pMaterial)->Emitter::emittance();
+        case kShadingLambert:
+        case kShadingGlossy:
+        case kShadingPerfectReflection:
+            return Color();
+        default:
+            return pMaterial->emittance();
+        }
+    }
+    
+    // Set up for shading a hit with the given material; this is what
+    // Material::evaluate() does, plus getting the per-hit constants ready
+    void setup(Material *pMaterial, const Point& position, const Vector& normal, const Vector& outgoing)
+    {
+        m_kind = pMaterial->shadingKind();
+        switch (m_kind)
+        {
+        case kShadingEmitter:
+            m_color = static_cast<Emitter*>(pMaterial)->Emitter::evaluate(position, normal, outgoing,
+                                                                           m_pBrdf, m_brdfWeight);
+            break;
+        case kShadingLambert:
+            m_color = static_cast<DiffuseMaterial*>(pMaterial)->DiffuseMaterial::evaluate(position, normal, outgoing,
+                                                                                           m_pBrdf, m_brdfWeight);
+            break;
+        case kShadingGlossy:
+            m_color = static_cast<GlossyMaterial*>(pMaterial)->GlossyMaterial::evaluate(position, normal, outgoing,
+                                                                                         m_pBrdf, m_brdfWeight);
+            m_exponent = static_cast<Glossy*>(m_pBrdf)->exponent();
+            m_glossyNormalization = (m_exponent + 1.0f) / (2.0f * M_PI);
+            m_glossySampleExponent = 1.0f / (m_exponent + 1.0f);
+            break;
+        case kShadingPerfectReflection:
+            m_color = static_cast<ReflectionMaterial*>(pMaterial)->ReflectionMaterial::evaluate(position, normal, outgoing,
+                                                                                                 m_pBrdf, m_brdfWeight);
+            break;
+        default:
+            m_color = pMaterial->evaluate(position, normal, outgoing, m_pBrdf, m_brdfWeight);
+            break;
+        }
+        m_normal = normal;
+        m_outgoing = outgoing;
+        m_nDotO = dot(outgoing, normal);
+        if (m_kind == kShadingLambert || m_kind == kShadingGlossy)
+            makeCoordinateSpace(normal, m_xAxis, m_yAxis, m_zAxis);
+    }
+    
+    // Same as what Material::evaluate() hands back
+    const Color& color() const { return m_color; }
+    float brdfWeight() const { return m_brdfWeight; }
+    Brdf* brdf() const { return m_pBrdf; }
+    
+    bool isDiracDistribution() const
+    {
+        switch (m_kind)
+        {
+        case kShadingLambert:
+        case kShadingGlossy:
+            return false;
+        case kShadingPerfectReflection:
+            return true;
+        default:
+            return m_pBrdf->isDiracDistribution();
+        }
+    }
+    
+    float lightSampleFraction() const
+    {
+        switch (m_kind)
+        {
+        case kShadingLambert:
+            return static_cast<const Lambert*>(m_pBrdf)->Lambert::lightSampleFraction();
+        case kShadingGlossy:
+            return static_cast<const Glossy*>(m_pBrdf)->Glossy::lightSampleFraction();
+        default:
+            return m_pBrdf->lightSampleFraction();
+        }
+    }
+    
+    // Brdf::evaluateSA() for this hit
+    float evaluateSA(const Vector& incoming, float& outPdf) const
+    {
+        switch (m_kind)
+        {
+        case kShadingLambert:
+            return evaluateLambert(incoming, outPdf);
+        case kShadingGlossy:
+            return evaluateGlossy(incoming, outPdf);
+        case kShadingPerfectReflection:
+            // Not possible to randomly sample this direction by chance
+            outPdf = 0.0f;
+            return 0.0f;
+        default:
+            return m_pBrdf->evaluateSA(incoming, m_outgoing, m_normal, outPdf);
+        }
+    }
+    
+    // Brdf::evaluateSA() for a batch of directions (the light samples at a
+    // hit), sorting out which BRDF it is just once for the lot
+    void evaluateSA(const Vector *incoming, unsigned int count, float *outResults, float *outPdfs) const
+    {
+        switch (m_kind)
+        {
+        case kShadingLambert:
+            for (unsigned int i = 0; i < count; ++i)
+                outResults[i] = evaluateLambert(incoming[i], outPdfs[i]);
+            break;
+        case kShadingGlossy:
+            for (unsigned int i = 0; i < count; ++i)
+                outResults[i] = evaluateGlossy(incoming[i], outPdfs[i]);
+            break;
+        default:
+            for (unsigned int i = 0; i < count; ++i)
+                outResults[i] = evaluateSA(incoming[i], outPdfs[i]);
+            break;
+        }
+    }
+    
+    // Brdf::sampleSA() for this hit
+    float sampleSA(Vector& outIncoming, float u1, float u2, float& outPdf) const
+    {
+        switch (m_kind)
+        {
+        case kShadingLambert:
+        {
+            // Cosine-weighted around the normal, flipped to the side we're
+            // looking from
+            Vector localIncoming = -uniformToCosineHemisphere(u1, u2);
+            outIncoming = transformFromLocalCoordinateSpace(localIncoming, m_xAxis, m_yAxis, m_zAxis);
+            if (m_nDotO < 0.0f)
+                outIncoming *= -1.0f;
+            outPdf = std::fabs(dot(-outIncoming, m_normal)) / M_PI;
+            return 1.0f / M_PI;
+        }
+        case kShadingGlossy:
+        {
+            // A-S half-vector around the normal, and reflect outgoing past it
+            float phi = 2.0f * M_PI * u1;
+            float cosTheta = std::pow(1.0f - u2, m_glossySampleExponent);
+            float sin2Theta = std::max(0.0f, 1.0f - cosTheta * cosTheta);
+            float sinTheta = std::sqrt(sin2Theta);
+            Vector localHalf(sinTheta * std::cos(phi),
+                             sinTheta * std::sin(phi),
+                             cosTheta);
+            Vector half = transformFromLocalCoordinateSpace(localHalf, m_xAxis, m_yAxis, m_zAxis);
+            if (m_nDotO < 0.0f)
+                half *= -1.0f;
+            outIncoming = m_outgoing - half * (2.0f * dot(m_outgoing, half));
+            return evaluateGlossy(outIncoming, outPdf);
+        }
+        case kShadingPerfectReflection:
+            return static_cast<const PerfectReflection*>(m_pBrdf)->PerfectReflection::sampleSA(outIncoming, m_outgoing,
+                                                                                                m_normal, u1, u2, outPdf);
+        default:
+            return m_pBrdf->sampleSA(outIncoming, m_outgoing, m_normal, u1, u2, outPdf);
+        }
+    }
+    
+protected:
+    // Same as Lambert::evaluateSA()
+    float evaluateLambert(const Vector& incoming, float& outPdf) const
+    {
+        float nDotI = dot(incoming, m_normal);
+        if ((nDotI > 0.0f && m_nDotO > 0.0f) ||
+            (nDotI < 0.0f && m_nDotO < 0.0f))
+        {
+            outPdf = 0.0f;
+            return 0.0f;
+        }
+        outPdf = std::fabs(nDotI) / M_PI;
+        return 1.0f / M_PI;
+    }
+    
+    // Same as Glossy::evaluateSA(), with the lobe's normalization done already
+    float evaluateGlossy(const Vector& incoming, float& outPdf) const
+    {
+        float nDotI = dot(incoming, m_normal);
+        if ((nDotI > 0.0f && m_nDotO > 0.0f) ||
+            (nDotI < 0.0f && m_nDotO < 0.0f))
+        {
+            outPdf = 0.0f;
+            return 0.0f;
+        }
+        Vector half;
+        if (dot(m_outgoing, incoming) > 0.999f)
+            half = m_normal;
+        else
+            half = (m_outgoing - incoming).normalized();
+        float d = m_glossyNormalization * std::pow(std::fabs(dot(m_normal, half)), m_exponent);
+        float result = d / (4.0f * std::fabs(m_nDotO + -nDotI - m_nDotO * -nDotI));
+        outPdf = d / (4.0f * std::fabs(dot(m_outgoing, half)));
+        return result;
+    }
+    
+    ShadingKind m_kind;
+    Brdf *m_pBrdf;
+    Color m_color;
+    float m_brdfWeight;
+    Vector m_normal, m_outgoing;
+    float m_nDotO;
+    // Frame around the normal (Lambert and glossy sampling)
+    Vector m_xAxis, m_yAxis, m_zAxis;
+    // Glossy lobe constants
+    float m_exponent, m_glossyNormalization, m_glossySampleExponent;
+};
+
+
 } // namespace Rayito
 
 
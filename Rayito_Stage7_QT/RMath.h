@@ -50,6 +50,11 @@ struct Color
         m_b = std::max(min, std::min(max, m_b));
     }
     
+    // Perceived brightness (Rec. 709 weights)
+    float luminance() const { return 0.2126f * m_r + 0.7152f * m_g + 0.0722f * m_b; }
+    
+    float maxComponent() const { return std::max(std::max(m_r, m_g), m_b); }
+    
     
     Color& operator =(const Color& c)
     {
@@ -614,14 +619,71 @@ inline Quaternion slerp(const Quaternion& q1, const Quaternion& q2, float t)
 //
 
 
+// Affine transformation in plain 3x4 matrix form: the left 3x3 holds the
+// rotation and scale, and the last column holds the translation.  This is what
+// Transform caches so rays can be moved between spaces with a single multiply.
+struct Matrix3x4
+{
+    float m_m[3][4];
+    
+    Matrix3x4()
+    {
+        for (unsigned int i = 0; i < 3; ++i)
+            for (unsigned int j = 0; j < 4; ++j)
+                m_m[i][j] = i == j ? 1.0f : 0.0f;
+    }
+    
+    // Builds the matrix that undoes a scale, rotate, translate (applied in that
+    // order), i.e. takes things from world space back into local space
+    static Matrix3x4 toLocal(const Vector& scale, const Quaternion& rot, const Vector& trans)
+    {
+        // The inverse rotation matrix is the transpose of the one for the
+        // quaternion (see the quaternion-vector multiply above), and the
+        // inverse scale divides each of its rows.
+        const float qw = rot.m_w, qx = rot.m_v.m_x, qy = rot.m_v.m_y, qz = rot.m_v.m_z;
+        Matrix3x4 result;
+        result.m_m[0][0] = (1.0f - 2.0f * (qy * qy + qz * qz)) / scale.m_x;
+        result.m_m[0][1] = (2.0f * (qx * qy + qw * qz)) / scale.m_x;
+        result.m_m[0][2] = (2.0f * (qx * qz - qw * qy)) / scale.m_x;
+        result.m_m[1][0] = (2.0f * (qx * qy - qw * qz)) / scale.m_y;
+        result.m_m[1][1] = (1.0f - 2.0f * (qx * qx + qz * qz)) / scale.m_y;
+        result.m_m[1][2] = (2.0f * (qy * qz + qw * qx)) / scale.m_y;
+        result.m_m[2][0] = (2.0f * (qx * qz + qw * qy)) / scale.m_z;
+        result.m_m[2][1] = (2.0f * (qy * qz - qw * qx)) / scale.m_z;
+        result.m_m[2][2] = (1.0f - 2.0f * (qx * qx + qy * qy)) / scale.m_z;
+        // Translation gets backed out before the rotation and scale
+        Vector offset = result.transformVector(trans);
+        result.m_m[0][3] = -offset.m_x;
+        result.m_m[1][3] = -offset.m_y;
+        result.m_m[2][3] = -offset.m_z;
+        return result;
+    }
+    
+    Point transformPoint(const Point& p) const
+    {
+        return Point(m_m[0][0] * p.m_x + m_m[0][1] * p.m_y + m_m[0][2] * p.m_z + m_m[0][3],
+                     m_m[1][0] * p.m_x + m_m[1][1] * p.m_y + m_m[1][2] * p.m_z + m_m[1][3],
+                     m_m[2][0] * p.m_x + m_m[2][1] * p.m_y + m_m[2][2] * p.m_z + m_m[2][3]);
+    }
+    
+    Vector transformVector(const Vector& v) const
+    {
+        return Vector(m_m[0][0] * v.m_x + m_m[0][1] * v.m_y + m_m[0][2] * v.m_z,
+                      m_m[1][0] * v.m_x + m_m[1][1] * v.m_y + m_m[1][2] * v.m_z,
+                      m_m[2][0] * v.m_x + m_m[2][1] * v.m_y + m_m[2][2] * v.m_z);
+    }
+};
+
+
 // Transformation class (*not* a matrix, but instead for simplicity of motion blur
 // it encodes a scale, rotate, and then translate (applied in that order))
 class Transform
 {
 public:
-    Transform() : m_time(), m_scale(), m_rotate(), m_translate() { }
+    Transform() : m_time(), m_scale(), m_rotate(), m_translate(), m_toLocal(), m_translateOnly() { }
     Transform(const Transform& t)
-                : m_time(t.m_time), m_scale(t.m_scale), m_rotate(t.m_rotate), m_translate(t.m_translate) { }
+                : m_time(t.m_time), m_scale(t.m_scale), m_rotate(t.m_rotate), m_translate(t.m_translate),
+                  m_toLocal(t.m_toLocal), m_translateOnly(t.m_translateOnly) { }
     
     Transform& operator =(const Transform& t)
     {
@@ -629,6 +691,8 @@ public:
         m_scale = t.m_scale;
         m_rotate = t.m_rotate;
         m_translate = t.m_translate;
+        m_toLocal = t.m_toLocal;
+        m_translateOnly = t.m_translateOnly;
         return *this;
     }
     
@@ -646,6 +710,7 @@ public:
         m_scale.clear();
         m_rotate.clear();
         m_translate.clear();
+        invalidateMatrices();
     }
     
 
@@ -714,6 +779,20 @@ public:
             return lerp(m_rotate[index], m_rotate[index + 1], t);
     }
     
+    // Does the rotation change anywhere between the two times?  Translation
+    // and scaling move points in straight lines, but rotation swings them
+    // along curves.
+    bool rotatesBetween(float time0, float time1) const
+    {
+        Quaternion start = rotation(time0);
+        for (size_t i = 0; i < m_time.size(); ++i)
+        {
+            if (m_time[i] > time0 && m_time[i] <= time1 && !sameRotation(m_rotate[i], start))
+                return true;
+        }
+        return !sameRotation(rotation(time1), start);
+    }
+    
     // Overwrite aspects of the transformation
     
     void setTranslationKey(size_t keyIndex, const Vector& trans)
@@ -721,6 +800,7 @@ public:
         if (keyIndex >= m_translate.size())
             return;
         m_translate[keyIndex] = trans;
+        invalidateMatrices();
     }
     
     void setScalingKey(size_t keyIndex, const Vector& scaling)
@@ -728,6 +808,7 @@ public:
         if (keyIndex >= m_scale.size())
             return;
         m_scale[keyIndex] = scaling;
+        invalidateMatrices();
     }
     
     void setRotationKey(size_t keyIndex, const Quaternion& rot)
@@ -735,24 +816,28 @@ public:
         if (keyIndex >= m_rotate.size())
             return;
         m_rotate[keyIndex] = rot;
+        invalidateMatrices();
     }
     
     void setTranslation(float time, const Vector& trans)
     {
         size_t index = findOrInsertKey(time);
         m_translate[index] = trans;
+        invalidateMatrices();
     }
     
     void setScaling(float time, const Vector& scaling)
     {
         size_t index = findOrInsertKey(time);
         m_scale[index] = scaling;
+        invalidateMatrices();
     }
     
     void setRotation(float time, const Quaternion& rot)
     {
         size_t index = findOrInsertKey(time);
         m_rotate[index] = rot;
+        invalidateMatrices();
     }
     
     // Concatenate additional transformations
@@ -762,6 +847,7 @@ public:
         if (keyIndex >= m_translate.size())
             return;
         m_translate[keyIndex] += trans;
+        invalidateMatrices();
     }
     
     void scaleKey(size_t keyIndex, const Vector& scaling)
@@ -769,6 +855,7 @@ public:
         if (keyIndex >= m_scale.size())
             return;
         m_scale[keyIndex] *= scaling;
+        invalidateMatrices();
     }
     
     void rotateKey(size_t keyIndex, const Quaternion& rot)
@@ -776,24 +863,28 @@ public:
         if (keyIndex >= m_rotate.size())
             return;
         m_rotate[keyIndex] *= rot;
+        invalidateMatrices();
     }
     
     void translate(float time, const Vector& trans)
     {
         size_t index = findOrInsertKey(time);
         m_translate[index] += trans;
+        invalidateMatrices();
     }
     
     void scale(float time, const Vector& scaling)
     {
         size_t index = findOrInsertKey(time);
         m_scale[index] *= scaling;
+        invalidateMatrices();
     }
     
     void rotate(float time, const Quaternion& rot)
     {
         size_t index = findOrInsertKey(time);
         m_rotate[index] *= rot;
+        invalidateMatrices();
     }
     
     
@@ -804,6 +895,50 @@ public:
         {
             m_rotate[i].normalize();
         }
+        
+        // Cache the world-to-local matrix at every key, so static transforms
+        // never have to search for keys or mix anything per ray.  Segments that
+        // only translate keep the same rotation/scale part at both ends, so
+        // mixing their cached matrices is exact and needs no quaternion lerp.
+        m_toLocal.resize(numKeys());
+        m_translateOnly.resize(numSegments());
+        for (size_t i = 0; i < m_toLocal.size(); ++i)
+        {
+            m_toLocal[i] = Matrix3x4::toLocal(scalingKey(i), rotationKey(i), translationKey(i));
+        }
+        for (size_t i = 0; i < m_translateOnly.size(); ++i)
+        {
+            const Vector& s0 = m_scale[i];
+            const Vector& s1 = m_scale[i + 1];
+            m_translateOnly[i] = s0.m_x == s1.m_x && s0.m_y == s1.m_y && s0.m_z == s1.m_z &&
+                                 sameRotation(m_rotate[i], m_rotate[i + 1]);
+        }
+    }
+    
+    // True once prepare() has cached the matrices, until the next edit
+    bool hasMatrices() const { return !m_toLocal.empty(); }
+    
+    // World-to-local matrix at the given time; only call this after prepare()
+    Matrix3x4 toLocalMatrix(float time) const
+    {
+        if (m_time.empty())
+            return m_toLocal[0];
+        float t;
+        size_t index = timeIndex(time, t);
+        if (t == 0.0f)
+            return m_toLocal[index];
+        if (!m_translateOnly[index])
+        {
+            // Rotation and/or scale change over the segment, so the matrix has
+            // to be rebuilt from the mixed values (once for the whole ray)
+            return Matrix3x4::toLocal(m_scale[index] * (1.0f - t) + m_scale[index + 1] * t,
+                                      lerp(m_rotate[index], m_rotate[index + 1], t),
+                                      m_translate[index] * (1.0f - t) + m_translate[index + 1] * t);
+        }
+        Matrix3x4 result = m_toLocal[index];
+        for (unsigned int i = 0; i < 3; ++i)
+            result.m_m[i][3] = m_toLocal[index].m_m[i][3] * (1.0f - t) + m_toLocal[index + 1].m_m[i][3] * t;
+        return result;
     }
     
     
@@ -813,6 +948,8 @@ public:
     
     Point toLocalPoint(float time, const Point& p) const
     {
+        if (hasMatrices())
+            return toLocalMatrix(time).transformPoint(p);
         return ((~rotation(time)) * (p - translation(time))) / scaling(time);
     }
     
@@ -823,6 +960,8 @@ public:
     
     Vector toLocalVector(float time, const Vector& v) const
     {
+        if (hasMatrices())
+            return toLocalMatrix(time).transformVector(v);
         return ((~rotation(time)) * v) / scaling(time);
     }
     
@@ -841,11 +980,31 @@ public:
         return rotation(time) * n;
     }
     
+    // How much a bit of surface with the given (local space) normal grows in
+    // area going to non-local space.  Only the scaling matters, and unless
+    // it is uniform, how much depends on which way the surface faces.
+    float fromLocalAreaScale(float time, const Vector& n) const
+    {
+        Vector s = scaling(time);
+        Vector scaledNormal(s.m_y * s.m_z * n.m_x, s.m_x * s.m_z * n.m_y, s.m_x * s.m_y * n.m_z);
+        return scaledNormal.length() / n.length();
+    }
+    
 private:
+    static bool sameRotation(const Quaternion& r0, const Quaternion& r1)
+    {
+        return r0.m_w == r1.m_w && r0.m_v.m_x == r1.m_v.m_x &&
+               r0.m_v.m_y == r1.m_v.m_y && r0.m_v.m_z == r1.m_v.m_z;
+    }
+    
     std::vector<float>      m_time;
     std::vector<Vector>     m_scale;
     std::vector<Quaternion> m_rotate;
     std::vector<Vector>     m_translate;
+    std::vector<Matrix3x4>  m_toLocal;
+    std::vector<bool>       m_translateOnly;
+    
+    void invalidateMatrices() { m_toLocal.clear(); }
     
     size_t timeIndex(float time, float& outT) const
     {
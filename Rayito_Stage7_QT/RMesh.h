@@ -7,7 +7,9 @@
 #ifndef __RMESH_H__
 #define __RMESH_H__
 
+#include <cstdint>
 #include <list>
+#include <string>
 #include <vector>
 #include <algorithm>
 
@@ -33,6 +35,85 @@ struct Face
 };
 
 
+// Triangle ready for ray intersection, with everything the intersection test
+// needs that doesn't depend on the ray worked out ahead of time: the first
+// vertex, the two edges out of it, and the (unnormalized) geometric normal.
+// The face and which triangle of its fan this is are kept for shading.  This
+// is 64 bytes, one triangle per cache line.
+struct alignas(16) MeshTriangle
+{
+    Point m_v0;
+    Vector m_edge1, m_edge2;
+    Vector m_normal;
+    unsigned int m_face;
+    unsigned int m_fanIndex;
+};
+
+
+// Four triangles from one BVH leaf, "structure of arrays" style, so they can
+// be loaded straight into SIMD registers.  There are 9 components (v0, edge1
+// and edge2; x, y, z of each; the normal is cheaper to recompute than to
+// load), each holding that component for all 4 triangles.  Each leaf gets its
+// own run of packets, with any unused lanes at the end of the last one zeroed
+// out (which makes them degenerate, so they never get hit).
+const unsigned int kTrianglePacketComponents = 9;
+const unsigned int kTrianglePacketWidth = 4;
+
+struct alignas(16) TrianglePacket
+{
+    float m_components[kTrianglePacketComponents][kTrianglePacketWidth];
+};
+
+
+// Ways of testing a leaf's triangles against a ray: one at a time with plain
+// floats (the reference the others have to match), or 4 or 8 at once with SSE
+// or AVX.  The SIMD kernels live in TriangleKernels.cpp; which ones can be
+// used is worked out at runtime from what the CPU supports.
+enum TriangleKernel
+{
+    kTriangleKernelScalar = 0,
+    kTriangleKernelSSE,
+    kTriangleKernelAVX
+};
+
+bool triangleKernelSupported(TriangleKernel kernel);
+TriangleKernel fastestTriangleKernel();
+
+// How many triangles a kernel tests at once
+inline unsigned int triangleKernelWidth(TriangleKernel kernel)
+{
+    return kernel == kTriangleKernelAVX ? 8 : (kernel == kTriangleKernelSSE ? 4 : 1);
+}
+
+// Test a ray against the first numTris triangles in a run of packets, looking
+// for the closest hit in [kRayTMin, tMax).  Returns which triangle was hit
+// (with its distance and barycentric coords) or -1 for a miss.  Ties go to the
+// earlier triangle, same as testing them one at a time in order.  The kernel
+// must be one of the SIMD ones.
+int intersectTrianglePackets(TriangleKernel kernel,
+                             const TrianglePacket* packets,
+                             unsigned int numTris,
+                             const Ray& ray,
+                             float tMax,
+                             float& outT,
+                             float& outBeta,
+                             float& outGamma);
+bool doesIntersectTrianglePackets(TriangleKernel kernel,
+                                  const TrianglePacket* packets,
+                                  unsigned int numTris,
+                                  const Ray& ray);
+
+
+// Typical growth in area from a transform's local space to non-local space
+// (at its first key), for when there's no particular bit of surface in mind.
+// This is exact for uniform scaling.
+inline float averageAreaScale(const Transform& transform)
+{
+    Vector s = transform.scaling(transform.keyTime(0));
+    return std::pow(std::fabs(s.m_x * s.m_y * s.m_z), 2.0f / 3.0f);
+}
+
+
 // Polygon mesh.  Faces may have 3 or more sides, but each face must be convex
 // (no holes or edges going back inside the hull at all).  Faces are triangulated
 // by making a triangle fan out from the first vertex.
@@ -48,17 +129,71 @@ public:
           m_faces(faces),
           m_pMaterial(pMaterial),
           m_bbox(),
-          m_bvh(*this),
-          m_faceAreaCDF(),
+          m_localBBox(),
+          m_keyBBoxes(),
+          m_triangles(),
+          m_numTriangles(0),
+          m_trianglesDirty(true),
+          m_geometryDirty(true),
+          m_packets(),
+          m_leafPackets(),
+          m_triangleKernel(kTriangleKernelScalar),
+          m_bvh(*this, kBvhBuildBinnedSAH),
+          m_triangleTable(),
           m_totalArea(0.0f)
     {
-        
+        // Each face is a fan of triangles; the BVH is built over those
+        for (size_t faceIndex = 0; faceIndex < m_faces.size(); ++faceIndex)
+        {
+            m_numTriangles += m_faces[faceIndex].m_vertexIndices.size() - 2;
+        }
+        setTriangleKernel(fastestTriangleKernel());
     }
     
     virtual ~Mesh() { }
     
     void setMaterial(Material* pMaterial) { m_pMaterial = pMaterial; }
     
+    // Move the vertices around (for deforming meshes); takes effect at the
+    // next prepare().  Faces refer to vertices by index, so the number of
+    // vertices can't change: a vertex array of the wrong size is refused (the
+    // mesh stays as it was) and this returns false.
+    bool setVertices(const std::vector<Point>& verts)
+    {
+        if (verts.size() != m_vertices.size())
+            return false;
+        m_vertices = verts;
+        m_trianglesDirty = true;
+        m_geometryDirty = true;
+        return true;
+    }
+    const std::vector<Point>& vertices() const { return m_vertices; }
+    const std::vector<Vector>& normals() const { return m_normals; }
+    const std::vector<Face>& faces() const { return m_faces; }
+    
+    const Bvh4<Mesh>& bvh() const { return m_bvh; }
+    Bvh4<Mesh>&       bvh()       { return m_bvh; }
+    
+    // Which ray-triangle test is used for the BVH leaves (defaults to the
+    // fastest the CPU supports; asking for one it doesn't support is ignored).
+    // The BVH is told to fill its leaves up to the kernel's width, since
+    // testing a whole packet costs about as much as testing one triangle, so
+    // changing kernels means a rebuild at the next prepare().
+    TriangleKernel triangleKernel() const { return m_triangleKernel; }
+    void setTriangleKernel(TriangleKernel kernel)
+    {
+        if (!triangleKernelSupported(kernel))
+            return;
+        m_triangleKernel = kernel;
+        unsigned int width = triangleKernelWidth(kernel);
+        if (m_bvh.leafBlockSize() != width)
+        {
+            m_bvh.setLeafBlockSize(width);
+            m_bvh.setMaxLeafSize(std::max(kBvhDefaultMaxLeafSize, width));
+            m_geometryDirty = true;
+        }
+    }
+    
     virtual bool intersect(Intersection& intersection)
     {
         // Transform ray to the local space of our transformation
@@ -86,48 +221,92 @@ public:
         return m_bbox;
     }
     
+    virtual BBox bboxAtTime(float time)
+    {
+        // Use the tight bbox if we have one for this time, otherwise settle for
+        // transforming the local bbox
+        for (size_t ti = 0; ti < m_keyBBoxes.size(); ++ti)
+        {
+            if (m_transform.keyTime(ti) == time)
+                return m_keyBBoxes[ti];
+        }
+        return m_localBBox.transformFromLocal(time, m_transform);
+    }
+    
     virtual void prepare()
     {
         Shape::prepare();
         
-        // Calculate the bounding box (in non-local space!)
+        // Always redo the geometry when prepared directly, in case the BVH
+        // settings changed
+        m_geometryDirty = true;
+        prepareGeometry();
+        
+        // Calculate the bounding box (in non-local space!), both at each
+        // transform key and over all of them
         m_bbox = BBox();
+        m_keyBBoxes.assign(m_transform.numKeys(), BBox());
         for (size_t ti = 0; ti < m_transform.numKeys(); ++ti)
         {
             float time = m_transform.keyTime(ti);
             for (size_t i = 0; i < m_vertices.size(); ++i)
             {
-                m_bbox.expand(m_transform.fromLocalPoint(time, m_vertices[i]));
+                m_keyBBoxes[ti].expand(m_transform.fromLocalPoint(time, m_vertices[i]));
             }
+            m_bbox = m_bbox.combined(m_keyBBoxes[ti]);
         }
+    }
+    
+    // Get everything ready that only depends on the mesh's own geometry (not
+    // where it's placed): the triangles, their areas and the BVH.  prepare()
+    // does this, and so does each Instance of the mesh, but it only happens
+    // once until the geometry changes (or the mesh is prepared again).
+    void prepareGeometry()
+    {
+        if (!m_geometryDirty)
+            return;
         
-        // Calculate total surface area, and the running total of per-face area.
-        // This is used to create the "cumulative distribution function" of the
-        // face areas we can use to quickly choose a face proportional to its
-        // area based on a random number (this means you can use meshes as area
-        // lights).
-        m_faceAreaCDF.clear();
-        m_faceAreaCDF.reserve(m_faces.size() + 1);
+        m_localBBox = BBox();
+        for (size_t i = 0; i < m_vertices.size(); ++i)
+        {
+            m_localBBox.expand(m_vertices[i]);
+        }
+        
+        // Chop the faces up into triangles for ray tracing
+        if (m_trianglesDirty)
+            triangulate();
+        
+        // Calculate total surface area, and set up an alias table over the
+        // triangle areas so we can choose a triangle proportional to its area
+        // from a random number in constant time (this means you can use
+        // meshes as area lights, and big ones cost no more to sample).
+        std::vector<float> triangleAreas(m_numTriangles);
         m_totalArea = 0.0f;
-        for (size_t faceIndex = 0; faceIndex < m_faces.size(); ++faceIndex)
+        for (unsigned int i = 0; i < m_numTriangles; ++i)
         {
-            float faceArea = 0.0f;
-            for (size_t tri = 0; tri < m_faces[faceIndex].m_vertexIndices.size() - 2; ++tri)
-            {
-                Point p0 = m_vertices[m_faces[faceIndex].m_vertexIndices[0]];
-                Point p1 = m_vertices[m_faces[faceIndex].m_vertexIndices[tri + 1]];
-                Point p2 = m_vertices[m_faces[faceIndex].m_vertexIndices[tri + 2]];
-                faceArea += cross(p1 - p0, p2 - p0).length() * 0.5f;
-            }
-            m_faceAreaCDF.push_back(m_totalArea);
-            m_totalArea += faceArea;
+            triangleAreas[i] = elementArea(i);
+            m_totalArea += triangleAreas[i];
         }
-        m_faceAreaCDF.push_back(m_totalArea);
+        m_triangleTable.build(triangleAreas);
+        
+        // Build the BVH so ray intersections are nice and fast (if only the
+        // vertex positions changed since last time, just refit it)
+        m_bvh.update();
         
-        // Build the BVH so ray intersections are nice and fast
-        m_bvh.build();
+        // Lay the triangles out for the SIMD kernels, in the BVH's order
+        packTriangles();
+        
+        m_geometryDirty = false;
     }
     
+    // Bbox of the mesh in its own local space (valid after prepareGeometry())
+    const BBox& localBBox() const { return m_localBBox; }
+    
+    // Intersect a ray that's already in the mesh's local space (leaving out
+    // the mesh's own transform, which is what instances of it want)
+    bool intersectLocal(Intersection& intersection) { return m_bvh.intersect(intersection); }
+    bool doesIntersectLocal(const Ray& ray)         { return m_bvh.doesIntersect(ray); }
+    
     // Given two random numbers between 0.0 and 1.0, find a location + surface
     // normal on the surface of the *light*.
     virtual bool sampleSurface(const Point& refPosition,
@@ -140,48 +319,44 @@ public:
                                Vector& outNormal,
                                float& outPdf)
     {
-        // Select a face based on a random number (u3), proportional to face
-        // surface area; a face with double the surface area of another is twice
-        // as likely to be selected.
-        std::vector<float>::iterator iter = std::upper_bound(m_faceAreaCDF.begin(),
-                                                             m_faceAreaCDF.end(),
-                                                             u3 * m_totalArea);
-        // Get the face index, taking care to make sure we get a face index in range
-        size_t faceIndex;
-        if (iter == m_faceAreaCDF.end())
-            faceIndex = m_faceAreaCDF.size() - 1;
-        else if (iter == m_faceAreaCDF.begin())
-            faceIndex = 0;
-        else
-            faceIndex = std::distance(m_faceAreaCDF.begin(), iter) - 1;
-        // Find the actual triangle on the face we are choosing
-        float faceArea = m_faceAreaCDF[faceIndex + 1] - m_faceAreaCDF[faceIndex];
-        float triangleSelector = (u3 * m_totalArea - m_faceAreaCDF[faceIndex]) / faceArea;
-        float triangleAreaSoFar = 0.0f;
-        for (size_t tri = 0; tri < m_faces[faceIndex].m_vertexIndices.size() - 2; ++tri)
-        {
-            Point p0 = m_vertices[m_faces[faceIndex].m_vertexIndices[0]];
-            Point p1 = m_vertices[m_faces[faceIndex].m_vertexIndices[tri + 1]];
-            Point p2 = m_vertices[m_faces[faceIndex].m_vertexIndices[tri + 2]];
-            triangleAreaSoFar += cross(p1 - p0, p2 - p0).length() * 0.5f;
-            if (triangleSelector * faceArea < triangleAreaSoFar)
-            {
-                // We found our triangle!  Now, find out which point on the
-                // triangle we selected, and put it in non-local space.
-                float alpha = 0.0f, beta = 0.0f;
-                uniformToBarycentricTriangle(u1, u2, alpha, beta);
-                float gamma = 1.0f - alpha - beta;
-                outPosition = p0 * alpha + p1 * beta + p2 * gamma;
-                outPosition = m_transform.fromLocalPoint(refTime, outPosition);
-                // Calculate normal and the PDF of having selected this position (w.r.t. solid angle)
-                outNormal = cross(p1 - p0, p2 - p0);
-                outNormal = m_transform.fromLocalNormal(refTime, outNormal).normalized();
-                Vector toSurf = refPosition - outPosition;
-                outPdf = toSurf.length2() * surfaceAreaPdf() / std::fabs(dot(toSurf.normalized(), outNormal));
-                return true;
-            }
-        }
-        return false;
+        if (!sampleLocalSurface(u1, u2, u3, outPosition, outNormal))
+            return false;
+        // The PDF w.r.t. area in non-local space depends on how the transform
+        // scales the sampled triangle
+        float areaPdf = localSurfaceAreaPdf() / m_transform.fromLocalAreaScale(refTime, outNormal);
+        // Put the position and normal in non-local space
+        outPosition = m_transform.fromLocalPoint(refTime, outPosition);
+        outNormal = m_transform.fromLocalNormal(refTime, outNormal).normalized();
+        // Calculate the PDF of having selected this position (w.r.t. solid angle)
+        Vector toSurf = refPosition - outPosition;
+        outPdf = toSurf.length2() * areaPdf / std::fabs(dot(toSurf.normalized(), outNormal));
+        return true;
+    }
+    
+    // Pick a point on the surface of the mesh in its local space, uniformly by
+    // area, given three random numbers between 0.0 and 1.0.  The normal that
+    // comes back is the (unnormalized) geometric normal there.
+    bool sampleLocalSurface(float u1, float u2, float u3, Point& outPosition, Vector& outNormal) const
+    {
+        if (m_triangleTable.empty())
+            return false;
+        // Select a triangle based on a random number (u3), proportional to
+        // its surface area; a triangle with double the surface area of
+        // another is twice as likely to be selected.
+        const MeshTriangle& tri = m_triangles[m_triangleTable.sample(u3)];
+        // Now, find out which point on the triangle we selected
+        float alpha = 0.0f, beta = 0.0f;
+        uniformToBarycentricTriangle(u1, u2, alpha, beta);
+        float gamma = 1.0f - alpha - beta;
+        outPosition = tri.m_v0 + tri.m_edge1 * beta + tri.m_edge2 * gamma;
+        outNormal = tri.m_normal;
+        return true;
+    }
+    
+    // Likelihood of sampleLocalSurface() picking a point, w.r.t. local area
+    float localSurfaceAreaPdf() const
+    {
+        return m_totalArea > 0.0f ? 1.0f / m_totalArea : 0.0f;
     }
     
     virtual float pdfSA(const Point &refPosition,
@@ -191,61 +366,92 @@ public:
                         const Vector &surfNormal) const
     {
         // Likelihood of having selected this position (w.r.t. solid angle)
+        float areaPdf = localSurfaceAreaPdf() /
+                        m_transform.fromLocalAreaScale(refTime, m_transform.toLocalNormal(refTime, surfNormal));
         Vector toSurf = refPosition - surfPosition;
-        return toSurf.length2() * surfaceAreaPdf() / std::fabs(dot(toSurf.normalized(), surfNormal));
+        return toSurf.length2() * areaPdf / std::fabs(dot(toSurf.normalized(), surfNormal));
     }
     
     virtual float surfaceAreaPdf() const
     {
-        // TODO: this does not account for scaling
-        return 1.0f / m_totalArea;
+        // Exact under uniform scaling; otherwise how much a triangle grows
+        // depends on which way it faces, so settle for the average growth
+        return localSurfaceAreaPdf() / averageAreaScale(m_transform);
     }
     
-    // Methods for BVH build
+    // Methods for BVH build (the elements are the triangles)
     
-    virtual unsigned int numElements() const { return m_faces.size(); }
+    virtual unsigned int numElements() const { return m_numTriangles; }
     
     virtual BBox elementBBox(unsigned int index) const
     {
-        // Build a bbox around the face
+        const MeshTriangle& tri = m_triangles[index];
         BBox bbox;
-        for (size_t i = 0; i < m_faces[index].m_vertexIndices.size(); ++i)
-        {
-            bbox.expand(m_vertices[m_faces[index].m_vertexIndices[i]]);
-        }
+        bbox.expand(tri.m_v0);
+        bbox.expand(tri.m_v0 + tri.m_edge1);
+        bbox.expand(tri.m_v0 + tri.m_edge2);
         return bbox;
     }
     
     virtual float elementArea(unsigned int index) const
     {
-        return m_faceAreaCDF[index + 1] - m_faceAreaCDF[index];
+        return m_triangles[index].m_normal.length() * 0.5f;
     }
     
+    // Faces are in local space, so they don't move as far as the BVH is concerned
+    virtual unsigned int numTimeKeys()                         const { return 1; }
+    virtual float        timeKey(unsigned int)                 const { return 0.0f; }
+    virtual BBox         elementBBox(unsigned int index, unsigned int) const { return elementBBox(index); }
+    virtual bool         elementMovesLinearly(unsigned int, unsigned int) const { return true; }
+    
     // Methods for BVH intersection
     
     virtual bool intersect(Intersection& intersection, unsigned int index)
     {
-        // Intersect the triangles of the face, bailing if we find one; we can
-        // to this because we assume and hope the triangles are coplanar with
-        // each other.  The first one to claim the intersection thus wins.
-        bool intersectAny = false;
-        for (size_t i = 0; i < m_faces[index].m_vertexIndices.size() - 2; ++i)
+        return intersectTri(m_triangles[index], intersection);
+    }
+    
+    virtual bool doesIntersect(const Ray& ray, unsigned int index)
+    {
+        return doesIntersectTri(m_triangles[index], ray);
+    }
+    
+    virtual bool intersectLeaf(Intersection& intersection, unsigned int firstPrim, unsigned int numPrims)
+    {
+        const unsigned int *primIndices = m_bvh.primIndices();
+        if (m_triangleKernel == kTriangleKernelScalar)
         {
-            if (intersectTri(index, i, intersection))
-                intersectAny = true;
+            bool intersected = false;
+            for (unsigned int i = firstPrim; i < firstPrim + numPrims; ++i)
+            {
+                if (intersectTri(m_triangles[primIndices[i]], intersection))
+                    intersected = true;
+            }
+            return intersected;
         }
-        return intersectAny;
+        
+        float t, beta, gamma;
+        int hit = intersectTrianglePackets(m_triangleKernel, &m_packets[m_leafPackets[firstPrim]], numPrims,
+                                           intersection.m_ray, intersection.m_t, t, beta, gamma);
+        if (hit < 0)
+            return false;
+        setIntersection(m_triangles[primIndices[firstPrim + hit]], t, beta, gamma, intersection);
+        return true;
     }
     
-    virtual bool doesIntersect(const Ray& ray, unsigned int index)
+    virtual bool doesIntersectLeaf(const Ray& ray, unsigned int firstPrim, unsigned int numPrims)
     {
-        // Intersect the triangles of the face
-        for (size_t i = 0; i < m_faces[index].m_vertexIndices.size() - 2; ++i)
+        if (m_triangleKernel == kTriangleKernelScalar)
         {
-            if (doesIntersectTri(index, i, ray))
-                return true;
+            const unsigned int *primIndices = m_bvh.primIndices();
+            for (unsigned int i = firstPrim; i < firstPrim + numPrims; ++i)
+            {
+                if (doesIntersectTri(m_triangles[primIndices[i]], ray))
+                    return true;
+            }
+            return false;
         }
-        return false;
+        return doesIntersectTrianglePackets(m_triangleKernel, &m_packets[m_leafPackets[firstPrim]], numPrims, ray);
     }
 
 protected:
@@ -254,16 +460,80 @@ protected:
     std::vector<Face> m_faces;
     Material *m_pMaterial;
     BBox m_bbox;
-    Bvh<Mesh> m_bvh;
-    std::vector<float> m_faceAreaCDF;
+    BBox m_localBBox;
+    std::vector<BBox> m_keyBBoxes;
+    std::vector<MeshTriangle, AlignedAllocator<MeshTriangle, 16> > m_triangles;
+    unsigned int m_numTriangles;
+    bool m_trianglesDirty;
+    bool m_geometryDirty;
+    std::vector<TrianglePacket, AlignedAllocator<TrianglePacket> > m_packets;
+    std::vector<unsigned int> m_leafPackets;
+    TriangleKernel m_triangleKernel;
+    Bvh4<Mesh> m_bvh;
+    AliasTable m_triangleTable;
     float m_totalArea;
     
-    bool intersectTri(unsigned int faceIndex, unsigned int tri, Intersection& intersection)
+    void triangulate()
+    {
+        m_triangles.clear();
+        m_triangles.reserve(m_numTriangles);
+        for (size_t faceIndex = 0; faceIndex < m_faces.size(); ++faceIndex)
+        {
+            const Face& face = m_faces[faceIndex];
+            for (size_t tri = 0; tri < face.m_vertexIndices.size() - 2; ++tri)
+            {
+                Point p0 = m_vertices[face.m_vertexIndices[0]];
+                Point p1 = m_vertices[face.m_vertexIndices[tri + 1]];
+                Point p2 = m_vertices[face.m_vertexIndices[tri + 2]];
+                MeshTriangle triangle;
+                triangle.m_v0 = p0;
+                triangle.m_edge1 = p1 - p0;
+                triangle.m_edge2 = p2 - p0;
+                triangle.m_normal = cross(triangle.m_edge1, triangle.m_edge2);
+                triangle.m_face = faceIndex;
+                triangle.m_fanIndex = tri;
+                m_triangles.push_back(triangle);
+            }
+        }
+        m_trianglesDirty = false;
+    }
+    
+    // Pack each BVH leaf's triangles into its own run of packets, and keep
+    // track of where each leaf's run starts (by the leaf's first prim)
+    void packTriangles()
+    {
+        m_packets.clear();
+        m_leafPackets.assign(m_numTriangles, 0);
+        const BvhNode *nodes = m_bvh.binary().nodes();
+        const unsigned int *primIndices = m_bvh.primIndices();
+        for (unsigned int i = 0; i < m_bvh.binary().numNodes(); ++i)
+        {
+            if (nodes[i].interiorNode() || nodes[i].numPrims() == 0)
+                continue;
+            unsigned int firstPrim = nodes[i].firstPrim();
+            m_leafPackets[firstPrim] = (unsigned int)m_packets.size();
+            for (unsigned int p = 0; p < nodes[i].numPrims(); ++p)
+            {
+                unsigned int lane = p % kTrianglePacketWidth;
+                if (lane == 0)
+                    m_packets.push_back(TrianglePacket()); // All zeroes
+                const MeshTriangle& tri = m_triangles[primIndices[firstPrim + p]];
+                float components[kTrianglePacketComponents] =
+                {
+                    tri.m_v0.m_x,    tri.m_v0.m_y,    tri.m_v0.m_z,
+                    tri.m_edge1.m_x, tri.m_edge1.m_y, tri.m_edge1.m_z,
+                    tri.m_edge2.m_x, tri.m_edge2.m_y, tri.m_edge2.m_z
+                };
+                for (unsigned int c = 0; c < kTrianglePacketComponents; ++c)
+                {
+                    m_packets.back().m_components[c][lane] = components[c];
+                }
+            }
+        }
+    }
+    
+    bool intersectTri(const MeshTriangle& tri, Intersection& intersection)
     {
-        unsigned int v0 = m_faces[faceIndex].m_vertexIndices[0];
-        unsigned int v1 = m_faces[faceIndex].m_vertexIndices[tri + 1];
-        unsigned int v2 = m_faces[faceIndex].m_vertexIndices[tri + 2];
-        
         // Moller-Trumbore ray-triangle intersection test.  The point here is to
         // find the barycentric coordinates of the triangle where the ray hits
         // the plane the triangle lives in.  If the barycentric coordinates
@@ -273,45 +543,52 @@ protected:
         // on the values at the intersection.  So if we store things at the
         // vertices (like normals, UVs, colors, etc) we can just weight them
         // with the barycentric coordinates to get the interpolated result.
+        // The edges and normal were worked out ahead of time; the ray origin to
+        // the other two vertices is just origin to v0 plus an edge, and the
+        // origin to v0 part drops out of the dot products with the cross
+        // product, so only the edges are needed for beta and gamma.
         
-        Vector v0To1 = m_vertices[v1] - m_vertices[v0];
-        Vector v0To2 = m_vertices[v2] - m_vertices[v0];
-        Vector gnormal = cross(v0To1, v0To2);
-        float det = -dot(intersection.m_ray.m_direction, gnormal);
+        float det = -dot(intersection.m_ray.m_direction, tri.m_normal);
         if (det == 0.0f)
             return false;
         
-        Vector rOriginToV0 = m_vertices[v0] - intersection.m_ray.m_origin;
+        Vector rOriginToV0 = tri.m_v0 - intersection.m_ray.m_origin;
         Vector rayVertCross = cross(intersection.m_ray.m_direction, rOriginToV0);
-        Vector rOriginToV1 = m_vertices[v1] - intersection.m_ray.m_origin;
         float invDet = 1.0f / det;
         
         // Calculate barycentric gamma coord
-        float gamma = -dot(rOriginToV1, rayVertCross) * invDet;
+        float gamma = -dot(tri.m_edge1, rayVertCross) * invDet;
         if (gamma < 0.0f || gamma > 1.0f)
             return false;
         
-        Vector rOriginToV2 = m_vertices[v2] - intersection.m_ray.m_origin;
-        
         // Calculate barycentric beta coord
-        float beta = dot(rOriginToV2, rayVertCross) * invDet;
+        float beta = dot(tri.m_edge2, rayVertCross) * invDet;
         if (beta < 0.0f || beta + gamma > 1.0f)
             return false;
         
-        float t = -dot(rOriginToV0, gnormal) * invDet;
+        float t = -dot(rOriginToV0, tri.m_normal) * invDet;
         if (t < kRayTMin || t >= intersection.m_t)
             return false;
         
-        float alpha = 1.0f - beta - gamma;
+        setIntersection(tri, t, beta, gamma, intersection);
+        return true;
+    }
     
+    // Fill out the intersection for a hit on a triangle, given the distance
+    // and barycentric coords of the hit
+    void setIntersection(const MeshTriangle& tri, float t, float beta, float gamma, Intersection& intersection)
+    {
+        float alpha = 1.0f - beta - gamma;
+        
         // Calculate shading normal...
         Vector shadingNormal;
-        if (!m_faces[faceIndex].m_normalIndices.empty())
+        const Face& face = m_faces[tri.m_face];
+        if (!face.m_normalIndices.empty())
         {
             // We have normals stored at the vertices, so use them.
-            unsigned int n0 = m_faces[faceIndex].m_normalIndices[0];
-            unsigned int n1 = m_faces[faceIndex].m_normalIndices[tri + 1];
-            unsigned int n2 = m_faces[faceIndex].m_normalIndices[tri + 2];
+            unsigned int n0 = face.m_normalIndices[0];
+            unsigned int n1 = face.m_normalIndices[tri.m_fanIndex + 1];
+            unsigned int n2 = face.m_normalIndices[tri.m_fanIndex + 2];
             
             // Weight normals at each vertex by barycentric coords to create
             // the interpolated normal at the intersection point.
@@ -323,7 +600,7 @@ protected:
         else
         {
             // Use the geometric (flat-shaded) normal
-            shadingNormal = gnormal;
+            shadingNormal = tri.m_normal;
         }
         
         intersection.m_t = t;
@@ -331,47 +608,31 @@ protected:
         intersection.m_pMaterial = m_pMaterial;
         intersection.m_normal = shadingNormal;
         intersection.m_colorModifier = Color(1.0f);
-        
-        return true;
     }
     
-    bool doesIntersectTri(unsigned int faceIndex, unsigned int tri, const Ray& ray)
+    bool doesIntersectTri(const MeshTriangle& tri, const Ray& ray)
     {
-        unsigned int v0 = m_faces[faceIndex].m_vertexIndices[0];
-        unsigned int v1 = m_faces[faceIndex].m_vertexIndices[tri + 1];
-        unsigned int v2 = m_faces[faceIndex].m_vertexIndices[tri + 2];
-        
-        // Moller-Trumbore ray-triangle intersection test.  The point here is to
-        // find the barycentric coordinates of the triangle where the ray hits
-        // the plane the triangle lives in.  If the barycentric coordinates
-        // alpha, beta, gamma all add up to 1 (and each is in the 0.0 to 1.0
-        // range) then we have a valid intersection in the triangle.
+        // Same Moller-Trumbore test as above, minus the shading
         
-        Vector v0To1 = m_vertices[v1] - m_vertices[v0];
-        Vector v0To2 = m_vertices[v2] - m_vertices[v0];
-        Vector gnormal = cross(v0To1, v0To2);
-        float det = -dot(ray.m_direction, gnormal);
+        float det = -dot(ray.m_direction, tri.m_normal);
         if (det == 0.0f)
             return false;
         
-        Vector rOriginToV0 = m_vertices[v0] - ray.m_origin;
+        Vector rOriginToV0 = tri.m_v0 - ray.m_origin;
         Vector rayVertCross = cross(ray.m_direction, rOriginToV0);
-        Vector rOriginToV1 = m_vertices[v1] - ray.m_origin;
         float invDet = 1.0f / det;
         
         // Calculate barycentric gamma coord
-        float gamma = -dot(rOriginToV1, rayVertCross) * invDet;
+        float gamma = -dot(tri.m_edge1, rayVertCross) * invDet;
         if (gamma < 0.0f || gamma > 1.0f)
             return false;
         
-        Vector rOriginToV2 = m_vertices[v2] - ray.m_origin;
-        
         // Calculate barycentric beta coord
-        float beta = dot(rOriginToV2, rayVertCross) * invDet;
+        float beta = dot(tri.m_edge2, rayVertCross) * invDet;
         if (beta < 0.0f || beta + gamma > 1.0f)
             return false;
         
-        float t = -dot(rOriginToV0, gnormal) * invDet;
+        float t = -dot(rOriginToV0, tri.m_normal) * invDet;
         if (t < kRayTMin || t >= ray.m_tMax)
             return false;
         
@@ -380,7 +641,155 @@ protected:
 };
 
 
-Mesh* createFromOBJFile(const char* filename);
+// One placement of a mesh.  An instance has its own transform and (optionally)
+// its own material, but shares the mesh's vertices, triangles and BVH with
+// every other instance of it, so placing the same mesh many times only costs
+// an instance's worth of memory each.  The mesh doesn't need to be in the
+// scene itself; if it is, its own transform doesn't carry over to instances.
+class Instance : public Shape
+{
+public:
+    Instance(Mesh* pMesh, Material* pMaterial = NULL)
+        : Shape(),
+          m_pMesh(pMesh),
+          m_pMaterial(pMaterial),
+          m_bbox()
+    {
+        
+    }
+    
+    virtual ~Instance() { }
+    
+    Mesh* mesh() const { return m_pMesh; }
+    
+    // With no material of its own, the instance uses the mesh's material
+    void setMaterial(Material* pMaterial) { m_pMaterial = pMaterial; }
+    
+    virtual bool intersect(Intersection& intersection)
+    {
+        // Transform ray to the local space of our transformation, and let the
+        // mesh's BVH find the intersection
+        Ray nonLocalRay = intersection.m_ray;
+        intersection.m_ray = intersection.m_ray.transformToLocal(m_transform);
+        bool intersected = m_pMesh->intersectLocal(intersection);
+        // Patch ray back to non-local space, and claim the intersection as ours
+        if (intersected)
+        {
+            intersection.m_normal = m_transform.fromLocalNormal(nonLocalRay.m_time, intersection.m_normal);
+            intersection.m_pShape = this;
+            if (m_pMaterial != NULL)
+                intersection.m_pMaterial = m_pMaterial;
+        }
+        intersection.m_ray = nonLocalRay;
+        return intersected;
+    }
+    
+    virtual bool doesIntersect(const Ray& ray)
+    {
+        Ray localRay = ray.transformToLocal(m_transform);
+        return m_pMesh->doesIntersectLocal(localRay);
+    }
+    
+    virtual BBox bbox()
+    {
+        // This is only valid after prepare() is called
+        return m_bbox;
+    }
+    
+    virtual BBox bboxAtTime(float time)
+    {
+        return m_pMesh->localBBox().transformFromLocal(time, m_transform);
+    }
+    
+    virtual void prepare()
+    {
+        Shape::prepare();
+        
+        // The mesh only actually gets prepared by the first of its instances
+        m_pMesh->prepareGeometry();
+        
+        // Put the mesh's local bbox in non-local space at each transform key.
+        // Transforming all the vertices would be tighter, but that's a cost
+        // per instance that grows with the mesh.
+        m_bbox = BBox();
+        for (size_t ti = 0; ti < m_transform.numKeys(); ++ti)
+        {
+            m_bbox = m_bbox.combined(bboxAtTime(m_transform.keyTime(ti)));
+        }
+    }
+    
+    virtual bool sampleSurface(const Point& refPosition,
+                               const Vector& refNormal,
+                               float refTime,
+                               float u1,
+                               float u2,
+                               float u3,
+                               Point& outPosition,
+                               Vector& outNormal,
+                               float& outPdf)
+    {
+        if (!m_pMesh->sampleLocalSurface(u1, u2, u3, outPosition, outNormal))
+            return false;
+        float areaPdf = m_pMesh->localSurfaceAreaPdf() / m_transform.fromLocalAreaScale(refTime, outNormal);
+        outPosition = m_transform.fromLocalPoint(refTime, outPosition);
+        outNormal = m_transform.fromLocalNormal(refTime, outNormal).normalized();
+        Vector toSurf = refPosition - outPosition;
+        outPdf = toSurf.length2() * areaPdf / std::fabs(dot(toSurf.normalized(), outNormal));
+        return true;
+    }
+    
+    virtual float pdfSA(const Point &refPosition,
+                        const Vector &refNormal,
+                        float refTime,
+                        const Point &surfPosition,
+                        const Vector &surfNormal) const
+    {
+        float areaPdf = m_pMesh->localSurfaceAreaPdf() /
+                        m_transform.fromLocalAreaScale(refTime, m_transform.toLocalNormal(refTime, surfNormal));
+        Vector toSurf = refPosition - surfPosition;
+        return toSurf.length2() * areaPdf / std::fabs(dot(toSurf.normalized(), surfNormal));
+    }
+    
+    virtual float surfaceAreaPdf() const
+    {
+        // Same as the mesh's, but with our own transform
+        return m_pMesh->localSurfaceAreaPdf() / averageAreaScale(m_transform);
+    }
+    
+protected:
+    Mesh *m_pMesh;
+    Material *m_pMaterial;
+    BBox m_bbox;
+};
+
+
+// Load a mesh from an OBJ file.  Given a cache directory, this keeps a cache
+// file there (see meshCacheFilename()) holding the parsed mesh and its BVH,
+// so later loads of the same file skip both parsing and building.  If the OBJ
+// changes, the cache is noticed to be stale and gets replaced.  An empty
+// directory means defaultMeshCacheDirectory(), and NULL turns the cache off.
+// Passing the OBJ's own directory keeps the caches next to the OBJs.
+Mesh* createFromOBJFile(const char* filename, const char* cacheDirectory = "");
+
+
+// Mesh cache files (see MeshCache.cpp).  Caches are tagged with a hash of the
+// source file's contents, and only load if the hash (and the BVH build
+// settings) match.  Writing builds the mesh's BVH first if need be.
+bool hashFileContents(const char* filename, uint64_t& outHash);
+Mesh* readMeshCache(const char* cacheFilename, uint64_t sourceHash);
+
+// The cache file for an OBJ: the OBJ's file name, then a hash of its absolute
+// path and ".rbvh", so same-named OBJs from different directories can share a
+// cache directory without clobbering each other's caches
+std::string meshCacheFilename(const char* filename, const std::string& cacheDirectory);
+bool writeMeshCache(const char* cacheFilename, Mesh& mesh, uint64_t sourceHash);
+
+// Per-user directory for mesh caches ($XDG_CACHE_HOME/rayito, ~/.cache/rayito,
+// or %LOCALAPPDATA%\rayito on Windows); empty if there's nowhere to put one
+std::string defaultMeshCacheDirectory();
+
+// Make a directory and any missing parents; true if it's there afterward
+bool makeDirectories(const char* path);
 
 
 } // namespace Rayito
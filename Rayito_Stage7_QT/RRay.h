@@ -77,6 +77,13 @@ struct Ray
     // The rotation quaternion should be normalized first before being used here!
     Ray transformToLocal(const Transform& txform) const
     {
+        // Prepared transforms have their matrices cached; look one up once and
+        // use it for both the origin and direction
+        if (txform.hasMatrices())
+        {
+            Matrix3x4 toLocal = txform.toLocalMatrix(m_time);
+            return Ray(toLocal.transformPoint(m_origin), toLocal.transformVector(m_direction), m_tMax, m_time);
+        }
         return Ray(txform.toLocalPoint(m_time, m_origin), txform.toLocalVector(m_time, m_direction), m_tMax, m_time);
     }
     
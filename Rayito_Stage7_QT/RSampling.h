@@ -9,6 +9,7 @@
 
 #include <cmath>
 #include <algorithm>
+#include <vector>
 
 #include "RMath.h"
 
@@ -58,6 +59,71 @@ struct Rng
 };
 
 
+// Bulk sample generation works on this many values at a time
+const unsigned int kSampleLanes = 8;
+
+
+// Eight xoshiro128** generators running side by side, each with its own state.
+// Every lane does the same plain integer ops, so the loops over the lanes
+// compile to SIMD code and make 8 random values for about the cost of one.
+// See http://prng.di.unimi.it/
+struct Rng8
+{
+    unsigned int m_s0[kSampleLanes], m_s1[kSampleLanes], m_s2[kSampleLanes], m_s3[kSampleLanes];
+    
+    explicit Rng8(unsigned int seed = 0)
+    {
+        // The lanes' states come from a SplitMix32 sequence on the seed (the
+        // Murmur3 finalizer on a Weyl sequence), so they're never all zero
+        for (unsigned int lane = 0; lane < kSampleLanes; ++lane)
+        {
+            m_s0[lane] = splitMix32(seed);
+            m_s1[lane] = splitMix32(seed);
+            m_s2[lane] = splitMix32(seed);
+            m_s3[lane] = splitMix32(seed);
+        }
+    }
+    
+    
+    // Returns 32 random bits in each lane of out
+    void nextUInt32(unsigned int *out)
+    {
+        for (unsigned int lane = 0; lane < kSampleLanes; ++lane)
+        {
+            unsigned int scrambled = m_s1[lane] * 5;
+            out[lane] = ((scrambled << 7) | (scrambled >> 25)) * 9;
+            unsigned int t = m_s1[lane] << 9;
+            m_s2[lane] ^= m_s0[lane];
+            m_s3[lane] ^= m_s1[lane];
+            m_s1[lane] ^= m_s2[lane];
+            m_s0[lane] ^= m_s3[lane];
+            m_s2[lane] ^= t;
+            m_s3[lane] = (m_s3[lane] << 11) | (m_s3[lane] >> 21);
+        }
+    }
+    
+    // Fills out[0, count) with random bits, 8 values per step
+    void fill(unsigned int *out, size_t count)
+    {
+        unsigned int values[kSampleLanes];
+        for (size_t i = 0; i < count; i += kSampleLanes)
+        {
+            nextUInt32(values);
+            std::copy(values, values + std::min(size_t(kSampleLanes), count - i), out + i);
+        }
+    }
+    
+protected:
+    static unsigned int splitMix32(unsigned int& state)
+    {
+        unsigned int z = (state += 0x9e3779b9u);
+        z = (z ^ (z >> 16)) * 0x85ebca6bu;
+        z = (z ^ (z >> 13)) * 0xc2b2ae35u;
+        return z ^ (z >> 16);
+    }
+};
+
+
 const unsigned int kUnlimitedSamples = 0;
 
 
@@ -103,6 +169,23 @@ public:
     
     virtual void refill(unsigned int permutation) = 0;
     
+    // Bulk versions of sample1D() and sample2D(), for samples [first, first + count)
+    virtual void fill1D(unsigned int first, unsigned int count, float *out)
+    {
+        for (unsigned int i = 0; i < count; ++i)
+            out[i] = sample1D(first + i);
+    }
+    
+    virtual void fill2D(unsigned int first, unsigned int count, float *outD1, float *outD2)
+    {
+        for (unsigned int i = 0; i < count; ++i)
+            sample2D(first + i, outD1[i], outD2[i]);
+    }
+    
+    // Says samples [first, end) are the ones coming up (until the next
+    // refill), so samplers that can make them faster in bulk may do so
+    virtual void expectSamples(unsigned int first, unsigned int end) { }
+    
 protected:
     Rng& m_rng;
     unsigned int m_currentSampleIndex;
@@ -258,13 +341,15 @@ public:
                                  Rng& rng,
                                  unsigned int permutation)
         : Sampler(rng), m_permutation(permutation), m_xSamples(xSamples),
-          m_ySamples(ySamples), m_is2D(true) { }
+          m_ySamples(ySamples), m_is2D(true), m_cacheFirst(0), m_cacheCount(0),
+          m_cacheFilled(false) { }
     
     CorrelatedMultiJitterSampler(unsigned int samples,
                                  Rng& rng,
                                  unsigned int permutation)
         : Sampler(rng), m_permutation(permutation), m_xSamples(samples),
-          m_ySamples(0), m_is2D(false) { }
+          m_ySamples(0), m_is2D(false), m_cacheFirst(0), m_cacheCount(0),
+          m_cacheFilled(false) { }
     
     virtual ~CorrelatedMultiJitterSampler() { }
     
@@ -273,6 +358,12 @@ public:
     {
         if (m_is2D || index >= m_xSamples)
             return m_rng.nextFloat(); // Bad, bad programmer!  Using a 1D sample from a 2D pattern?
+        if (index - m_cacheFirst < m_cacheCount)
+        {
+            if (!m_cacheFilled)
+                fillCache();
+            return m_cacheD1[index - m_cacheFirst];
+        }
         unsigned int permutedIndex = permute(index, m_xSamples, m_permutation * 0x8ff3cd11);
         float sx = randFloat01(permutedIndex, m_permutation * 0xa399d265);
         return (permutedIndex + sx) / float(m_xSamples);
@@ -293,6 +384,13 @@ public:
             outD1 = m_rng.nextFloat(); 
             outD2 = m_rng.nextFloat();
         }
+        else if (index - m_cacheFirst < m_cacheCount)
+        {
+            if (!m_cacheFilled)
+                fillCache();
+            outD1 = m_cacheD1[index - m_cacheFirst];
+            outD2 = m_cacheD2[index - m_cacheFirst];
+        }
         else
         {
             unsigned int permutedIndex = permute(index, m_xSamples * m_ySamples, m_permutation * 0xc2d3c8fb);
@@ -316,11 +414,96 @@ public:
     {
         m_permutation = permutation;
         m_currentSampleIndex = 0;
+        m_cacheCount = 0;
+        m_cacheFilled = false;
+    }
+    
+    // Same samples as sample1D(), made 8 at a time
+    virtual void fill1D(unsigned int first, unsigned int count, float *out)
+    {
+        if (m_is2D || first + count > m_xSamples)
+        {
+            Sampler::fill1D(first, count, out);
+            return;
+        }
+        unsigned int index[kSampleLanes], permutedIndex[kSampleLanes];
+        float sx[kSampleLanes];
+        for (unsigned int i = 0; i < count; i += kSampleLanes)
+        {
+            // Lanes past the end redo the first sample, and get dropped
+            for (unsigned int lane = 0; lane < kSampleLanes; ++lane)
+                index[lane] = i + lane < count ? first + i + lane : first;
+            permute8(index, m_xSamples, m_permutation * 0x8ff3cd11, permutedIndex);
+            randFloat01x8(permutedIndex, m_permutation * 0xa399d265, sx);
+            unsigned int lanes = std::min(kSampleLanes, count - i);
+            for (unsigned int lane = 0; lane < lanes; ++lane)
+                out[i + lane] = (permutedIndex[lane] + sx[lane]) / float(m_xSamples);
+        }
+    }
+    
+    // Same samples as sample2D(), made 8 at a time
+    virtual void fill2D(unsigned int first, unsigned int count, float *outD1, float *outD2)
+    {
+        if (!m_is2D || first + count > m_xSamples * m_ySamples || m_xSamples * m_ySamples > (1u << 24))
+        {
+            Sampler::fill2D(first, count, outD1, outD2);
+            return;
+        }
+        unsigned int index[kSampleLanes], permutedIndex[kSampleLanes];
+        unsigned int column[kSampleLanes], row[kSampleLanes], ix[kSampleLanes], iy[kSampleLanes];
+        float sx[kSampleLanes], sy[kSampleLanes];
+        for (unsigned int i = 0; i < count; i += kSampleLanes)
+        {
+            for (unsigned int lane = 0; lane < kSampleLanes; ++lane)
+                index[lane] = i + lane < count ? first + i + lane : first;
+            permute8(index, m_xSamples * m_ySamples, m_permutation * 0xc2d3c8fb, permutedIndex);
+            divide8(permutedIndex, m_xSamples, row, column);
+            permute8(column, m_xSamples, m_permutation * 0xa511e9b3, ix);
+            permute8(row, m_ySamples, m_permutation * 0x63d83595, iy);
+            randFloat01x8(permutedIndex, m_permutation * 0xa399d265, sx);
+            randFloat01x8(permutedIndex, m_permutation * 0x711ad6a5, sy);
+            unsigned int lanes = std::min(kSampleLanes, count - i);
+            for (unsigned int lane = 0; lane < lanes; ++lane)
+            {
+                outD1[i + lane] = (int(ix[lane]) + (int(iy[lane]) + sx[lane]) / float(m_ySamples)) / float(m_xSamples);
+                outD2[i + lane] = (permutedIndex[lane] + sy[lane]) / float(m_xSamples * m_ySamples);
+            }
+        }
+    }
+    
+    // The expected samples all get made in one go, the first time any of
+    // them is asked for (patterns that a pixel's paths never reach cost nothing)
+    virtual void expectSamples(unsigned int first, unsigned int end)
+    {
+        unsigned int total = m_is2D ? m_xSamples * m_ySamples : m_xSamples;
+        end = std::min(end, total);
+        m_cacheFirst = first;
+        m_cacheCount = first < end ? end - first : 0;
+        m_cacheFilled = false;
     }
     
 protected:
     unsigned int m_permutation, m_xSamples, m_ySamples;
     bool m_is2D;
+    // Samples [m_cacheFirst, m_cacheFirst + m_cacheCount), made by expectSamples()
+    unsigned int m_cacheFirst, m_cacheCount;
+    bool m_cacheFilled;
+    std::vector<float> m_cacheD1, m_cacheD2;
+    
+    void fillCache()
+    {
+        m_cacheD1.resize(m_cacheCount);
+        if (m_is2D)
+        {
+            m_cacheD2.resize(m_cacheCount);
+            fill2D(m_cacheFirst, m_cacheCount, &m_cacheD1[0], &m_cacheD2[0]);
+        }
+        else
+        {
+            fill1D(m_cacheFirst, m_cacheCount, &m_cacheD1[0]);
+        }
+        m_cacheFilled = true;
+    }
     
     // Permute a value in pseudo-random fashion via hashing.  Achieves avalanche
     // and works on values up to 2^27.  Uses "cycle-walking" when len is not a
@@ -372,6 +555,241 @@ protected:
         i *= 1 | permutation >> 18;
         return i * 2.328306e-10f;
     }
+    
+    // permute() on 8 values at once.  Lanes keep hashing until every one of
+    // them has landed below num, and each keeps the first value that did.
+    static void permute8(const unsigned int *in, unsigned int num, unsigned int permutation, unsigned int *out)
+    {
+        unsigned int w = num - 1;
+        w |= w >> 1;
+        w |= w >> 2;
+        w |= w >> 4;
+        w |= w >> 8;
+        w |= w >> 16;
+        unsigned int i[kSampleLanes], walking[kSampleLanes];
+        for (unsigned int lane = 0; lane < kSampleLanes; ++lane)
+        {
+            i[lane] = in[lane];
+            walking[lane] = ~0u;
+            out[lane] = 0;
+        }
+        unsigned int anyWalking;
+        do
+        {
+            anyWalking = 0;
+            for (unsigned int lane = 0; lane < kSampleLanes; ++lane)
+            {
+                unsigned int x = i[lane];
+                x ^= permutation;
+                x *= 0xe170893d;
+                x ^= permutation >> 16;
+                x ^= (x & w) >> 4;
+                x ^= permutation >> 8;
+                x *= 0x0929eb3f;
+                x ^= permutation >> 23;
+                x ^= (x & w) >> 1;
+                x *= 1 | permutation >> 27;
+                x *= 0x6935fa69;
+                x ^= (x & w) >> 11;
+                x *= 0x74dcb303;
+                x ^= (x & w) >> 2;
+                x *= 0x9e501cc3;
+                x ^= (x & w) >> 2;
+                x *= 0xc860a3df;
+                x &= w;
+                x ^= x >> 5;
+                i[lane] = x;
+                unsigned int landed = walking[lane] & (x < num ? ~0u : 0u);
+                out[lane] = (out[lane] & ~landed) | (x & landed);
+                walking[lane] &= ~landed;
+                anyWalking |= walking[lane];
+            }
+        } while (anyWalking);
+        // (out + permutation) % num, without a divide per lane: the sum can
+        // wrap past 2^32, and when it does, 2^32 % num comes back off
+        unsigned int permutationRemainder = permutation % num;
+        unsigned int wrapRemainder = (0u - num) % num;
+        for (unsigned int lane = 0; lane < kSampleLanes; ++lane)
+        {
+            unsigned int x = out[lane];
+            unsigned int r = x + permutationRemainder;
+            r -= r >= num ? num : 0;
+            unsigned int wrapped = x + permutation < x ? wrapRemainder : 0;
+            out[lane] = r >= wrapped ? r - wrapped : r + num - wrapped;
+        }
+    }
+    
+    // Quotients and remainders of 8 values (below 2^24) by num, using a float
+    // reciprocal instead of a divide per lane; the guess can be off by one,
+    // which the remainder shows and fixes
+    static void divide8(const unsigned int *in, unsigned int num, unsigned int *quotient, unsigned int *remainder)
+    {
+        float reciprocal = 1.0f / float(num);
+        for (unsigned int lane = 0; lane < kSampleLanes; ++lane)
+        {
+            int q = int(float(in[lane]) * reciprocal);
+            int r = int(in[lane]) - q * int(num);
+            q += r < 0 ? -1 : (r >= int(num) ? 1 : 0);
+            r += r < 0 ? int(num) : (r >= int(num) ? -int(num) : 0);
+            quotient[lane] = q;
+            remainder[lane] = r;
+        }
+    }
+    
+    // randFloat01() on 8 values at once
+    static void randFloat01x8(const unsigned int *in, unsigned int permutation, float *out)
+    {
+        for (unsigned int lane = 0; lane < kSampleLanes; ++lane)
+        {
+            unsigned int i = in[lane];
+            i ^= permutation;
+            i ^= i >> 17;
+            i ^= i >> 10;
+            i *= 0xb36534e5;
+            i ^= i >> 12;
+            i ^= i >> 21;
+            i *= 0x93fc4795;
+            i ^= 0xdf6e307f;
+            i ^= i >> 17;
+            i *= 1 | permutation >> 18;
+            out[lane] = i * 2.328306e-10f;
+        }
+    }
+};
+
+
+// Owen-scrambled Sobol sampler.  Every pattern is the first one or two
+// dimensions of the Sobol sequence, with the sample order shuffled and the
+// points scrambled by hashing (nested uniform scrambling).  The scrambles are
+// seeded from the pattern's dimension and the pixel, so patterns don't
+// correlate with each other, and each one stays stratified for any number of
+// samples (powers of two are best).  Any sample can be looked up on its own,
+// with no tables or per-pixel setup.
+//
+// See "Practical Hash-based Owen Scrambling", Brent Burley, JCGT 9(4), 2020.
+class OwenScrambledSobolSampler : public Sampler
+{
+public:
+    // The dimension is which of the sequence's patterns this is; every use
+    // of random numbers in a path needs a different one.  numDimensions is 1
+    // or 2, and refill() takes the pixel's seed.
+    OwenScrambledSobolSampler(unsigned int dimension,
+                              unsigned int numDimensions,
+                              Rng& rng,
+                              unsigned int seed)
+        : Sampler(rng), m_dimension(dimension), m_is2D(numDimensions == 2) { refill(seed); }
+    
+    virtual ~OwenScrambledSobolSampler() { }
+    
+    
+    virtual float sample1D(unsigned int index)
+    {
+        if (m_is2D)
+            return m_rng.nextFloat(); // Bad, bad programmer!  Using a 1D sample from a 2D pattern?
+        // Dimension 0 is the bit-reversed index, and Owen scrambling works on
+        // the bits reversed, so those cancel
+        unsigned int shuffledIndex = nestedUniformScramble(index, m_indexSeed);
+        return toFloat(reverseBits(laineKarrasPermutation(shuffledIndex, m_seedD1)));
+    }
+
+    virtual unsigned int total1DSamplesAvailable() const
+    {
+        if (m_is2D)
+            return 0;
+        return ~0u;
+    }
+
+    virtual void sample2D(unsigned int index, float& outD1, float& outD2)
+    {
+        if (!m_is2D)
+        {
+            // Bad, bad programmer!  Using a 2D sample from a 1D pattern?
+            outD1 = m_rng.nextFloat(); 
+            outD2 = m_rng.nextFloat();
+            return;
+        }
+        unsigned int shuffledIndex = nestedUniformScramble(index, m_indexSeed);
+        outD1 = toFloat(reverseBits(laineKarrasPermutation(shuffledIndex, m_seedD1)));
+        outD2 = toFloat(nestedUniformScramble(sobolDimension1(shuffledIndex), m_seedD2));
+    }
+
+    virtual unsigned int total2DSamplesAvailable() const
+    {
+        if (!m_is2D)
+            return 0;
+        return ~0u;
+    }
+    
+    virtual void refill(unsigned int seed)
+    {
+        unsigned int patternSeed = hash(hash(seed) + m_dimension);
+        m_indexSeed = hash(patternSeed ^ 0x5bd1e995);
+        m_seedD1 = hash(patternSeed ^ 0x68e31da4);
+        m_seedD2 = hash(patternSeed ^ 0xb5297a4d);
+        m_currentSampleIndex = 0;
+    }
+    
+protected:
+    unsigned int m_dimension;
+    bool m_is2D;
+    unsigned int m_indexSeed, m_seedD1, m_seedD2;
+    
+    // Second dimension of the Sobol sequence (its direction numbers are each
+    // the last one xor'd with itself shifted down one)
+    static unsigned int sobolDimension1(unsigned int index)
+    {
+        unsigned int result = 0;
+        for (unsigned int direction = 1u << 31; index != 0; index >>= 1, direction ^= direction >> 1)
+        {
+            if (index & 1)
+                result ^= direction;
+        }
+        return result;
+    }
+    
+    // Hash-based stand-in for Owen scrambling on bit-reversed values: each bit
+    // only gets changed by the bits below it (Laine-Karras, with Vegdahl's
+    // better constants)
+    static unsigned int laineKarrasPermutation(unsigned int x, unsigned int seed)
+    {
+        x += seed;
+        x ^= x * 0x6c50b47c;
+        x ^= x * 0xb82f1e52;
+        x ^= x * 0xc7afe638;
+        x ^= x * 0x8d22f6e6;
+        return x;
+    }
+    
+    static unsigned int nestedUniformScramble(unsigned int x, unsigned int seed)
+    {
+        return reverseBits(laineKarrasPermutation(reverseBits(x), seed));
+    }
+    
+    static unsigned int reverseBits(unsigned int x)
+    {
+        x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+        x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+        x = ((x >> 4) & 0x0f0f0f0f) | ((x & 0x0f0f0f0f) << 4);
+        x = ((x >> 8) & 0x00ff00ff) | ((x & 0x00ff00ff) << 8);
+        return (x >> 16) | (x << 16);
+    }
+    
+    // Murmur3 finalizer
+    static unsigned int hash(unsigned int x)
+    {
+        x ^= x >> 16;
+        x *= 0x85ebca6b;
+        x ^= x >> 13;
+        x *= 0xc2b2ae35;
+        x ^= x >> 16;
+        return x;
+    }
+    
+    // The top 24 bits, so the result is below 1
+    static float toFloat(unsigned int x)
+    {
+        return (x >> 8) * (1.0f / 16777216.0f);
+    }
 };
 
 
@@ -532,6 +950,104 @@ inline void uniformToBarycentricTriangle(float u1, float u2, float& btu, float&
 }
 
 
+//
+// Discrete distributions
+//
+
+// Walker's alias method: picks one of N entries, with odds proportional to
+// their weights, in constant time from a single random number.  The number
+// picks a bucket, and what's left of it picks between the bucket's own entry
+// and its "alias", another entry that donated its extra weight to fill the
+// bucket up.  Built with Vose's method, which is O(N) and numerically stable.
+//
+// See "A Linear Algorithm For Generating Random Numbers With a Given
+// Distribution", Michael D. Vose, IEEE Trans. Software Eng. 17(9), 1991.
+class AliasTable
+{
+public:
+    AliasTable() : m_buckets() { }
+    
+    void build(const std::vector<float>& weights)
+    {
+        m_buckets.assign(weights.size(), Bucket());
+        double total = 0.0;
+        for (size_t i = 0; i < weights.size(); ++i)
+        {
+            total += std::max(0.0f, weights[i]);
+        }
+        if (total <= 0.0)
+        {
+            m_buckets.clear();
+            return;
+        }
+        
+        // Scale the weights so the average is 1, and sort them into the ones
+        // that can't fill a bucket by themselves and the ones with some to spare
+        std::vector<double> scaled(weights.size());
+        std::vector<unsigned int> under, over;
+        for (size_t i = 0; i < weights.size(); ++i)
+        {
+            scaled[i] = std::max(0.0f, weights[i]) * weights.size() / total;
+            if (scaled[i] < 1.0)
+                under.push_back(i);
+            else
+                over.push_back(i);
+        }
+        
+        // Top off each underfull bucket from an entry with weight to spare
+        while (!under.empty() && !over.empty())
+        {
+            unsigned int small = under.back();
+            unsigned int large = over.back();
+            under.pop_back();
+            m_buckets[small].m_threshold = float(scaled[small]);
+            m_buckets[small].m_alias = large;
+            scaled[large] = (scaled[large] + scaled[small]) - 1.0;
+            if (scaled[large] < 1.0)
+            {
+                over.pop_back();
+                under.push_back(large);
+            }
+        }
+        // Whatever is left is full (give or take roundoff)
+        for (size_t i = 0; i < over.size(); ++i)
+        {
+            m_buckets[over[i]].m_threshold = 1.0f;
+            m_buckets[over[i]].m_alias = over[i];
+        }
+        for (size_t i = 0; i < under.size(); ++i)
+        {
+            m_buckets[under[i]].m_threshold = 1.0f;
+            m_buckets[under[i]].m_alias = under[i];
+        }
+    }
+    
+    bool empty() const { return m_buckets.empty(); }
+    size_t size() const { return m_buckets.size(); }
+    
+    // Pick an entry with a random number between 0.0 and 1.0
+    unsigned int sample(float u) const
+    {
+        float scaled = u * m_buckets.size();
+        unsigned int index = std::min((unsigned int) scaled, (unsigned int) m_buckets.size() - 1);
+        const Bucket& bucket = m_buckets[index];
+        return scaled - index < bucket.m_threshold ? index : bucket.m_alias;
+    }
+    
+protected:
+    // Both halves of a bucket sit together, so a pick touches one cache line
+    struct Bucket
+    {
+        float m_threshold;
+        unsigned int m_alias;
+        
+        Bucket() : m_threshold(1.0f), m_alias(0) { }
+    };
+    
+    std::vector<Bucket> m_buckets;
+};
+
+
 } // namespace Rayito
 
 
@@ -44,6 +44,25 @@ public:
     
     // Get bbox of this shape (and its children)
     virtual BBox bbox() = 0;
+    // Get bbox of this shape at one moment in time (for motion blur); the
+    // bbox over the whole shutter is always a safe answer, if a loose one
+    virtual BBox bboxAtTime(float time) { return bbox(); }
+    // Does the shape rotate between the two times?  If not, it moves in
+    // straight lines, and blending its bboxes at the two times holds it.
+    virtual bool rotatesBetween(float time0, float time1) const
+    {
+        return m_transform.rotatesBetween(time0, time1);
+    }
+    // Add the times this shape's motion changes course at (if it moves)
+    virtual void motionKeyTimes(std::vector<float>& outTimes) const
+    {
+        if (m_transform.numSegments() == 0)
+            return;
+        for (size_t ti = 0; ti < m_transform.numKeys(); ++ti)
+        {
+            outTimes.push_back(m_transform.keyTime(ti));
+        }
+    }
     // Is the bbox of this shape infinitely big in at least one dimension?
     virtual bool infiniteExtent() const { return false; }
     
@@ -113,10 +132,13 @@ protected:
 class ShapeSet : public Shape
 {
 public:
-    ShapeSet() : Shape(), m_shapes(), m_infiniteShapes(), m_bvh(*this) { }
+    ShapeSet() : Shape(), m_shapes(), m_infiniteShapes(), m_timeKeys(), m_bvh(*this, kBvhBuildBinnedSAH) { }
     
     virtual ~ShapeSet() { }
     
+    const Bvh<ShapeSet>& bvh() const { return m_bvh; }
+    Bvh<ShapeSet>&       bvh()       { return m_bvh; }
+    
     virtual bool intersect(Intersection& intersection)
     {
         // Transform ray to local space for intersection
@@ -200,8 +222,24 @@ public:
             Shape *pShape = *iter;
             pShape->prepare();
         }
+        // Gather up the times any of the shapes change course, so the BVH can
+        // keep bounds for each of those times and blend between them.  With
+        // every key in the list, each shape moves in a straight line (at most)
+        // between consecutive keys.
+        m_timeKeys.clear();
+        for (std::vector<Shape*>::iterator iter = m_shapes.begin();
+             iter != m_shapes.end();
+             ++iter)
+        {
+            (*iter)->motionKeyTimes(m_timeKeys);
+        }
+        std::sort(m_timeKeys.begin(), m_timeKeys.end());
+        m_timeKeys.erase(std::unique(m_timeKeys.begin(), m_timeKeys.end()), m_timeKeys.end());
+        
+        // Shapes that just moved (or the same scene prepared again) only need
+        // the BVH refit, not rebuilt
         if (m_shapes.size() > 2)
-            m_bvh.build();
+            m_bvh.update();
     }
     
     virtual BBox bbox()
@@ -257,6 +295,16 @@ public:
     virtual unsigned int numElements()                   const { return m_shapes.size(); }
     virtual BBox         elementBBox(unsigned int index) const { return m_shapes[index]->bbox(); }
     virtual float        elementArea(unsigned int index) const { return 1.0f / m_shapes[index]->surfaceAreaPdf(); }
+    virtual unsigned int numTimeKeys()                   const { return std::max<unsigned int>(1, m_timeKeys.size()); }
+    virtual float        timeKey(unsigned int key)       const { return m_timeKeys.empty() ? 0.0f : m_timeKeys[key]; }
+    virtual BBox elementBBox(unsigned int index, unsigned int key) const
+    {
+        return m_timeKeys.empty() ? m_shapes[index]->bbox() : m_shapes[index]->bboxAtTime(m_timeKeys[key]);
+    }
+    virtual bool elementMovesLinearly(unsigned int index, unsigned int key) const
+    {
+        return m_timeKeys.empty() || !m_shapes[index]->rotatesBetween(m_timeKeys[key], m_timeKeys[key + 1]);
+    }
     
     // Methods for BVH intersection
     virtual bool intersect(Intersection& intersection, unsigned int index) { return m_shapes[index]->intersect(intersection); }
@@ -265,6 +313,7 @@ public:
 protected:
     std::vector<Shape*> m_shapes;
     std::vector<Shape*> m_infiniteShapes;
+    std::vector<float> m_timeKeys;
     Bvh<ShapeSet> m_bvh;
 };
 
@@ -523,6 +572,12 @@ public:
         return result;
     }
     
+    virtual BBox bboxAtTime(float time)
+    {
+        return BBox(m_position - Point(m_radius),
+                    m_position + Point(m_radius)).transformFromLocal(time, m_transform);
+    }
+    
     // Given two random numbers between 0.0 and 1.0, find a location + surface
     // normal on the surface of the *light*.
     virtual bool sampleSurface(const Point& refPosition,
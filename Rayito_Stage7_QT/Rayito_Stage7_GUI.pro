@@ -6,6 +6,8 @@
 
 QT       += core gui
 
+CONFIG   += c++11
+
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 
 TARGET = Rayito_Stage7_GUI
@@ -15,7 +17,11 @@ TEMPLATE = app
 SOURCES += main.cpp\
         MainWindow.cpp \
     RaytraceMain.cpp \
-    OBJMesh.cpp
+    Wavefront.cpp \
+    OBJMesh.cpp \
+    MeshCache.cpp \
+    TriangleKernels.cpp \
+    Scenes.cpp
 
 HEADERS  += MainWindow.h \
     rayito.h \
@@ -1,11 +1,14 @@
 #include <string>
 #include <iostream>
 #include <sstream>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 #include "rayito.h"
 
-#include <QThread>
-
 
 using namespace Rayito;
 
@@ -41,156 +44,623 @@ namespace
 {
 
 
+// Tiles are small enough that there are plenty to go around on a machine with
+// lots of cores, so the expensive parts of the image don't hold up the render.
+const size_t kTileDim = 16;
+
+
+// A rectangle of pixels to render
+struct Tile
+{
+    size_t m_xstart, m_xend, m_ystart, m_yend;
+};
+
+
+//
+// TileQueue hands out tiles to the render threads.  Each thread owns a
+// contiguous run of tiles and takes them from the front; once its run is used
+// up it steals from the front of the other threads' runs.  Owners and thieves
+// both claim a tile with a single atomic increment, so no locks are needed.
+//
+class TileQueue
+{
+public:
+    TileQueue(const std::vector<Tile>& tiles, size_t numWorkers)
+        : m_tiles(tiles), m_numWorkers(numWorkers), m_runs(new Run[numWorkers])
+    {
+        reset();
+    }
+    
+    ~TileQueue() { delete[] m_runs; }
+    
+    // Hand out all the tiles again (for the next pass); only call this while
+    // no thread is taking tiles
+    void reset()
+    {
+        // Split the tiles evenly, with the leftovers going to the first runs
+        size_t perWorker = m_tiles.size() / m_numWorkers;
+        size_t leftover = m_tiles.size() % m_numWorkers;
+        size_t start = 0;
+        for (size_t i = 0; i < m_numWorkers; ++i)
+        {
+            size_t count = perWorker + (i < leftover ? 1 : 0);
+            m_runs[i].m_next.store(start);
+            m_runs[i].m_end = start + count;
+            start += count;
+        }
+    }
+    
+    // Grab the next tile for the given worker; false when the image is done
+    bool nextTile(size_t worker, Tile& outTile)
+    {
+        for (size_t i = 0; i < m_numWorkers; ++i)
+        {
+            Run& run = m_runs[(worker + i) % m_numWorkers];
+            // Cheap check first so finished runs don't get hammered by thieves
+            if (run.m_next.load(std::memory_order_relaxed) >= run.m_end)
+                continue;
+            size_t index = run.m_next.fetch_add(1);
+            if (index < run.m_end)
+            {
+                outTile = m_tiles[index];
+                return true;
+            }
+        }
+        return false;
+    }
+    
+private:
+    // Keep each run on its own cache line so the threads don't fight over them
+    struct Run
+    {
+        std::atomic<size_t> m_next;
+        size_t m_end;
+        char m_padding[64 - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+    };
+    
+    const std::vector<Tile>& m_tiles;
+    size_t m_numWorkers;
+    Run *m_runs;
+    
+    TileQueue(const TileQueue&);
+    TileQueue& operator =(const TileQueue&);
+};
+
+
 //
-// RenderThread works on a small chunk of the image
+// PassControl lines the render threads up on passes.  A pass renders a range of
+// the pixel samples for the whole image; the threads sleep between passes so
+// the image can be looked at (and the render stopped) between them.
 //
-class RenderThread : public QThread
+class PassControl
 {
 public:
-    RenderThread(size_t xstart, size_t xend, size_t ystart, size_t yend,
+    explicit PassControl(size_t numWorkers)
+        : m_numWorkers(numWorkers), m_pass(0), m_firstSample(0), m_endSample(0),
+          m_workersBusy(0), m_done(false) { }
+    
+    // Start the threads on pixel samples [firstSample, endSample) and wait
+    // until they have all finished
+    void runPass(unsigned int firstSample, unsigned int endSample)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_firstSample = firstSample;
+        m_endSample = endSample;
+        m_workersBusy = m_numWorkers;
+        ++m_pass;
+        m_passStarted.notify_all();
+        while (m_workersBusy > 0)
+            m_passFinished.wait(lock);
+    }
+    
+    // No more passes; lets the threads exit
+    void finish()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_done = true;
+        m_passStarted.notify_all();
+    }
+    
+    // Render thread side: wait for a pass after the last one this thread did.
+    // Returns false when the render is over.
+    bool waitForPass(unsigned int& ioPass, unsigned int& outFirstSample, unsigned int& outEndSample)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (!m_done && m_pass == ioPass)
+            m_passStarted.wait(lock);
+        if (m_done)
+            return false;
+        ioPass = m_pass;
+        outFirstSample = m_firstSample;
+        outEndSample = m_endSample;
+        return true;
+    }
+    
+    void workerFinished()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (--m_workersBusy == 0)
+            m_passFinished.notify_one();
+    }
+    
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_passStarted, m_passFinished;
+    size_t m_numWorkers;
+    unsigned int m_pass;
+    unsigned int m_firstSample, m_endSample;
+    size_t m_workersBusy;
+    bool m_done;
+};
+
+
+// Random numbers for one pixel (sampleIndex 0 is for setting up the pixel's
+// sample patterns, and sampleIndex n + 1 is for pixel sample n).  Seeding from
+// where we are in the image means a pixel comes out the same no matter which
+// thread or pass renders it.
+Rng pixelRng(size_t pixelIndex, unsigned int sampleIndex)
+{
+    // Murmur3 finalizer to scramble the bits; MWC seeds just need to be nonzero
+    unsigned int h = static_cast<unsigned int>(pixelIndex) * 0x9e3779b9u + sampleIndex * 0x85ebca6bu;
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    unsigned int z = h;
+    h *= 0x27d4eb2du;
+    h ^= h >> 15;
+    return Rng(z | 1u, h | 1u);
+}
+
+
+// Where each pattern sits in the Sobol sequence's dimensions: the camera's come
+// first, then the same layout over again for each bounce
+enum CameraDimension
+{
+    kDimensionSubpixel = 0,
+    kDimensionLens,
+    kDimensionTime,
+    kNumCameraDimensions
+};
+
+enum BounceDimension
+{
+    kDimensionBounce = 0,
+    kDimensionRoulette,
+    kDimensionLightSelection,
+    kDimensionLightElement,
+    kDimensionLight,
+    kDimensionBrdf,
+    kDimensionStrategy,
+    kNumBounceDimensions
+};
+
+
+// Adaptive sampling doesn't trust a noise estimate from fewer samples than this
+// (with only a few, a pixel that has yet to find the rare bright paths looks
+// flat and clean)
+const unsigned int kMinAdaptiveSamples = 16;
+
+// Dark pixels are judged against this luminance instead, so noise that's
+// invisible in the shadows doesn't keep them sampling forever
+const float kNoiseLuminanceFloor = 0.01f;
+
+
+//
+// PixelStatistics tracks how many samples each pixel has, and the running sums
+// of their luminance that its noise is estimated from.  Pixels get marked as
+// converged once the noise around them is low enough, and are skipped after.
+//
+struct PixelStatistics
+{
+    std::vector<unsigned int> m_numSamples;
+    std::vector<double> m_luminanceSum;
+    std::vector<double> m_luminanceSumSquared;
+    std::vector<unsigned char> m_converged;
+    
+    explicit PixelStatistics(size_t numPixels)
+        : m_numSamples(numPixels, 0), m_luminanceSum(numPixels, 0.0),
+          m_luminanceSumSquared(numPixels, 0.0), m_converged(numPixels, 0) { }
+    
+    // Relative standard error of the pixel's mean luminance (or zero when
+    // there aren't enough samples to tell)
+    float noise(size_t pixelIndex) const
+    {
+        unsigned int n = m_numSamples[pixelIndex];
+        if (n < 2)
+            return 0.0f;
+        double mean = m_luminanceSum[pixelIndex] / n;
+        double variance = (m_luminanceSumSquared[pixelIndex] - m_luminanceSum[pixelIndex] * mean) / (n - 1);
+        double standardError = std::sqrt(std::max(variance, 0.0) / n);
+        return float(standardError / std::max(mean, double(kNoiseLuminanceFloor)));
+    }
+    
+    // Mark the pixels whose neighborhood is clean enough as converged (between
+    // passes, when the pixels aren't changing).  A pixel is judged by the worst
+    // noise in the 3x3 window around it, itself included.  Its own estimate
+    // comes from the same samples as its color, and is too small when they
+    // all happened to agree (say, none found a bright caustic path yet), so
+    // it can't stop a pixel on its own; the neighbors' samples are
+    // independent of it, and the minimum sample count covers the rest.  An
+    // isolated noisy pixel (a small glint) still keeps sampling.
+    void updateConverged(size_t width, size_t height, unsigned int minSamples, float noiseThreshold)
+    {
+        for (size_t y = 0; y < height; ++y)
+        {
+            for (size_t x = 0; x < width; ++x)
+            {
+                size_t pixelIndex = y * width + x;
+                if (m_converged[pixelIndex] || m_numSamples[pixelIndex] < minSamples)
+                    continue;
+                float neighborhoodNoise = 0.0f;
+                for (size_t ny = (y > 0 ? y - 1 : y); ny <= std::min(y + 1, height - 1); ++ny)
+                {
+                    for (size_t nx = (x > 0 ? x - 1 : x); nx <= std::min(x + 1, width - 1); ++nx)
+                    {
+                        neighborhoodNoise = std::max(neighborhoodNoise, noise(ny * width + nx));
+                    }
+                }
+                if (neighborhoodNoise < noiseThreshold)
+                    m_converged[pixelIndex] = 1;
+            }
+        }
+    }
+};
+
+
+//
+// RenderThread renders tiles from the queue for each pass, until the render is
+// over (run() is what each std::thread in the pool executes)
+//
+class RenderThread
+{
+public:
+    RenderThread(size_t worker,
+                 TileQueue& tiles,
+                 PassControl& passes,
                  Image *pImage,
+                 PixelStatistics& stats,
                  ShapeSet& masterSet,
                  const Camera& cam,
-                 std::vector<Shape*>& lights,
+                 const LightTree& lights,
                  unsigned int pixelSamplesHint,
                  unsigned int lightSamplesHint,
-                 unsigned int maxRayDepth)
-        : m_xstart(xstart), m_xend(xend), m_ystart(ystart), m_yend(yend),
-          m_pImage(pImage), m_masterSet(masterSet), m_camera(cam), m_lights(lights),
+                 unsigned int maxRayDepth,
+                 unsigned int rouletteMinBounces,
+                 IntegratorMode integrator,
+                 SamplerMode sampler,
+                 bool wavefront)
+        : m_worker(worker), m_tiles(tiles), m_passes(passes),
+          m_pImage(pImage), m_stats(stats), m_masterSet(masterSet), m_camera(cam), m_lights(lights),
           m_pixelSamplesHint(pixelSamplesHint), m_lightSamplesHint(lightSamplesHint),
-          m_maxRayDepth(maxRayDepth) { }
+          m_maxRayDepth(maxRayDepth), m_rouletteMinBounces(rouletteMinBounces), m_integrator(integrator),
+          m_sampler(sampler), m_wavefront(wavefront), m_rng(), m_samplers()
+    {
+        // A path traced on its own only needs the sample patterns for the
+        // pixel it's in, but the wavefront has paths from every pixel in the
+        // tile in flight at once, so it needs patterns for all of them.  They
+        // are made once here and just refilled for each pixel.
+        m_samplers.resize(m_wavefront ? kTileDim * kTileDim : 1);
+        for (size_t i = 0; i < m_samplers.size(); ++i)
+            createSamplers(m_samplers[i], m_rng);
+    }
+    
+    ~RenderThread()
+    {
+        for (size_t i = 0; i < m_samplers.size(); ++i)
+            deleteSamplers(m_samplers[i]);
+    }
+    
+    void run()
+    {
+        unsigned int pass = 0;
+        unsigned int firstSample, endSample;
+        while (m_passes.waitForPass(pass, firstSample, endSample))
+        {
+            Tile tile;
+            while (m_tiles.nextTile(m_worker, tile))
+            {
+                renderTile(tile, firstSample, endSample);
+            }
+            m_passes.workerFinished();
+        }
+    }
     
 protected:
-    virtual void run()
+    // Add pixel samples [firstSample, endSample) into the tile's pixels
+    void renderTile(const Tile& tile, unsigned int firstSample, unsigned int endSample)
     {
         // Random number generator (for random pixel positions, light positions, etc)
-        // We seed the generator for this render thread based on something that
-        // doesn't change, but gives us a good variable seed for each thread.
-        Rng rng(static_cast<unsigned int>(((m_xstart << 16) | m_xend) ^ m_xstart),
-                static_cast<unsigned int>(((m_ystart << 16) | m_yend) ^ m_ystart));
+        // It gets reseeded for each pixel and pixel sample below.
+        Rng& rng = m_rng;
+        std::vector<SamplerContainer>& samplers = m_samplers;
         
-        // The aspect ratio is used to make the image only get more zoomed in when
-        // the height changes (and not the width)
-        float aspectRatioXToY = float(m_pImage->width()) / float(m_pImage->height());
-        
-        SamplerContainer samplers;
-        samplers.m_numLightSamples = m_lights.empty() ? 0 : m_lightSamplesHint * m_lightSamplesHint;
-        samplers.m_maxRayDepth = m_maxRayDepth;
+        std::vector<PathSample> paths;
         
-        // Set up samplers for each of the ray bounces.  Each bounce will use
-        // the same sampler for all pixel samples in the pixel to reduce noise.
-        for (size_t i = 0; i < m_maxRayDepth; ++i)
-        {
-            samplers.m_bounceSamplers.push_back(new CorrelatedMultiJitterSampler(m_pixelSamplesHint,
-                                                                                 m_pixelSamplesHint,
-                                                                                 rng,
-                                                                                 rng.nextUInt32()));
-            samplers.m_lightSelectionSamplers.push_back(new CorrelatedMultiJitterSampler(m_pixelSamplesHint * m_lightSamplesHint *
-                                                                                         m_pixelSamplesHint * m_lightSamplesHint,
-                                                                                         rng,
-                                                                                         rng.nextUInt32()));
-            samplers.m_lightElementSamplers.push_back(new CorrelatedMultiJitterSampler(m_pixelSamplesHint * m_lightSamplesHint *
-                                                                                       m_pixelSamplesHint * m_lightSamplesHint,
-                                                                                       rng,
-                                                                                       rng.nextUInt32()));
-            samplers.m_lightSamplers.push_back(new CorrelatedMultiJitterSampler(m_pixelSamplesHint * m_lightSamplesHint,
-                                                                                m_pixelSamplesHint * m_lightSamplesHint,
-                                                                                rng,
-                                                                                rng.nextUInt32()));
-            samplers.m_brdfSamplers.push_back(new CorrelatedMultiJitterSampler(m_pixelSamplesHint * m_lightSamplesHint,
-                                                                               m_pixelSamplesHint * m_lightSamplesHint,
-                                                                               rng,
-                                                                               rng.nextUInt32()));
-        }
-        // Set up samplers for each pixel sample
-        samplers.m_timeSampler = new CorrelatedMultiJitterSampler(m_pixelSamplesHint * m_pixelSamplesHint, rng, rng.nextUInt32());
-        samplers.m_lensSampler = new CorrelatedMultiJitterSampler(m_pixelSamplesHint, m_pixelSamplesHint, rng, rng.nextUInt32());
-        samplers.m_subpixelSampler = new CorrelatedMultiJitterSampler(m_pixelSamplesHint, m_pixelSamplesHint, rng, rng.nextUInt32());
-        unsigned int totalPixelSamples = samplers.m_subpixelSampler->total2DSamplesAvailable();
-
         // For each pixel row...
-        for (size_t y = m_ystart; y < m_yend; ++y)
+        for (size_t y = tile.m_ystart; y < tile.m_yend; ++y)
         {
             // For each pixel across the row...
-            for (size_t x = m_xstart; x < m_xend; ++x)
+            for (size_t x = tile.m_xstart; x < tile.m_xend; ++x)
             {
-                // Accumulate pixel color
+                // Skip pixels that have converged already
+                size_t pixelIndex = y * m_pImage->width() + x;
+                if (m_stats.m_converged[pixelIndex])
+                    continue;
+                
+                SamplerContainer& pixelSamplers = m_wavefront ?
+                    samplers[(y - tile.m_ystart) * kTileDim + (x - tile.m_xstart)] : samplers[0];
+                refillSamplers(pixelSamplers, pixelIndex, firstSample, endSample, rng);
+                
+                // Wavefront: just line up the camera rays for now
+                if (m_wavefront)
+                {
+                    for (unsigned int psi = firstSample; psi < endSample; ++psi)
+                    {
+                        PathSample path;
+                        path.m_ray = cameraRay(pixelSamplers, x, y, psi);
+                        path.m_pSamplers = &pixelSamplers;
+                        path.m_pixelSampleIndex = psi;
+                        paths.push_back(path);
+                    }
+                    continue;
+                }
+                
+                // Accumulate pixel color, and luminance to estimate noise with
                 Color pixelColor(0.0f, 0.0f, 0.0f);
-                // For each sample in the pixel...
-                for (size_t psi = 0; psi < totalPixelSamples; ++psi)
+                double luminanceSum = 0.0;
+                double luminanceSumSquared = 0.0;
+                // For each sample in the pixel (for this pass)...
+                for (unsigned int psi = firstSample; psi < endSample; ++psi)
                 {
-                    // Calculate a stratified random position within the pixel
-                    // to hide aliasing
-                    float pu, pv;
-                    samplers.m_subpixelSampler->sample2D(psi, pu, pv);
-                    float xu = (x + pu) / float(m_pImage->width());
-                    // Flip pixel row to be in screen space (images are top-down)
-                    float yu = 1.0f - (y + pv) / float(m_pImage->height());
-                    
-                    // Calculate a stratified random variation for depth-of-field
-                    float lensU, lensV;
-                    samplers.m_lensSampler->sample2D(psi, lensU, lensV);
-                    
-                    // Grab a time for motion blur
-                    float timeU = samplers.m_timeSampler->sample1D(psi);
+                    rng = pixelRng(pixelIndex, psi + 1);
                     
                     // Find where this pixel sample hits in the scene
-                    Ray ray = m_camera.makeRay((xu - 0.5f) * aspectRatioXToY + 0.5f,
-                                               yu,
-                                               lensU,
-                                               lensV,
-                                               timeU);
+                    Ray ray = cameraRay(pixelSamplers, x, y, psi);
                     
                     // Trace a path out, gathering estimated radiance along the path
-                    pixelColor += pathTrace(ray,
-                                            m_masterSet,
-                                            m_lights,
-                                            rng,
-                                            samplers,
-                                            psi);
+                    Color sampleColor = pathTrace(ray,
+                                                  m_masterSet,
+                                                  m_lights,
+                                                  rng,
+                                                  pixelSamplers,
+                                                  psi);
+                    pixelColor += sampleColor;
+                    float luminance = sampleColor.luminance();
+                    luminanceSum += luminance;
+                    luminanceSumSquared += double(luminance) * luminance;
                 }
-                // Divide by the number of pixel samples (a box pixel filter, essentially)
-                pixelColor /= totalPixelSamples;
-                
-                // Store off the computed pixel in a big buffer
-                m_pImage->pixel(x, y) = pixelColor;
-                
-                // Reset samplers for the next pixel sample
-                for (size_t i = 0; i < m_maxRayDepth; ++i)
+                addPixelSamples(x, y, pixelColor, luminanceSum, luminanceSumSquared, endSample);
+            }
+        }
+        
+        // Trace the whole tile's paths together, then add them into their
+        // pixels (they were lined up pixel by pixel, in sample order)
+        if (m_wavefront && !paths.empty())
+        {
+            pathTraceBatch(paths, m_masterSet, m_lights);
+            unsigned int samplesPerPixel = endSample - firstSample;
+            for (size_t first = 0; first < paths.size(); first += samplesPerPixel)
+            {
+                size_t samplerIndex = paths[first].m_pSamplers - &samplers[0];
+                size_t x = tile.m_xstart + samplerIndex % kTileDim;
+                size_t y = tile.m_ystart + samplerIndex / kTileDim;
+                Color pixelColor(0.0f, 0.0f, 0.0f);
+                double luminanceSum = 0.0;
+                double luminanceSumSquared = 0.0;
+                for (size_t i = first; i < first + samplesPerPixel; ++i)
                 {
-                    samplers.m_bounceSamplers[i]->refill(rng.nextUInt32());
-                    samplers.m_lightSelectionSamplers[i]->refill(rng.nextUInt32());
-                    samplers.m_lightElementSamplers[i]->refill(rng.nextUInt32());
-                    samplers.m_lightSamplers[i]->refill(rng.nextUInt32());
-                    samplers.m_brdfSamplers[i]->refill(rng.nextUInt32());
+                    pixelColor += paths[i].m_result;
+                    float luminance = paths[i].m_result.luminance();
+                    luminanceSum += luminance;
+                    luminanceSumSquared += double(luminance) * luminance;
                 }
-                samplers.m_lensSampler->refill(rng.nextUInt32());
-                samplers.m_timeSampler->refill(rng.nextUInt32());
-                samplers.m_subpixelSampler->refill(rng.nextUInt32());
+                addPixelSamples(x, y, pixelColor, luminanceSum, luminanceSumSquared, endSample);
+            }
+        }
+    }
+    
+    // Set up samplers for each of the ray bounces, and for the pixel samples
+    void createSamplers(SamplerContainer& samplers, Rng& rng)
+    {
+        samplers.m_numLightSamples = m_lights.empty() ? 0 : m_lightSamplesHint * m_lightSamplesHint;
+        samplers.m_maxRayDepth = m_maxRayDepth;
+        samplers.m_rouletteMinBounces = m_rouletteMinBounces;
+        samplers.m_integrator = m_integrator;
+        
+        // Set up samplers for each of the ray bounces.  Each bounce will use
+        // the same sampler for all pixel samples in the pixel to reduce noise.
+        unsigned int pixelSamples = m_pixelSamplesHint * m_pixelSamplesHint;
+        unsigned int lightSamplesPerDim = m_pixelSamplesHint * m_lightSamplesHint;
+        for (size_t i = 0; i < m_maxRayDepth; ++i)
+        {
+            unsigned int dimension = kNumCameraDimensions + i * kNumBounceDimensions;
+            samplers.m_bounceSamplers.push_back(createSampler2D(dimension + kDimensionBounce,
+                                                                m_pixelSamplesHint, m_pixelSamplesHint, rng));
+            samplers.m_rouletteSamplers.push_back(createSampler1D(dimension + kDimensionRoulette,
+                                                                  pixelSamples, rng));
+            samplers.m_lightSelectionSamplers.push_back(createSampler1D(dimension + kDimensionLightSelection,
+                                                                        lightSamplesPerDim * lightSamplesPerDim, rng));
+            samplers.m_lightElementSamplers.push_back(createSampler1D(dimension + kDimensionLightElement,
+                                                                      lightSamplesPerDim * lightSamplesPerDim, rng));
+            samplers.m_lightSamplers.push_back(createSampler2D(dimension + kDimensionLight,
+                                                               lightSamplesPerDim, lightSamplesPerDim, rng));
+            samplers.m_brdfSamplers.push_back(createSampler2D(dimension + kDimensionBrdf,
+                                                              lightSamplesPerDim, lightSamplesPerDim, rng));
+            samplers.m_strategySamplers.push_back(createSampler1D(dimension + kDimensionStrategy,
+                                                                  lightSamplesPerDim * lightSamplesPerDim, rng));
+        }
+        // Set up samplers for each pixel sample
+        samplers.m_timeSampler = createSampler1D(kDimensionTime, pixelSamples, rng);
+        samplers.m_lensSampler = createSampler2D(kDimensionLens, m_pixelSamplesHint, m_pixelSamplesHint, rng);
+        samplers.m_subpixelSampler = createSampler2D(kDimensionSubpixel, m_pixelSamplesHint, m_pixelSamplesHint, rng);
+    }
+    
+    // A pattern of the sampler type in use (the sample counts are only for
+    // CMJ, and the dimension only for Sobol)
+    Sampler* createSampler1D(unsigned int dimension, unsigned int samples, Rng& rng)
+    {
+        if (m_sampler == kSamplerSobol)
+            return new OwenScrambledSobolSampler(dimension, 1, rng, 0);
+        return new CorrelatedMultiJitterSampler(samples, rng, rng.nextUInt32());
+    }
+    
+    Sampler* createSampler2D(unsigned int dimension, unsigned int xSamples, unsigned int ySamples, Rng& rng)
+    {
+        if (m_sampler == kSamplerSobol)
+            return new OwenScrambledSobolSampler(dimension, 2, rng, 0);
+        return new CorrelatedMultiJitterSampler(xSamples, ySamples, rng, rng.nextUInt32());
+    }
+    
+    // Set up the sample patterns for a pixel; they are the same for every
+    // pass so the pixel's samples stay stratified (the patterns are sized for
+    // the most samples a pixel can get)
+    void refillSamplers(SamplerContainer& samplers, size_t pixelIndex,
+                        unsigned int firstSample, unsigned int endSample, Rng& rng)
+    {
+        // The pixel's Rng still gets seeded, for patterns that run out to fall
+        // back on, but the patterns' permutations all come from one bulk fill
+        rng = pixelRng(pixelIndex, 0);
+        
+        // Sobol patterns are all seeded by the pixel alone (their dimensions
+        // keep them apart), and need no help making samples
+        if (m_sampler == kSamplerSobol)
+        {
+            unsigned int seed = static_cast<unsigned int>(pixelIndex);
+            for (size_t i = 0; i < m_maxRayDepth; ++i)
+            {
+                samplers.m_bounceSamplers[i]->refill(seed);
+                samplers.m_lightSelectionSamplers[i]->refill(seed);
+                samplers.m_lightElementSamplers[i]->refill(seed);
+                samplers.m_lightSamplers[i]->refill(seed);
+                samplers.m_brdfSamplers[i]->refill(seed);
+                samplers.m_rouletteSamplers[i]->refill(seed);
+                samplers.m_strategySamplers[i]->refill(seed);
             }
+            samplers.m_lensSampler->refill(seed);
+            samplers.m_timeSampler->refill(seed);
+            samplers.m_subpixelSampler->refill(seed);
+            return;
+        }
+        
+        m_permutations.resize(7 * m_maxRayDepth + 3);
+        Rng8 permutationRng(static_cast<unsigned int>(pixelIndex));
+        permutationRng.fill(&m_permutations[0], m_permutations.size());
+        const unsigned int *pPermutation = &m_permutations[0];
+        for (size_t i = 0; i < m_maxRayDepth; ++i)
+        {
+            samplers.m_bounceSamplers[i]->refill(*pPermutation++);
+            samplers.m_lightSelectionSamplers[i]->refill(*pPermutation++);
+            samplers.m_lightElementSamplers[i]->refill(*pPermutation++);
+            samplers.m_lightSamplers[i]->refill(*pPermutation++);
+            samplers.m_brdfSamplers[i]->refill(*pPermutation++);
+            samplers.m_rouletteSamplers[i]->refill(*pPermutation++);
+            samplers.m_strategySamplers[i]->refill(*pPermutation++);
         }
+        samplers.m_lensSampler->refill(*pPermutation++);
+        samplers.m_timeSampler->refill(*pPermutation++);
+        samplers.m_subpixelSampler->refill(*pPermutation++);
         
-        // Deallocate all samplers
+        // Let the patterns make this pass's samples in bulk
+        unsigned int firstLightSample = firstSample * samplers.m_numLightSamples;
+        unsigned int endLightSample = endSample * samplers.m_numLightSamples;
+        for (size_t i = 0; i < m_maxRayDepth; ++i)
+        {
+            samplers.m_bounceSamplers[i]->expectSamples(firstSample, endSample);
+            samplers.m_rouletteSamplers[i]->expectSamples(firstSample, endSample);
+            samplers.m_lightSelectionSamplers[i]->expectSamples(firstLightSample, endLightSample);
+            samplers.m_lightElementSamplers[i]->expectSamples(firstLightSample, endLightSample);
+            samplers.m_lightSamplers[i]->expectSamples(firstLightSample, endLightSample);
+            samplers.m_brdfSamplers[i]->expectSamples(firstLightSample, endLightSample);
+            samplers.m_strategySamplers[i]->expectSamples(firstLightSample, endLightSample);
+        }
+        samplers.m_lensSampler->expectSamples(firstSample, endSample);
+        samplers.m_timeSampler->expectSamples(firstSample, endSample);
+        samplers.m_subpixelSampler->expectSamples(firstSample, endSample);
+    }
+    
+    void deleteSamplers(SamplerContainer& samplers)
+    {
         for (size_t i = 0; i < m_maxRayDepth; ++i)
         {
             delete samplers.m_bounceSamplers[i];
+            delete samplers.m_rouletteSamplers[i];
             delete samplers.m_lightSelectionSamplers[i];
             delete samplers.m_lightElementSamplers[i];
             delete samplers.m_lightSamplers[i];
             delete samplers.m_brdfSamplers[i];
+            delete samplers.m_strategySamplers[i];
         }
         delete samplers.m_lensSampler;
         delete samplers.m_timeSampler;
         delete samplers.m_subpixelSampler;
     }
     
-    size_t m_xstart, m_xend, m_ystart, m_yend;
+    // The camera ray for a pixel sample
+    Ray cameraRay(SamplerContainer& samplers, size_t x, size_t y, unsigned int psi)
+    {
+        // The aspect ratio is used to make the image only get more zoomed in when
+        // the height changes (and not the width)
+        float aspectRatioXToY = float(m_pImage->width()) / float(m_pImage->height());
+        
+        // Calculate a stratified random position within the pixel
+        // to hide aliasing
+        float pu, pv;
+        samplers.m_subpixelSampler->sample2D(psi, pu, pv);
+        float xu = (x + pu) / float(m_pImage->width());
+        // Flip pixel row to be in screen space (images are top-down)
+        float yu = 1.0f - (y + pv) / float(m_pImage->height());
+        
+        // Calculate a stratified random variation for depth-of-field
+        float lensU, lensV;
+        samplers.m_lensSampler->sample2D(psi, lensU, lensV);
+        
+        // Grab a time for motion blur
+        float timeU = samplers.m_timeSampler->sample1D(psi);
+        
+        return m_camera.makeRay((xu - 0.5f) * aspectRatioXToY + 0.5f,
+                                yu,
+                                lensU,
+                                lensV,
+                                timeU);
+    }
+    
+    // Add a pass's samples into the pixel's running sum (the division happens
+    // once the render is over)
+    void addPixelSamples(size_t x, size_t y, const Color& pixelColor,
+                         double luminanceSum, double luminanceSumSquared, unsigned int endSample)
+    {
+        size_t pixelIndex = y * m_pImage->width() + x;
+        m_pImage->pixel(x, y) += pixelColor;
+        m_stats.m_numSamples[pixelIndex] = endSample;
+        m_stats.m_luminanceSum[pixelIndex] += luminanceSum;
+        m_stats.m_luminanceSumSquared[pixelIndex] += luminanceSumSquared;
+    }
+    
+    size_t m_worker;
+    TileQueue& m_tiles;
+    PassControl& m_passes;
     Image *m_pImage;
+    PixelStatistics& m_stats;
     ShapeSet& m_masterSet;
     const Camera& m_camera;
-    std::vector<Shape*>& m_lights;
+    const LightTree& m_lights;
     unsigned int m_pixelSamplesHint, m_lightSamplesHint;
     unsigned int m_maxRayDepth;
+    unsigned int m_rouletteMinBounces;
+    IntegratorMode m_integrator;
+    SamplerMode m_sampler;
+    bool m_wavefront;
+    // The samplers' patterns fall back on this Rng when they run out
+    Rng m_rng;
+    std::vector<SamplerContainer> m_samplers;
+    // Scratch space for refillSamplers()
+    std::vector<unsigned int> m_permutations;
+    
+    // No copying (the samplers would be deleted twice)
+    RenderThread(const RenderThread&);
+    RenderThread& operator =(const RenderThread&);
 };
 
 
@@ -267,9 +737,102 @@ Ray PerspectiveCamera::makeRay(float xScreen, float yScreen, float lensU, float
 }
 
 
+namespace
+{
+
+
+// How many light samples pathTrace() gets ready before evaluating the BRDF
+// for all of them at once
+const unsigned int kLightSampleBatch = 8;
+
+
+// One light sample of one-sample MIS: take either a light sample or a BRDF
+// sample (not both), and divide by the chance of either strategy producing
+// that direction.  That's the balance heuristic, with the odds of picking a
+// strategy standing in for its sample count.
+Color sampleOneStrategy(ShapeSet& scene,
+                        const LightTree& lights,
+                        SamplerContainer& samplers,
+                        const Intersection& intersection,
+                        const Point& position,
+                        const Vector& normal,
+                        const Vector& litNormal,
+                        const ShadingRecord& shading,
+                        float time,
+                        size_t numBounces,
+                        unsigned int finalLightSampleIndex)
+{
+    float lightFraction = shading.lightSampleFraction();
+    float strategyU = samplers.m_strategySamplers[numBounces]->sample1D(finalLightSampleIndex);
+    
+    Light *pLightShape = NULL;
+    Vector incoming;
+    float lightPdf = 0.0f;
+    float brdfPdf = 0.0f;
+    float brdfResult = 0.0f;
+    if (strategyU < lightFraction)
+    {
+        // Light strategy: pick a light and a point on it, and see if it's visible
+        float liu = samplers.m_lightSelectionSamplers[numBounces]->sample1D(finalLightSampleIndex);
+        float lightSelectionPdf = 0.0f;
+        if (!lights.sample(position, litNormal, liu, pLightShape, lightSelectionPdf))
+            return Color(0.0f, 0.0f, 0.0f);
+        
+        float lsu, lsv;
+        samplers.m_lightSamplers[numBounces]->sample2D(finalLightSampleIndex, lsu, lsv);
+        float leu = samplers.m_lightElementSamplers[numBounces]->sample1D(finalLightSampleIndex);
+        Point lightPoint;
+        Vector lightNormal;
+        pLightShape->sampleSurface(position, normal, time, lsu, lsv, leu, lightPoint, lightNormal, lightPdf);
+        if (lightPdf <= 0.0f)
+            return Color(0.0f, 0.0f, 0.0f);
+        lightPdf *= lightSelectionPdf;
+        
+        incoming = position - lightPoint;
+        float lightDistance = incoming.normalize();
+        brdfResult = shading.evaluateSA(incoming, brdfPdf);
+        if (brdfResult <= 0.0f)
+            return Color(0.0f, 0.0f, 0.0f);
+        
+        Ray shadowRay(position, -incoming, lightDistance - kRayTMin, time);
+        if (scene.doesIntersect(shadowRay))
+            return Color(0.0f, 0.0f, 0.0f);
+    }
+    else
+    {
+        // BRDF strategy: follow a BRDF sample and see if it runs into a
+        // light (any light; the light tree knows how likely it was to pick it)
+        float bsu, bsv;
+        samplers.m_brdfSamplers[numBounces]->sample2D(finalLightSampleIndex, bsu, bsv);
+        brdfResult = shading.sampleSA(incoming, bsu, bsv, brdfPdf);
+        if (brdfPdf <= 0.0f || brdfResult <= 0.0f)
+            return Color(0.0f, 0.0f, 0.0f);
+        
+        Intersection lightIntersection(Ray(position, -incoming, kRayTMax, time));
+        if (!scene.intersect(lightIntersection) || !lightIntersection.m_pShape->isLight())
+            return Color(0.0f, 0.0f, 0.0f);
+        pLightShape = (Light*) lightIntersection.m_pShape;
+        lightPdf = pLightShape->intersectPdf(lightIntersection);
+        if (lightPdf <= 0.0f)
+            return Color(0.0f, 0.0f, 0.0f);
+        lightPdf *= lights.pdf(position, litNormal, pLightShape);
+    }
+    
+    float combinedPdf = lightFraction * lightPdf + (1.0f - lightFraction) * brdfPdf;
+    return pLightShape->emitted() *
+           intersection.m_colorModifier * shading.color() *
+           brdfResult *
+           std::fabs(dot(-incoming, normal)) /
+           (combinedPdf * shading.brdfWeight());
+}
+
+
+} // namespace
+
+
 Color pathTrace(const Ray& ray,
                 ShapeSet& scene,
-                std::vector<Shape*>& lights,
+                const LightTree& lights,
                 Rng& rng,
                 SamplerContainer& samplers,
                 unsigned int pixelSampleIndex)
@@ -283,11 +846,20 @@ Color pathTrace(const Ray& ray,
     // Start with the initial ray from the camera
     Ray currentRay = ray;
     
+    // With a shared BRDF ray, each leg of the path is also the BRDF half of
+    // MIS for the vertex it left, so we need to remember a few things about
+    // that vertex (and trace one more leg past the last bounce to finish it)
+    bool shareBrdfRay = samplers.m_integrator == kIntegratorSharedBrdfRay;
+    bool oneSampleMIS = samplers.m_integrator == kIntegratorOneSampleMIS;
+    Point lastPosition;
+    Vector lastLitNormal;
+    float lastBrdfPdf = 0.0f;
+    
     // While we have bounces left we can still take...
     size_t numBounces = 0;
     size_t numDiracBounces = 0;
     bool lastBounceDiracDistribution = false;
-    while (numBounces < samplers.m_maxRayDepth)
+    while (numBounces < samplers.m_maxRayDepth || (shareBrdfRay && numBounces == samplers.m_maxRayDepth))
     {
         // Trace the ray to see if we hit anything
         Intersection intersection(currentRay);
@@ -300,147 +872,211 @@ Color pathTrace(const Ray& ray,
         // Add in emission when directly visible or via perfect specular bounces
         // (Note that we stop including it through any non-Dirac bounce to
         // prevent caustic noise.)
-        if (numBounces == 0 || numBounces == numDiracBounces)
+        bool pastLastBounce = numBounces == samplers.m_maxRayDepth;
+        if (!pastLastBounce && (numBounces == 0 || numBounces == numDiracBounces))
         {
-            result += throughput * intersection.m_pMaterial->emittance();
+            result += throughput * ShadingRecord::emittance(intersection.m_pMaterial);
         }
+        else if (shareBrdfRay && !lastBounceDiracDistribution && intersection.m_pShape->isLight())
+        {
+            // The BRDF sampled this leg and it ran into a light: that's the
+            // BRDF sample for MIS at the last vertex.  Ask the light (and the
+            // light tree) how likely light sampling was to pick this point.
+            Light *pHitLight = (Light*) intersection.m_pShape;
+            float lightPdf = pHitLight->intersectPdf(intersection);
+            if (lightPdf > 0.0f)
+            {
+                lightPdf *= lights.pdf(lastPosition, lastLitNormal, pHitLight);
+                float misWeightBrdf = powerHeuristic(1, lastBrdfPdf, samplers.m_numLightSamples, lightPdf);
+                result += throughput * pHitLight->emitted() * misWeightBrdf;
+            }
+        }
+        if (pastLastBounce)
+            break;
         
         // Evaluate the material and intersection information at this bounce
         Point position = intersection.position();
         Vector normal = intersection.m_normal;
         Vector outgoing = -currentRay.m_direction;
-        Brdf* pBrdf = NULL;
-        float brdfWeight = 1.0f;
-        Color matColor = intersection.m_pMaterial->evaluate(position,
-                                                            normal,
-                                                            outgoing,
-                                                            pBrdf,
-                                                            brdfWeight);
+        ShadingRecord shading;
+        shading.setup(intersection.m_pMaterial, position, normal, outgoing);
         // No BRDF?  We can't evaluate lighting, so bail.
-        if (pBrdf == NULL)
+        if (shading.brdf() == NULL)
         {
             return result;
         }
         
         // Was this a perfect specular bounce?
-        lastBounceDiracDistribution = pBrdf->isDiracDistribution();
+        lastBounceDiracDistribution = shading.isDiracDistribution();
         if (lastBounceDiracDistribution)
             numDiracBounces++;
         
         // Evaluate direct lighting at this bounce
         
+        // Lights only shine on the side of the surface we're looking at
+        Vector litNormal = dot(normal, outgoing) < 0.0f ? -normal : normal;
         if (!lastBounceDiracDistribution)
         {
             Color lightResult = Color(0.0f, 0.0f, 0.0f);
-            float lightSelectionWeight = float(lights.size()) / samplers.m_numLightSamples;
-            for (size_t lightSampleIndex = 0; lightSampleIndex < samplers.m_numLightSamples; ++lightSampleIndex)
+            // Sample lights using MIS between the light and the BRDF.
+            // This means we ask the light for a direction, and the likelihood
+            // of having sampled that direction (the PDF).  Then we ask the
+            // BRDF what it thinks of that direction (its PDF), and weight
+            // the light sample with MIS.
+            //
+            // Then, we ask the BRDF for a direction, and the likelihood of
+            // having sampled that direction (the PDF).  Then we ask the
+            // light what it thinks of that direction (its PDF, and whether
+            // that direction even runs into the light at all), and weight
+            // the BRDF sample with MIS.
+            //
+            // By doing both samples and asking both the BRDF and light for
+            // their PDF for each one, we can combine the strengths of both
+            // sampling methods and get the best of both worlds.  It does
+            // cost an extra shadow ray and evaluation, though, but it is
+            // generally such an improvement in quality that it is very much
+            // worth the overhead.
+            
+            // (With a shared BRDF ray, the BRDF sample is the next leg of
+            // the path instead, and it gets weighted once it hits something.
+            // With one-sample MIS, only one of the two samples is taken.)
+            
+            // The light samples go through in small batches: first each one
+            // picks a light and a point on it, then the BRDF is evaluated for
+            // the whole batch of directions at once, then the rays get traced
+            for (size_t batchStart = 0; batchStart < samplers.m_numLightSamples; batchStart += kLightSampleBatch)
             {
-                // Sample lights using MIS between the light and the BRDF.
-                // This means we ask the light for a direction, and the likelihood
-                // of having sampled that direction (the PDF).  Then we ask the
-                // BRDF what it thinks of that direction (its PDF), and weight
-                // the light sample with MIS.
-                //
-                // Then, we ask the BRDF for a direction, and the likelihood of
-                // having sampled that direction (the PDF).  Then we ask the
-                // light what it thinks of that direction (its PDF, and whether
-                // that direction even runs into the light at all), and weight
-                // the BRDF sample with MIS.
-                //
-                // By doing both samples and asking both the BRDF and light for
-                // their PDF for each one, we can combine the strengths of both
-                // sampling methods and get the best of both worlds.  It does
-                // cost an extra shadow ray and evaluation, though, but it is
-                // generally such an improvement in quality that it is very much
-                // worth the overhead.
+                unsigned int batchSize = std::min(kLightSampleBatch, samplers.m_numLightSamples - (unsigned int)batchStart);
+                
+                if (oneSampleMIS)
+                {
+                    for (unsigned int i = 0; i < batchSize; ++i)
+                    {
+                        unsigned int finalLightSampleIndex = pixelSampleIndex * samplers.m_numLightSamples +
+                                                             batchStart + i;
+                        lightResult += sampleOneStrategy(scene, lights, samplers, intersection,
+                                                         position, normal, litNormal, shading, ray.m_time,
+                                                         numBounces, finalLightSampleIndex);
+                    }
+                    continue;
+                }
                 
-                // Select a light randomly for this sample
-                unsigned int finalLightSampleIndex = pixelSampleIndex * samplers.m_numLightSamples +
-                                                     lightSampleIndex;
-                float liu = samplers.m_lightSelectionSamplers[numBounces]->sample1D(finalLightSampleIndex);
-                size_t lightIndex = (size_t)(liu * lights.size());
-                if (lightIndex >= lights.size())
-                    lightIndex = lights.size() - 1;
-                Light *pLightShape = (Light*) lights[lightIndex];
+                Light *batchLights[kLightSampleBatch];
+                float lightSelectionPdfs[kLightSampleBatch];
+                float lightPdfs[kLightSampleBatch];
+                float lightDistances[kLightSampleBatch];
+                Vector lightIncomings[kLightSampleBatch];
+                for (unsigned int i = 0; i < batchSize; ++i)
+                {
+                    unsigned int finalLightSampleIndex = pixelSampleIndex * samplers.m_numLightSamples +
+                                                         batchStart + i;
+                    batchLights[i] = NULL;
+                    lightPdfs[i] = 0.0f;
+                    // (Something harmless for the BRDF to look at, if there's no light)
+                    lightIncomings[i] = -litNormal;
+                    
+                    // Select a light for this sample, favoring the ones likely
+                    // to light this point the most; both the light and BRDF
+                    // samples below only count this light, so they are both
+                    // weighted by how likely it was to be picked
+                    float liu = samplers.m_lightSelectionSamplers[numBounces]->sample1D(finalLightSampleIndex);
+                    if (!lights.sample(position, litNormal, liu, batchLights[i], lightSelectionPdfs[i]))
+                    {
+                        batchLights[i] = NULL; // No light can reach this point
+                        continue;
+                    }
+                    
+                    // Ask the light for a random position/normal we can use for lighting
+                    float lsu, lsv;
+                    samplers.m_lightSamplers[numBounces]->sample2D(finalLightSampleIndex, lsu, lsv);
+                    float leu = samplers.m_lightElementSamplers[numBounces]->sample1D(finalLightSampleIndex);
+                    Point lightPoint;
+                    Vector lightNormal;
+                    batchLights[i]->sampleSurface(position,
+                                                  normal,
+                                                  ray.m_time,
+                                                  lsu, lsv, leu,
+                                                  lightPoint,
+                                                  lightNormal,
+                                                  lightPdfs[i]);
+                    if (lightPdfs[i] > 0.0f)
+                    {
+                        lightIncomings[i] = position - lightPoint;
+                        lightDistances[i] = lightIncomings[i].normalize();
+                    }
+                }
                 
-                // Ask the light for a random position/normal we can use for lighting
-                float lsu, lsv;
-                samplers.m_lightSamplers[numBounces]->sample2D(finalLightSampleIndex, lsu, lsv);
-                float leu = samplers.m_lightElementSamplers[numBounces]->sample1D(finalLightSampleIndex);
-                Point lightPoint;
-                Vector lightNormal;
-                float lightPdf = 0.0f;
-                pLightShape->sampleSurface(position,
-                                           normal,
-                                           ray.m_time,
-                                           lsu, lsv, leu,
-                                           lightPoint,
-                                           lightNormal,
-                                           lightPdf);
+                // Ask the BRDF what it thinks of these light positions (for MIS)
+                float brdfResults[kLightSampleBatch];
+                float brdfPdfs[kLightSampleBatch];
+                shading.evaluateSA(lightIncomings, batchSize, brdfResults, brdfPdfs);
                 
-                if (lightPdf > 0.0f)
-                {   
-                    // Ask the BRDF what it thinks of this light position (for MIS)
-                    Vector lightIncoming = position - lightPoint;
-                    float lightDistance = lightIncoming.normalize();
-                    float brdfPdf = 0.0f;
-                    float brdfResult = pBrdf->evaluateSA(lightIncoming,
-                                                         outgoing,
-                                                         normal,
-                                                         brdfPdf);
-                    if (brdfResult > 0.0f && brdfPdf > 0.0f)
+                for (unsigned int i = 0; i < batchSize; ++i)
+                {
+                    unsigned int finalLightSampleIndex = pixelSampleIndex * samplers.m_numLightSamples +
+                                                         batchStart + i;
+                    Light *pLightShape = batchLights[i];
+                    if (pLightShape == NULL)
+                        continue;
+                    float lightSelectionPdf = lightSelectionPdfs[i];
+                    float lightPdf = lightPdfs[i];
+                    const Vector& lightIncoming = lightIncomings[i];
+                    if (lightPdf > 0.0f && brdfResults[i] > 0.0f && brdfPdfs[i] > 0.0f)
                     {
                         // Fire a shadow ray to make sure we can actually see the light position
-                        Ray shadowRay(position, -lightIncoming, lightDistance - kRayTMin, ray.m_time);
+                        Ray shadowRay(position, -lightIncoming, lightDistances[i] - kRayTMin, ray.m_time);
                         if (!scene.doesIntersect(shadowRay))
                         {
                             // The light point is visible, so let's add that
-                            // contribution (mixed by MIS)
-                            float misWeightLight = powerHeuristic(1, lightPdf, 1, brdfPdf);
+                            // contribution (mixed by MIS).  A shared BRDF ray
+                            // could hit any light, so the odds of picking this
+                            // one count toward the light's PDF.
+                            float misWeightLight = shareBrdfRay ?
+                                powerHeuristic(samplers.m_numLightSamples, lightPdf * lightSelectionPdf, 1, brdfPdfs[i]) :
+                                powerHeuristic(1, lightPdf, 1, brdfPdfs[i]);
                             lightResult += pLightShape->emitted() *
-                                           intersection.m_colorModifier * matColor *
-                                           brdfResult *
+                                           intersection.m_colorModifier * shading.color() *
+                                           brdfResults[i] *
                                            std::fabs(dot(-lightIncoming, normal)) *
-                                           misWeightLight / (lightPdf * brdfWeight);
+                                           misWeightLight / (lightPdf * shading.brdfWeight() * lightSelectionPdf);
                         }
                     }
-                }
-                
-                // Ask the BRDF for a sample direction
-                float bsu, bsv;
-                samplers.m_brdfSamplers[numBounces]->sample2D(finalLightSampleIndex, bsu, bsv);
-                Vector brdfIncoming;
-                float brdfPdf = 0.0f;
-                float brdfResult = pBrdf->sampleSA(brdfIncoming,
-                                                   outgoing,
-                                                   normal,
-                                                   bsu,
-                                                   bsv,
-                                                   brdfPdf);
-                if (brdfPdf > 0.0f && brdfResult > 0.0f)
-                {
-                    Intersection shadowIntersection(Ray(position, -brdfIncoming, kRayTMax, ray.m_time));
-                    bool intersected = scene.intersect(shadowIntersection);
-                    if (intersected && shadowIntersection.m_pShape == pLightShape)
+                    
+                    if (shareBrdfRay)
+                        continue;
+                    
+                    // Ask the BRDF for a sample direction
+                    float bsu, bsv;
+                    samplers.m_brdfSamplers[numBounces]->sample2D(finalLightSampleIndex, bsu, bsv);
+                    Vector brdfIncoming;
+                    float brdfPdf = 0.0f;
+                    float brdfResult = shading.sampleSA(brdfIncoming, bsu, bsv, brdfPdf);
+                    if (brdfPdf > 0.0f && brdfResult > 0.0f)
                     {
-                        // Ask the light what it thinks of this direction (for MIS)
-                        lightPdf = pLightShape->intersectPdf(shadowIntersection);
-                        if (lightPdf > 0.0f)
+                        Intersection shadowIntersection(Ray(position, -brdfIncoming, kRayTMax, ray.m_time));
+                        bool intersected = scene.intersect(shadowIntersection);
+                        if (intersected && shadowIntersection.m_pShape == pLightShape)
                         {
-                            // BRDF chose the light, so let's add that
-                            // contribution (mixed by MIS)
-                            float misWeightBrdf = powerHeuristic(1, brdfPdf, 1, lightPdf);
-                            lightResult += pLightShape->emitted() * 
-                                           intersection.m_colorModifier * matColor * brdfResult *
-                                           std::fabs(dot(-brdfIncoming, normal)) * misWeightBrdf /
-                                           (brdfPdf * brdfWeight);
+                            // Ask the light what it thinks of this direction (for MIS)
+                            lightPdf = pLightShape->intersectPdf(shadowIntersection);
+                            if (lightPdf > 0.0f)
+                            {
+                                // BRDF chose the light, so let's add that
+                                // contribution (mixed by MIS)
+                                float misWeightBrdf = powerHeuristic(1, brdfPdf, 1, lightPdf);
+                                lightResult += pLightShape->emitted() * 
+                                               intersection.m_colorModifier * shading.color() * brdfResult *
+                                               std::fabs(dot(-brdfIncoming, normal)) * misWeightBrdf /
+                                               (brdfPdf * shading.brdfWeight() * lightSelectionPdf);
+                            }
                         }
                     }
                 }
             }
             
             // Average light samples
-            lightResult *= samplers.m_numLightSamples > 0 ? lightSelectionWeight : 0.0f;
+            if (samplers.m_numLightSamples > 0)
+                lightResult /= float(samplers.m_numLightSamples);
             
             // Add direct lighting at this bounce (modified by how much the
             // previous bounces have dimmed it)
@@ -452,22 +1088,23 @@ Color pathTrace(const Ray& ray,
         samplers.m_bounceSamplers[numBounces]->sample2D(pixelSampleIndex, brdfSampleU, brdfSampleV);
         Vector incoming;
         float incomingBrdfPdf = 0.0f;
-        float incomingBrdfResult = pBrdf->sampleSA(incoming,
-                                                   outgoing,
-                                                   normal,
-                                                   brdfSampleU,
-                                                   brdfSampleV,
-                                                   incomingBrdfPdf);
+        float incomingBrdfResult = shading.sampleSA(incoming,
+                                                    brdfSampleU,
+                                                    brdfSampleV,
+                                                    incomingBrdfPdf);
 
         if (incomingBrdfPdf > 0.0f)
         {
+            lastPosition = position;
+            lastLitNormal = litNormal;
+            lastBrdfPdf = incomingBrdfPdf;
             currentRay.m_origin = position;
             currentRay.m_direction = -incoming;
             currentRay.m_tMax = kRayTMax;
             // Reduce lighting effect for the next bounce based on this bounce's BRDF
-            throughput *= intersection.m_colorModifier * matColor * incomingBrdfResult *
+            throughput *= intersection.m_colorModifier * shading.color() * incomingBrdfResult *
                           (std::fabs(dot(-incoming, normal)) /
-                          (incomingBrdfPdf * brdfWeight));
+                          (incomingBrdfPdf * shading.brdfWeight()));
         }
         else
         {
@@ -475,6 +1112,19 @@ Color pathTrace(const Ray& ray,
         }
         
         numBounces++;
+        
+        // Russian roulette: once the path is long enough, randomly end it with
+        // a chance that grows as its throughput drops, so dim paths stop
+        // costing rays.  The paths that carry on are weighted up by the odds
+        // of surviving, which keeps the estimate unbiased.
+        if (numBounces >= samplers.m_rouletteMinBounces && numBounces < samplers.m_maxRayDepth)
+        {
+            float survival = std::min(1.0f, throughput.maxComponent());
+            float rouletteSample = samplers.m_rouletteSamplers[numBounces]->sample1D(pixelSampleIndex);
+            if (rouletteSample >= survival)
+                break;
+            throughput /= survival;
+        }
     }
     
     // This represents an estimate of the total light coming in along the path
@@ -484,96 +1134,158 @@ Color pathTrace(const Ray& ray,
 
 Image* raytrace(ShapeSet& scene,
                 const Camera& cam,
-                size_t width,
-                size_t height,
-                unsigned int pixelSamplesHint,
-                unsigned int lightSamplesHint,
-                unsigned int maxRayDepth)
+                const RenderSettings& settings,
+                RenderProgress *pProgress,
+                RenderStats *pStats)
 {
+    size_t width = settings.m_width;
+    size_t height = settings.m_height;
+    
     // Get light list from the scene
     std::vector<Shape*> lights;
     scene.findLights(lights);
     
+    // Time the scene setup too, since none of the pixels can start before it's done
+    std::chrono::steady_clock::time_point prepareStart = std::chrono::steady_clock::now();
     scene.prepare();
     
-    // Set up the output image
+    // Organize the lights so each shading point can quickly pick good ones
+    LightTree lightTree(lights);
+    float prepareTime = std::chrono::duration<float>(std::chrono::steady_clock::now() - prepareStart).count();
+    
+    // Set up the output image, and the per-pixel sample bookkeeping
     Image *pImage = new Image(width, height);
+    PixelStatistics stats(width * height);
     
-    // Set up render threads; we make as much as 16 chunks of the image that
-    // can render in parallel.
-    const size_t kChunkDim = 4;
-    
-    // Chunk size is the number of pixels per image chunk (we have to take care
-    // to deal with tiny images)
-    size_t xChunkSize = width >= kChunkDim ? width / kChunkDim : 1;
-    size_t yChunkSize = height >= kChunkDim ? height / kChunkDim : 1;
-    // Chunks are the number of chunks in each dimension we can chop the image
-    // into (again, taking care to deal with tiny images, and also images that
-    // don't divide clealy into 4 chunks)
-    size_t xChunks = width > kChunkDim ? width / xChunkSize : 1;
-    size_t yChunks = height > kChunkDim ? height / yChunkSize : 1;
-    if (xChunks * xChunkSize < width) xChunks++;
-    if (yChunks * yChunkSize < height) yChunks++;
-    
-    // Set up render threads
-    size_t numRenderThreads = xChunks * yChunks;
-    RenderThread **renderThreads = new RenderThread*[numRenderThreads];
+    // Every pixel gets pixelSamplesHint^2 samples (or exactly pixelSamples, for
+    // Sobol patterns).  With adaptive sampling on, pixels that are still noisy
+    // after that keep going, up to the max.
+    unsigned int minPixelSamples = settings.m_pixelSamplesHint * settings.m_pixelSamplesHint;
+    if (settings.m_sampler == kSamplerSobol && settings.m_pixelSamples > 0)
+        minPixelSamples = settings.m_pixelSamples;
+    unsigned int patternHint = settings.m_pixelSamplesHint;
+    unsigned int maxPixelSamples = minPixelSamples;
+    float noiseThreshold = 0.0f;
+    if (settings.m_maxPixelSamplesHint * settings.m_maxPixelSamplesHint > minPixelSamples &&
+        settings.m_noiseThreshold > 0.0f)
+    {
+        patternHint = settings.m_maxPixelSamplesHint;
+        maxPixelSamples = patternHint * patternHint;
+        noiseThreshold = settings.m_noiseThreshold;
+    }
+    unsigned int minAdaptiveSamples = std::max(minPixelSamples, kMinAdaptiveSamples);
     
-    // Launch render threads
-    for (size_t yc = 0; yc < yChunks; ++yc)
+    // Cut the image up into tiles, in scanline order so each thread's run of
+    // tiles covers a band of the image (taking care to deal with images that
+    // don't divide clearly into tiles)
+    std::vector<Tile> tiles;
+    for (size_t yStart = 0; yStart < height; yStart += kTileDim)
     {
-        // Get the row start/end (making sure the last chunk doesn't go off the end)
-        size_t yStart = yc * yChunkSize;
-        size_t yEnd = std::min((yc + 1) * yChunkSize, height);
-        for (size_t xc = 0; xc < xChunks; ++xc)
+        for (size_t xStart = 0; xStart < width; xStart += kTileDim)
         {
-            // Get the column start/end (making sure the last chunk doesn't go off the end)
-            size_t xStart = xc * xChunkSize;
-            size_t xEnd = std::min((xc + 1) * xChunkSize, width);
-            // Render the chunk!
-            renderThreads[yc * xChunks + xc] = new RenderThread(xStart,
-                                                                xEnd,
-                                                                yStart,
-                                                                yEnd,
-                                                                pImage,
-                                                                scene,
-                                                                cam,
-                                                                lights,
-                                                                pixelSamplesHint,
-                                                                lightSamplesHint,
-                                                                maxRayDepth);
-            renderThreads[yc * xChunks + xc]->start();
+            Tile tile;
+            tile.m_xstart = xStart;
+            tile.m_xend = std::min(xStart + kTileDim, width);
+            tile.m_ystart = yStart;
+            tile.m_yend = std::min(yStart + kTileDim, height);
+            tiles.push_back(tile);
         }
     }
     
-    // Wait until the render finishes
-    bool stillRunning;
-    do
+    // One render thread per hardware thread (but no more than there are tiles)
+    size_t numRenderThreads = std::thread::hardware_concurrency();
+    numRenderThreads = std::max(size_t(1), std::min(numRenderThreads, tiles.size()));
+    TileQueue tileQueue(tiles, numRenderThreads);
+    PassControl passes(numRenderThreads);
+    
+    // Launch render threads
+    RenderThread **renderThreads = new RenderThread*[numRenderThreads];
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < numRenderThreads; ++i)
     {
-        // See if any render thread is still going...
-        stillRunning = false;
-        for (size_t i = 0; i < numRenderThreads; ++i)
-        {
-            if (renderThreads[i]->isRunning())
-            {
-                stillRunning = true;
-                break;
-            }
-        }
-        if (stillRunning)
-        {
-            // Give up the CPU so the render threads can do their thing
-            QThread::yieldCurrentThread();
-        }
-    } while (stillRunning);
+        renderThreads[i] = new RenderThread(i,
+                                            tileQueue,
+                                            passes,
+                                            pImage,
+                                            stats,
+                                            scene,
+                                            cam,
+                                            lightTree,
+                                            patternHint,
+                                            settings.m_lightSamplesHint,
+                                            settings.m_maxRayDepth,
+                                            settings.m_rouletteMinBounces,
+                                            settings.m_integrator,
+                                            settings.m_sampler,
+                                            settings.m_wavefront);
+        threads.push_back(std::thread(&RenderThread::run, renderThreads[i]));
+    }
+    
+    // A progressive render does one sample per pixel per pass, so there is
+    // something to look at right away; otherwise the first pass does all the
+    // samples every pixel gets, and adaptive passes after it do as many again.
+    unsigned int samplesPerPass = pProgress != NULL ? 1 : minPixelSamples;
+    unsigned int samplesDone = 0;
+    while (samplesDone < maxPixelSamples)
+    {
+        unsigned int passEnd = std::min(samplesDone + samplesPerPass, maxPixelSamples);
+        tileQueue.reset();
+        passes.runPass(samplesDone, passEnd);
+        samplesDone = passEnd;
+        
+        // The render threads are idle until the next pass, so the image can be
+        // looked at directly
+        if (pProgress != NULL && !pProgress->passFinished(*pImage, stats.m_numSamples, samplesDone, maxPixelSamples))
+            break;
+        
+        // See which pixels are clean enough to stop, and stop early if they
+        // all are
+        if (noiseThreshold > 0.0f)
+            stats.updateConverged(width, height, minAdaptiveSamples, noiseThreshold);
+        if (noiseThreshold > 0.0f &&
+            std::find(stats.m_converged.begin(), stats.m_converged.end(), 0) == stats.m_converged.end())
+            break;
+    }
     
-    // Clean up render thread objects
+    // Wait until the render threads exit, then clean up render thread objects
+    passes.finish();
     for (size_t i = 0; i < numRenderThreads; ++i)
     {
+        threads[i].join();
         delete renderThreads[i];
     }
     delete[] renderThreads;
     
+    // Divide the sums by each pixel's number of samples (a box pixel filter,
+    // essentially), and add up what the render cost and how noisy it is
+    RenderStats renderStats;
+    renderStats.m_prepareTime = prepareTime;
+    size_t noisePixels = 0;
+    double noiseSum = 0.0;
+    for (size_t y = 0; y < height; ++y)
+    {
+        for (size_t x = 0; x < width; ++x)
+        {
+            size_t pixelIndex = y * width + x;
+            unsigned int numSamples = stats.m_numSamples[pixelIndex];
+            if (numSamples > 0)
+                pImage->pixel(x, y) /= numSamples;
+            renderStats.m_samplesSpent += numSamples;
+            renderStats.m_convergedPixels += stats.m_converged[pixelIndex];
+            if (numSamples >= 2)
+            {
+                float noise = stats.noise(pixelIndex);
+                noiseSum += noise;
+                renderStats.m_maxNoise = std::max(renderStats.m_maxNoise, noise);
+                ++noisePixels;
+            }
+        }
+    }
+    if (noisePixels > 0)
+        renderStats.m_averageNoise = float(noiseSum / noisePixels);
+    if (pStats != NULL)
+        *pStats = renderStats;
+    
     // We made a picture!
     return pImage;
 }
@@ -0,0 +1,327 @@
+#include <iostream>
+
+#include "rayito.h"
+#include "RMesh.h"
+
+
+//
+// The example scenes live here, away from any UI code, so both the Qt app and
+// the command-line renderer can build and render them.
+//
+
+
+namespace Rayito
+{
+
+
+static Mesh* makeCube()
+{
+    std::vector<Face> faces;
+    std::vector<Vector> normals;
+    std::vector<Point> vertices;
+    vertices.push_back(Point(0.0f, 0.0f, 0.0f));
+    vertices.push_back(Point(1.0f, 0.0f, 0.0f));
+    vertices.push_back(Point(1.0f, 1.0f, 0.0f));
+    vertices.push_back(Point(0.0f, 1.0f, 0.0f));
+    vertices.push_back(Point(0.0f, 0.0f, 1.0f));
+    vertices.push_back(Point(1.0f, 0.0f, 1.0f));
+    vertices.push_back(Point(1.0f, 1.0f, 1.0f));
+    vertices.push_back(Point(0.0f, 1.0f, 1.0f));
+    faces.push_back(Face());
+    faces.back().m_vertexIndices.push_back(0);
+    faces.back().m_vertexIndices.push_back(1);
+    faces.back().m_vertexIndices.push_back(2);
+    faces.back().m_vertexIndices.push_back(3);
+    faces.push_back(Face());
+    faces.back().m_vertexIndices.push_back(1);
+    faces.back().m_vertexIndices.push_back(5);
+    faces.back().m_vertexIndices.push_back(6);
+    faces.back().m_vertexIndices.push_back(2);
+    faces.push_back(Face());
+    faces.back().m_vertexIndices.push_back(5);
+    faces.back().m_vertexIndices.push_back(4);
+    faces.back().m_vertexIndices.push_back(7);
+    faces.back().m_vertexIndices.push_back(6);
+    faces.push_back(Face());
+    faces.back().m_vertexIndices.push_back(4);
+    faces.back().m_vertexIndices.push_back(0);
+    faces.back().m_vertexIndices.push_back(3);
+    faces.back().m_vertexIndices.push_back(7);
+    faces.push_back(Face());
+    faces.back().m_vertexIndices.push_back(3);
+    faces.back().m_vertexIndices.push_back(2);
+    faces.back().m_vertexIndices.push_back(6);
+    faces.back().m_vertexIndices.push_back(7);
+    faces.push_back(Face());
+    faces.back().m_vertexIndices.push_back(3);
+    faces.back().m_vertexIndices.push_back(2);
+    faces.back().m_vertexIndices.push_back(6);
+    faces.back().m_vertexIndices.push_back(7);
+    return new Mesh(vertices, normals, faces, NULL);
+}
+
+
+Image* renderExampleScene(const RenderSettings& settings,
+                          RenderProgress *pProgress,
+                          RenderStats *pStats)
+{
+    // Make a picture...
+    
+    // Available materials
+    DiffuseMaterial blueishLambert(Color(0.6f, 0.6f, 0.9f));
+    DiffuseMaterial purplishLambert(Color(0.8f, 0.3f, 0.7f));
+    DiffuseMaterial reddishLambert(Color(0.8f, 0.3f, 0.1f));
+    GlossyMaterial bluishGlossy(Color(0.5f, 0.3f, 0.8f), 0.3);
+    GlossyMaterial greenishGlossy(Color(0.3f, 0.9f, 0.3f), 0.1f);
+    GlossyMaterial reddishGlossy(Color(0.8f, 0.1f, 0.1f), 0.3f);
+    ReflectionMaterial reflective(Color(0.7f, 0.7f, 0.2f));
+    
+    // The 'scene'
+    ShapeSet masterSet;
+    
+    // Put a ground plane in (with bullseye texture!)
+    // Last parameter is whether to do the bullseye texture or not
+    Plane plane(Point(), Vector(0.0f, 1.0f, 0.0f), &blueishLambert, true);
+    plane.transform().translate(0.0f, Vector(0.0f, -2.0f, 0.0f));
+    masterSet.addShape(&plane);
+    
+    // Add a pile-o-spheres with a few interesting materials
+    
+    Sphere sphere1(Point(), 1.0f, &purplishLambert);
+    sphere1.transform().setTranslation(0.0f, Vector(2.0f, -1.0f, 0.0f));
+    sphere1.transform().setTranslation(1.0f, Vector(3.0f, -1.0f, 0.0f));
+    masterSet.addShape(&sphere1);
+    
+    Sphere sphere2(Point(), 2.0f, &greenishGlossy);
+    sphere2.transform().translate(0.0f, Vector(-3.0f, 0.0f, -2.0f));
+    masterSet.addShape(&sphere2);
+    
+    Sphere sphere3(Point(), 0.5f, &bluishGlossy);
+    sphere3.transform().translate(0.0f, Vector(1.5f, -1.5f, 2.5f));
+    masterSet.addShape(&sphere3);
+    
+    Sphere sphere4(Point(), 0.5f, &reflective);
+    sphere4.transform().translate(0.0f, Vector(-2.0, -1.5f, 1.0f));
+    masterSet.addShape(&sphere4);
+    
+    // Add a manually created mesh (a box), and read an OBJ file into a mesh
+    
+    Mesh *cubeMesh = makeCube();
+    cubeMesh->setMaterial(&reddishLambert);
+    cubeMesh->transform().translate(0.0f, Vector(0.0f, -2.0f, -2.0f));
+    cubeMesh->transform().rotate(1.0f, Quaternion(Vector(0.0f, 1.0f, 0.0f), M_PI / 4.0f));
+    masterSet.addShape(cubeMesh);
+
+    // (If the OBJ can't be found, render the rest of the scene without it)
+    std::string objFilename = settings.m_modelDirectory + "/bumpy.obj";
+    Mesh* pOBJMesh = createFromOBJFile(objFilename.c_str(),
+                                       settings.m_meshCache ? settings.m_meshCacheDirectory.c_str() : NULL);
+#if MAKE_OBJ_A_MESH_LIGHT
+    ShapeLight *pMeshLight = NULL;
+#endif
+    if (pOBJMesh != NULL)
+    {
+        pOBJMesh->setMaterial(&reddishGlossy);
+        pOBJMesh->transform().setTranslation(0.0f, Vector(0.2f, 0.0f, 0.0f));
+        pOBJMesh->transform().rotate(0.5f, Quaternion(Vector(0.0f, 1.0f, 0.0f), M_PI / 4.0f));
+        pOBJMesh->transform().rotate(1.0f, Quaternion(Vector(0.0f, 1.0f, 0.0f), M_PI / 2.0f));
+#if MAKE_OBJ_A_MESH_LIGHT
+        // For some fun, you can turn the OBJ mesh into a light (it's a bit noisy, though)
+        pMeshLight = new ShapeLight(pOBJMesh, Color(1.0f, 1.0f, 1.0f), 10.0f);
+        masterSet.addShape(pMeshLight);
+#else
+        masterSet.addShape(pOBJMesh);
+#endif
+    }
+    else
+    {
+        std::cerr << "Could not read OBJ file: " << objFilename << std::endl;
+    }
+
+    // Add an area light
+    RectangleLight areaLight(Point(),
+                             Vector(3.0f, 0.0f, 0.0f),
+                             Vector(0.0f, 0.0f, 3.0f),
+                             Color(1.0f, 1.0f, 1.0f),
+                             5.0f);
+    areaLight.transform().setTranslation(0.0f, Vector(-1.5f, 4.0f, -1.5f));
+    // Uncomment this to have the rect light hinge-swing downward
+//    areaLight.transform().setRotation(1.0f, Quaternion(Vector(0.0f, 0.0f, 1.0f), -M_PI / 4.0f));
+    masterSet.addShape(&areaLight);
+
+    // Add an area light based on a shape (a sphere)
+    Sphere sphereForLight(Point(), 0.1f, &blueishLambert);
+    sphereForLight.transform().setTranslation(0.0f, Vector(0.0f, 0.5f, 4.0f));
+    sphereForLight.transform().setTranslation(0.33f, Vector(0.0f, 1.5f, 4.0f));
+    sphereForLight.transform().setTranslation(0.67f, Vector(1.0f, 1.5f, 4.0f));
+    sphereForLight.transform().setTranslation(1.0f, Vector(1.0f, 0.5f, 4.0f));
+    ShapeLight sphereLight(&sphereForLight, Color(1.0f, 1.0f, 0.3f), 100.0f);
+    masterSet.addShape(&sphereLight);
+    
+    // Create the camera based on the render settings
+    PerspectiveCamera cam(settings.m_fieldOfView,
+                          Point(-4.0f, 5.0f, 15.0f),
+                          Point(0.0f, 0.0f, 0.0f),
+                          Point(0.0f, 1.0f, 0.0f),
+                          settings.m_focalDistance,
+                          settings.m_lensRadius,
+                          settings.m_shutterOpen,
+                          settings.m_shutterClose);
+    
+    // Ray trace!
+    Image *pImage = raytrace(masterSet, cam, settings, pProgress, pStats);
+    
+    // Clean up the scene
+#if MAKE_OBJ_A_MESH_LIGHT
+    delete pMeshLight;
+#endif
+    delete cubeMesh;
+    delete pOBJMesh;
+    
+    return pImage;
+}
+
+
+// Let's have some fun, and make a scene where objects fall and bounce off the
+// ground using real physics kinematics.
+static Point kinematicPosition(const Point& start,
+                               const Vector& velocity,
+                               float time,
+                               const Vector& gravity = Vector(0.0f, -9.8f, 0.0f),
+                               float groundHeight = 0.0f)
+{
+    // Kinematic equations:
+    //     p = p0 + v*t
+    //     p = t*(vi + vf)/2
+    //     vf = v0 + a*t
+    //     p = p0 + (v0 + v0 + a*t)*t/2 = p0 + v0*t + a*t*t/2
+    // Solving for time to find when we smack the plane:
+    //     t = (-v0 + sqrt(v0*v0 - 4*a*p0/2))/(2*a/2) = (-v0 + sqrt(v0*v0 - 2*a*p0))/a
+    
+    // Gravity direction
+    Vector up = -gravity.normalized();
+    float vUp = dot(velocity, up);
+    float pUp = dot(start, up);
+    float aUp = -gravity.length();
+    
+    float discriminant = vUp * vUp - 2.0f * aUp * pUp;
+    if (discriminant > 0.0f)
+    {
+        float intersectionTime = (-vUp - std::sqrt(discriminant)) / aUp;
+        if (intersectionTime < time)
+        {
+            // Find intersection position
+            Point isect = start + velocity * intersectionTime +
+                          gravity * intersectionTime * intersectionTime * 0.5f;
+            Vector isectVelocity = (velocity + gravity * intersectionTime);
+            Vector reboundVelocity = isectVelocity - 2.0f * up * dot(isectVelocity, up);
+            float reboundTime = time - intersectionTime;
+            return isect + reboundVelocity * reboundTime +
+                   gravity * reboundTime * reboundTime * 0.5f;
+        }
+    }
+    // Do the usual kinematic result
+    return start + velocity * time + gravity * time * time * 0.5f;
+}
+
+
+Image* renderBouncingScene(const RenderSettings& settings,
+                           RenderProgress *pProgress,
+                           RenderStats *pStats)
+{
+    // Make a picture...
+    
+    // Available materials
+    DiffuseMaterial blueishLambert(Color(0.6f, 0.6f, 0.9f));
+    GlossyMaterial yellowishGlossy(Color(0.9f, 0.9f, 0.3f), 0.3f);
+    DiffuseMaterial redLambert(Color(1.0f, 0.2f, 0.2f));
+    
+    // The 'scene'
+    ShapeSet masterSet;
+    
+    // Put a ground plane in (with bullseye texture!)
+    // Last parameter is whether to do the bullseye texture or not
+    Plane plane(Point(), Vector(0.0f, 1.0f, 0.0f), &redLambert, true);
+    masterSet.addShape(&plane);
+    
+    // Add a pile-o-spheres at various stages of falling/bouncing
+    
+    Sphere spheres[10];
+    Point start(-10.0f, 10.0f, 0.0f);
+    Vector velocity(4.5f, 0.0f, 0.0f);
+    float timeOffset = 0.0f;
+    const float timeDelta = 0.2f;
+    for (unsigned int i = 0; i < 10; ++i)
+    {
+        Point position0 = kinematicPosition(start, velocity, timeOffset);
+        Point position1 = kinematicPosition(start, velocity, timeOffset + timeDelta);
+        
+        spheres[i].transform().setTranslation(0.0f, position0);
+        spheres[i].transform().setTranslation(1.0f, position1);
+        spheres[i].setMaterial(&blueishLambert);
+        
+        masterSet.addShape(&spheres[i]);
+        
+        timeOffset += timeDelta * 2.0f;
+    }
+    
+    // Add a pile-o-cubes at various stages of falling/bouncing, and rotating
+    
+    Mesh* cubes[10];
+    start = Point(10.0f, 10.0f, 2.0f);
+    velocity = Vector(-4.5f, 0.0f, 0.0f);
+    timeOffset = 0.0f;
+    for (unsigned int i = 0; i < 10; ++i)
+    {
+        Point position0 = kinematicPosition(start, velocity, timeOffset);
+        Point position1 = kinematicPosition(start, velocity, timeOffset + timeDelta);
+        float rotation0 = timeOffset * M_PI * 0.5;
+        if (rotation0 > M_PI * 2.0f)
+            rotation0 -= M_PI * 2.0f;
+        float rotation1 = rotation0 + timeDelta * M_PI * 0.5;
+        
+        cubes[i] = makeCube();
+        cubes[i]->transform().setTranslation(0.0f, position0);
+        cubes[i]->transform().setRotation(0.0f, Quaternion(Vector(1.0f, 0.0f, 1.0f).normalized(), rotation0));
+        cubes[i]->transform().setTranslation(1.0f, position1);
+        cubes[i]->transform().setRotation(1.0f, Quaternion(Vector(1.0f, 0.0f, 1.0f).normalized(), rotation1));
+        cubes[i]->setMaterial(&yellowishGlossy);
+        
+        masterSet.addShape(cubes[i]);
+        
+        timeOffset += timeDelta * 2.0f;
+    }
+    
+    // Add an area light
+    RectangleLight areaLight(Point(),
+                             Vector(2.0f, 0.0f, 0.0f),
+                             Vector(0.0f, 0.0f, 2.0f),
+                             Color(1.0f, 1.0f, 1.0f),
+                             50.0f);
+    areaLight.transform().setTranslation(0.0f, Vector(-1.0f, 15.0f, 1.0f));
+    masterSet.addShape(&areaLight);
+
+    // Create the camera based on the render settings
+    PerspectiveCamera cam(settings.m_fieldOfView,
+                          Point(-4.0f, 10.0f, 30.0f),
+                          Point(0.0f, 5.0f, 0.0f),
+                          Point(0.0f, 1.0f, 0.0f),
+                          settings.m_focalDistance,
+                          settings.m_lensRadius,
+                          settings.m_shutterOpen,
+                          settings.m_shutterClose);
+    
+    // Ray trace!
+    Image *pImage = raytrace(masterSet, cam, settings, pProgress, pStats);
+    
+    // Clean up the scene
+    for (unsigned int i = 0; i < 10; ++i)
+    {
+        delete cubes[i];
+    }
+    
+    return pImage;
+}
+
+
+} // namespace Rayito
@@ -0,0 +1,399 @@
+#include "RMesh.h"
+
+// The AVX kernel gets compiled for AVX on its own (with the target attribute
+// on GCC/clang; MSVC is happy to emit AVX anywhere), so the rest of the
+// program still runs on CPUs without it.  It's only used if the CPU says so.
+#if RAYITO_USE_SSE && (defined(__GNUC__) || defined(_MSC_VER))
+    #define RAYITO_USE_AVX 1
+    #include <immintrin.h>
+    #if defined(_MSC_VER) && !defined(__clang__)
+        #include <intrin.h>
+        #define RAYITO_TARGET_AVX
+    #else
+        #define RAYITO_TARGET_AVX __attribute__((target("avx")))
+    #endif
+#else
+    #define RAYITO_USE_AVX 0
+#endif
+
+
+namespace Rayito
+{
+
+
+static bool cpuSupportsAVX()
+{
+#if RAYITO_USE_AVX && defined(_MSC_VER) && !defined(__clang__)
+    // Needs the CPU to have AVX, and the OS to save the AVX registers
+    int info[4];
+    __cpuid(info, 1);
+    bool osSaves = (info[2] & (1 << 27)) != 0;
+    bool hasAVX = (info[2] & (1 << 28)) != 0;
+    return osSaves && hasAVX && (_xgetbv(0) & 0x6) == 0x6;
+#elif RAYITO_USE_AVX
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx") != 0;
+#else
+    return false;
+#endif
+}
+
+
+bool triangleKernelSupported(TriangleKernel kernel)
+{
+    switch (kernel)
+    {
+        case kTriangleKernelScalar: return true;
+        case kTriangleKernelSSE:    return RAYITO_USE_SSE != 0;
+        case kTriangleKernelAVX:
+        {
+            static const bool supported = cpuSupportsAVX();
+            return supported;
+        }
+    }
+    return false;
+}
+
+
+TriangleKernel fastestTriangleKernel()
+{
+    if (triangleKernelSupported(kTriangleKernelAVX))
+        return kTriangleKernelAVX;
+    if (triangleKernelSupported(kTriangleKernelSSE))
+        return kTriangleKernelSSE;
+    return kTriangleKernelScalar;
+}
+
+
+// Go through the lanes that passed the test (in order), keeping the closest;
+// a later lane has to be strictly closer to win, just like in Mesh::intersectTri()
+static int closestLane(int mask, unsigned int width, const float t[], float& tMax)
+{
+    int closest = -1;
+    for (unsigned int lane = 0; lane < width; ++lane)
+    {
+        if ((mask & (1 << lane)) && t[lane] < tMax)
+        {
+            tMax = t[lane];
+            closest = (int)lane;
+        }
+    }
+    return closest;
+}
+
+// Lanes that hold one of the triangles we were asked about (the rest of a
+// load past the end of the run belongs to some other leaf)
+static int laneMask(unsigned int width, unsigned int remaining)
+{
+    return remaining >= width ? (1 << width) - 1 : (1 << remaining) - 1;
+}
+
+
+/*
+ * The SIMD kernels do exactly the same Moller-Trumbore math as
+ * Mesh::intersectTri() (same operations in the same order, so the results are
+ * bit-for-bit identical), just on a packet of triangles at once.  Instead of
+ * bailing out early, every test makes a lane mask, and the masks get ANDed
+ * together at the end.  The tests are written as "passes" rather than "fails"
+ * so a NaN from a degenerate triangle fails them.
+ */
+
+#if RAYITO_USE_SSE
+
+static inline __m128 dot4(__m128 ax, __m128 ay, __m128 az, __m128 bx, __m128 by, __m128 bz)
+{
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, bx), _mm_mul_ps(ay, by)), _mm_mul_ps(az, bz));
+}
+
+// Distance and barycentric coords of the ray hitting a packet's four
+// triangles, and a mask of which ones actually count as a hit
+static inline int intersectPacket4(const TrianglePacket& packet,
+                                   const __m128 origin[3],
+                                   const __m128 direction[3],
+                                   float tMax,
+                                   __m128& outT,
+                                   __m128& outBeta,
+                                   __m128& outGamma)
+{
+    const __m128 signBit = _mm_set1_ps(-0.0f);
+    __m128 v0x = _mm_load_ps(packet.m_components[0]);
+    __m128 v0y = _mm_load_ps(packet.m_components[1]);
+    __m128 v0z = _mm_load_ps(packet.m_components[2]);
+    __m128 e1x = _mm_load_ps(packet.m_components[3]);
+    __m128 e1y = _mm_load_ps(packet.m_components[4]);
+    __m128 e1z = _mm_load_ps(packet.m_components[5]);
+    __m128 e2x = _mm_load_ps(packet.m_components[6]);
+    __m128 e2y = _mm_load_ps(packet.m_components[7]);
+    __m128 e2z = _mm_load_ps(packet.m_components[8]);
+    
+    // Normal is cross(edge1, edge2), same as MeshTriangle::m_normal
+    __m128 nx = _mm_sub_ps(_mm_mul_ps(e1y, e2z), _mm_mul_ps(e1z, e2y));
+    __m128 ny = _mm_sub_ps(_mm_mul_ps(e1z, e2x), _mm_mul_ps(e1x, e2z));
+    __m128 nz = _mm_sub_ps(_mm_mul_ps(e1x, e2y), _mm_mul_ps(e1y, e2x));
+    __m128 det = _mm_xor_ps(dot4(direction[0], direction[1], direction[2], nx, ny, nz), signBit);
+    
+    __m128 rx = _mm_sub_ps(v0x, origin[0]);
+    __m128 ry = _mm_sub_ps(v0y, origin[1]);
+    __m128 rz = _mm_sub_ps(v0z, origin[2]);
+    __m128 cx = _mm_sub_ps(_mm_mul_ps(direction[1], rz), _mm_mul_ps(direction[2], ry));
+    __m128 cy = _mm_sub_ps(_mm_mul_ps(direction[2], rx), _mm_mul_ps(direction[0], rz));
+    __m128 cz = _mm_sub_ps(_mm_mul_ps(direction[0], ry), _mm_mul_ps(direction[1], rx));
+    __m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+    
+    __m128 gamma = _mm_mul_ps(_mm_xor_ps(dot4(e1x, e1y, e1z, cx, cy, cz), signBit), invDet);
+    __m128 beta = _mm_mul_ps(dot4(e2x, e2y, e2z, cx, cy, cz), invDet);
+    __m128 t = _mm_mul_ps(_mm_xor_ps(dot4(rx, ry, rz, nx, ny, nz), signBit), invDet);
+    
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    __m128 valid = _mm_cmpneq_ps(det, zero);
+    valid = _mm_and_ps(valid, _mm_cmpge_ps(gamma, zero));
+    valid = _mm_and_ps(valid, _mm_cmple_ps(gamma, one));
+    valid = _mm_and_ps(valid, _mm_cmpge_ps(beta, zero));
+    valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(beta, gamma), one));
+    valid = _mm_and_ps(valid, _mm_cmpge_ps(t, _mm_set1_ps(kRayTMin)));
+    valid = _mm_and_ps(valid, _mm_cmplt_ps(t, _mm_set1_ps(tMax)));
+    
+    outT = t;
+    outBeta = beta;
+    outGamma = gamma;
+    return _mm_movemask_ps(valid);
+}
+
+static int intersectTrianglesSSE(const TrianglePacket* packets,
+                                 unsigned int numTris,
+                                 const Ray& ray,
+                                 float tMax,
+                                 float& outT,
+                                 float& outBeta,
+                                 float& outGamma)
+{
+    __m128 origin[3] = { _mm_set1_ps(ray.m_origin.m_x), _mm_set1_ps(ray.m_origin.m_y), _mm_set1_ps(ray.m_origin.m_z) };
+    __m128 direction[3] = { _mm_set1_ps(ray.m_direction.m_x), _mm_set1_ps(ray.m_direction.m_y), _mm_set1_ps(ray.m_direction.m_z) };
+    
+    int hit = -1;
+    for (unsigned int first = 0; first < numTris; first += 4)
+    {
+        __m128 t, beta, gamma;
+        int mask = intersectPacket4(packets[first / 4], origin, direction, tMax, t, beta, gamma);
+        mask &= laneMask(4, numTris - first);
+        if (mask == 0)
+            continue;
+        
+        float tLanes[4], betaLanes[4], gammaLanes[4];
+        _mm_storeu_ps(tLanes, t);
+        _mm_storeu_ps(betaLanes, beta);
+        _mm_storeu_ps(gammaLanes, gamma);
+        int lane = closestLane(mask, 4, tLanes, tMax);
+        hit = (int)(first + lane);
+        outT = tLanes[lane];
+        outBeta = betaLanes[lane];
+        outGamma = gammaLanes[lane];
+    }
+    return hit;
+}
+
+static bool doesIntersectTrianglesSSE(const TrianglePacket* packets,
+                                      unsigned int numTris,
+                                      const Ray& ray)
+{
+    __m128 origin[3] = { _mm_set1_ps(ray.m_origin.m_x), _mm_set1_ps(ray.m_origin.m_y), _mm_set1_ps(ray.m_origin.m_z) };
+    __m128 direction[3] = { _mm_set1_ps(ray.m_direction.m_x), _mm_set1_ps(ray.m_direction.m_y), _mm_set1_ps(ray.m_direction.m_z) };
+    
+    for (unsigned int first = 0; first < numTris; first += 4)
+    {
+        __m128 t, beta, gamma;
+        int mask = intersectPacket4(packets[first / 4], origin, direction, ray.m_tMax, t, beta, gamma);
+        if (mask & laneMask(4, numTris - first))
+            return true;
+    }
+    return false;
+}
+
+#endif // RAYITO_USE_SSE
+
+
+#if RAYITO_USE_AVX
+
+RAYITO_TARGET_AVX
+static inline __m256 dot8(__m256 ax, __m256 ay, __m256 az, __m256 bx, __m256 by, __m256 bz)
+{
+    return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ax, bx), _mm256_mul_ps(ay, by)), _mm256_mul_ps(az, bz));
+}
+
+// One component of two packets side by side
+RAYITO_TARGET_AVX
+static inline __m256 loadPackets8(const TrianglePacket* packets, unsigned int c)
+{
+    return _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_load_ps(packets[0].m_components[c])),
+                                _mm_load_ps(packets[1].m_components[c]),
+                                1);
+}
+
+// Same as intersectPacket4(), for two packets (eight triangles) at a time
+RAYITO_TARGET_AVX
+static inline int intersectPacket8(const TrianglePacket* packets,
+                                   const __m256 origin[3],
+                                   const __m256 direction[3],
+                                   float tMax,
+                                   __m256& outT,
+                                   __m256& outBeta,
+                                   __m256& outGamma)
+{
+    const __m256 signBit = _mm256_set1_ps(-0.0f);
+    __m256 v0x = loadPackets8(packets, 0);
+    __m256 v0y = loadPackets8(packets, 1);
+    __m256 v0z = loadPackets8(packets, 2);
+    __m256 e1x = loadPackets8(packets, 3);
+    __m256 e1y = loadPackets8(packets, 4);
+    __m256 e1z = loadPackets8(packets, 5);
+    __m256 e2x = loadPackets8(packets, 6);
+    __m256 e2y = loadPackets8(packets, 7);
+    __m256 e2z = loadPackets8(packets, 8);
+    
+    __m256 nx = _mm256_sub_ps(_mm256_mul_ps(e1y, e2z), _mm256_mul_ps(e1z, e2y));
+    __m256 ny = _mm256_sub_ps(_mm256_mul_ps(e1z, e2x), _mm256_mul_ps(e1x, e2z));
+    __m256 nz = _mm256_sub_ps(_mm256_mul_ps(e1x, e2y), _mm256_mul_ps(e1y, e2x));
+    __m256 det = _mm256_xor_ps(dot8(direction[0], direction[1], direction[2], nx, ny, nz), signBit);
+    
+    __m256 rx = _mm256_sub_ps(v0x, origin[0]);
+    __m256 ry = _mm256_sub_ps(v0y, origin[1]);
+    __m256 rz = _mm256_sub_ps(v0z, origin[2]);
+    __m256 cx = _mm256_sub_ps(_mm256_mul_ps(direction[1], rz), _mm256_mul_ps(direction[2], ry));
+    __m256 cy = _mm256_sub_ps(_mm256_mul_ps(direction[2], rx), _mm256_mul_ps(direction[0], rz));
+    __m256 cz = _mm256_sub_ps(_mm256_mul_ps(direction[0], ry), _mm256_mul_ps(direction[1], rx));
+    __m256 invDet = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+    
+    __m256 gamma = _mm256_mul_ps(_mm256_xor_ps(dot8(e1x, e1y, e1z, cx, cy, cz), signBit), invDet);
+    __m256 beta = _mm256_mul_ps(dot8(e2x, e2y, e2z, cx, cy, cz), invDet);
+    __m256 t = _mm256_mul_ps(_mm256_xor_ps(dot8(rx, ry, rz, nx, ny, nz), signBit), invDet);
+    
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    __m256 valid = _mm256_cmp_ps(det, zero, _CMP_NEQ_OQ);
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(gamma, zero, _CMP_GE_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(gamma, one, _CMP_LE_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(beta, zero, _CMP_GE_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(_mm256_add_ps(beta, gamma), one, _CMP_LE_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, _mm256_set1_ps(kRayTMin), _CMP_GE_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, _mm256_set1_ps(tMax), _CMP_LT_OQ));
+    
+    outT = t;
+    outBeta = beta;
+    outGamma = gamma;
+    return _mm256_movemask_ps(valid);
+}
+
+// The AVX kernels take eight triangles at a time while there are more than
+// four left, and finish up with the SSE kernel (a run of packets can end on
+// an odd one, so there isn't always a second packet to load)
+RAYITO_TARGET_AVX
+static int intersectTrianglesAVX(const TrianglePacket* packets,
+                                 unsigned int numTris,
+                                 const Ray& ray,
+                                 float tMax,
+                                 float& outT,
+                                 float& outBeta,
+                                 float& outGamma)
+{
+    __m256 origin[3] = { _mm256_set1_ps(ray.m_origin.m_x), _mm256_set1_ps(ray.m_origin.m_y), _mm256_set1_ps(ray.m_origin.m_z) };
+    __m256 direction[3] = { _mm256_set1_ps(ray.m_direction.m_x), _mm256_set1_ps(ray.m_direction.m_y), _mm256_set1_ps(ray.m_direction.m_z) };
+    
+    int hit = -1;
+    unsigned int first = 0;
+    for ( ; first + 4 < numTris; first += 8)
+    {
+        __m256 t, beta, gamma;
+        int mask = intersectPacket8(&packets[first / 4], origin, direction, tMax, t, beta, gamma);
+        mask &= laneMask(8, numTris - first);
+        if (mask == 0)
+            continue;
+        
+        float tLanes[8], betaLanes[8], gammaLanes[8];
+        _mm256_storeu_ps(tLanes, t);
+        _mm256_storeu_ps(betaLanes, beta);
+        _mm256_storeu_ps(gammaLanes, gamma);
+        int lane = closestLane(mask, 8, tLanes, tMax);
+        hit = (int)(first + lane);
+        outT = tLanes[lane];
+        outBeta = betaLanes[lane];
+        outGamma = gammaLanes[lane];
+    }
+    if (first < numTris)
+    {
+        int lastHit = intersectTrianglesSSE(&packets[first / 4], numTris - first, ray, tMax, outT, outBeta, outGamma);
+        if (lastHit >= 0)
+            hit = (int)first + lastHit;
+    }
+    return hit;
+}
+
+RAYITO_TARGET_AVX
+static bool doesIntersectTrianglesAVX(const TrianglePacket* packets,
+                                      unsigned int numTris,
+                                      const Ray& ray)
+{
+    __m256 origin[3] = { _mm256_set1_ps(ray.m_origin.m_x), _mm256_set1_ps(ray.m_origin.m_y), _mm256_set1_ps(ray.m_origin.m_z) };
+    __m256 direction[3] = { _mm256_set1_ps(ray.m_direction.m_x), _mm256_set1_ps(ray.m_direction.m_y), _mm256_set1_ps(ray.m_direction.m_z) };
+    
+    unsigned int first = 0;
+    for ( ; first + 4 < numTris; first += 8)
+    {
+        __m256 t, beta, gamma;
+        int mask = intersectPacket8(&packets[first / 4], origin, direction, ray.m_tMax, t, beta, gamma);
+        if (mask & laneMask(8, numTris - first))
+            return true;
+    }
+    return first < numTris && doesIntersectTrianglesSSE(&packets[first / 4], numTris - first, ray);
+}
+
+#endif // RAYITO_USE_AVX
+
+
+int intersectTrianglePackets(TriangleKernel kernel,
+                             const TrianglePacket* packets,
+                             unsigned int numTris,
+                             const Ray& ray,
+                             float tMax,
+                             float& outT,
+                             float& outBeta,
+                             float& outGamma)
+{
+    switch (kernel)
+    {
+#if RAYITO_USE_AVX
+        case kTriangleKernelAVX:
+            return intersectTrianglesAVX(packets, numTris, ray, tMax, outT, outBeta, outGamma);
+#endif
+#if RAYITO_USE_SSE
+        case kTriangleKernelSSE:
+            return intersectTrianglesSSE(packets, numTris, ray, tMax, outT, outBeta, outGamma);
+#endif
+        default:
+            return -1;
+    }
+}
+
+
+bool doesIntersectTrianglePackets(TriangleKernel kernel,
+                                  const TrianglePacket* packets,
+                                  unsigned int numTris,
+                                  const Ray& ray)
+{
+    switch (kernel)
+    {
+#if RAYITO_USE_AVX
+        case kTriangleKernelAVX:
+            return doesIntersectTrianglesAVX(packets, numTris, ray);
+#endif
+#if RAYITO_USE_SSE
+        case kTriangleKernelSSE:
+            return doesIntersectTrianglesSSE(packets, numTris, ray);
+#endif
+        default:
+            return false;
+    }
+}
+
+
+} // namespace Rayito
@@ -0,0 +1,576 @@
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "rayito.h"
+
+
+namespace Rayito
+{
+
+/*
+ * Wavefront path tracing.  pathTrace() follows one path from start to finish
+ * before starting the next, so one intersection test after another goes
+ * through unrelated parts of the BVH, and one shading after another runs
+ * unrelated materials.  Here a whole batch of paths moves forward together,
+ * one bounce at a time, and each bounce is done as separate stages over the
+ * batch:
+ *     extend    trace every live path's next ray into the scene
+ *     shade     add emission, queue up the light samples' rays, pick the
+ *               next leg of the path (grouped by material)
+ *     shadow    trace the light samples' rays, and add in the ones that
+ *               make it to their light
+ * Before each stage, the rays (or hits) are sorted along a Morton curve, so
+ * rays that start near each other and head the same way are traced one after
+ * another, and find the BVH nodes they need still in cache.
+ *
+ * Every path uses the same sample patterns and makes the same choices as it
+ * would in pathTrace(), so the two give the same answers (give or take the
+ * order some floating point adds happen in).
+ */
+
+
+namespace
+{
+
+
+// Spread the low 10 bits of a value out to every third bit
+inline uint32_t spreadBits(uint32_t v)
+{
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+// Bits at each level of the Morton curve (10 per axis)
+const float kMortonCells = 1024.0f;
+
+inline uint32_t mortonCell(float value, float low, float scale)
+{
+    float cell = (value - low) * scale;
+    if (!(cell > 0.0f)) // (NaNs too)
+        return 0;
+    return std::min(uint32_t(cell), uint32_t(kMortonCells) - 1);
+}
+
+// Morton code of a point inside some bounds, 30 bits
+class MortonEncoder
+{
+public:
+    explicit MortonEncoder(const BBox& bounds) : m_low(bounds.m_min)
+    {
+        Vector extents = bounds.m_max - bounds.m_min;
+        m_scale = Vector(extents.m_x > 0.0f ? kMortonCells / extents.m_x : 0.0f,
+                         extents.m_y > 0.0f ? kMortonCells / extents.m_y : 0.0f,
+                         extents.m_z > 0.0f ? kMortonCells / extents.m_z : 0.0f);
+    }
+    
+    uint64_t encode(const Point& p) const
+    {
+        return (spreadBits(mortonCell(p.m_x, m_low.m_x, m_scale.m_x)) << 2) |
+               (spreadBits(mortonCell(p.m_y, m_low.m_y, m_scale.m_y)) << 1) |
+                spreadBits(mortonCell(p.m_z, m_low.m_z, m_scale.m_z));
+    }
+    
+    // Origin first, then roughly which way it points (2 bits per axis), so
+    // rays from the same spot are still grouped by direction
+    uint64_t encode(const Ray& ray) const
+    {
+        uint32_t dx = std::min(uint32_t((ray.m_direction.m_x + 1.0f) * 2.0f), 3u);
+        uint32_t dy = std::min(uint32_t((ray.m_direction.m_y + 1.0f) * 2.0f), 3u);
+        uint32_t dz = std::min(uint32_t((ray.m_direction.m_z + 1.0f) * 2.0f), 3u);
+        uint32_t direction = (spreadBits(dx) << 2) | (spreadBits(dy) << 1) | spreadBits(dz);
+        return (encode(ray.m_origin) << 6) | direction;
+    }
+    
+private:
+    Point m_low;
+    Vector m_scale;
+};
+
+
+// A queue entry to sort: grouped first (by material, say), then along the curve
+struct SortKey
+{
+    uintptr_t m_group;
+    uint64_t m_key;
+    unsigned int m_index;
+    
+    bool operator <(const SortKey& k) const
+    {
+        if (m_group != k.m_group)
+            return m_group < k.m_group;
+        return m_key < k.m_key;
+    }
+};
+
+
+// The wavefront's state for more paths than this no longer fits in cache,
+// which costs more than the sorting saves, so bigger batches go in pieces
+const size_t kMaxWavefrontPaths = 256;
+
+
+class Wavefront
+{
+public:
+    Wavefront(ShapeSet& scene, const LightTree& lights)
+        : m_pPaths(NULL), m_scene(scene), m_lights(lights) { }
+    
+    // Trace the paths all the way (the state is kept around for the next batch)
+    void run(PathSample *pPaths, size_t numPaths)
+    {
+        m_pPaths = pPaths;
+        m_rays.resize(numPaths);
+        m_hits.resize(numPaths);
+        m_throughput.assign(numPaths, Color(1.0f, 1.0f, 1.0f));
+        m_numBounces.assign(numPaths, 0);
+        m_numDiracBounces.assign(numPaths, 0);
+        m_lastBounceDirac.assign(numPaths, 0);
+        m_lastPosition.resize(numPaths);
+        m_lastLitNormal.resize(numPaths);
+        m_lastBrdfPdf.assign(numPaths, 0.0f);
+        m_active.resize(numPaths);
+        for (size_t i = 0; i < numPaths; ++i)
+        {
+            pPaths[i].m_result = Color(0.0f, 0.0f, 0.0f);
+            m_rays[i] = pPaths[i].m_ray;
+            m_active[i] = static_cast<unsigned int>(i);
+        }
+        
+        while (!m_active.empty())
+        {
+            extend();
+            shade();
+            traceShadowRays();
+        }
+    }
+    
+private:
+    // Trace each live path's ray, and drop the ones that leave the scene
+    void extend()
+    {
+        sortRays(m_rays, m_active);
+        size_t numLive = 0;
+        for (size_t i = 0; i < m_active.size(); ++i)
+        {
+            unsigned int path = m_active[i];
+            m_hits[path] = Intersection(m_rays[path]);
+            if (m_scene.intersect(m_hits[path]))
+                m_active[numLive++] = path;
+        }
+        m_active.resize(numLive);
+    }
+    
+    // Shade each hit, and drop the paths that are done bouncing
+    void shade()
+    {
+        // Group the hits by material, so each material's code and data get
+        // used for a run of hits before moving on to the next
+        BBox bounds;
+        for (size_t i = 0; i < m_active.size(); ++i)
+            bounds.expand(m_hits[m_active[i]].position());
+        MortonEncoder encoder(bounds);
+        m_sortKeys.resize(m_active.size());
+        for (size_t i = 0; i < m_active.size(); ++i)
+        {
+            const Intersection& hit = m_hits[m_active[i]];
+            m_sortKeys[i].m_group = reinterpret_cast<uintptr_t>(hit.m_pMaterial);
+            m_sortKeys[i].m_key = encoder.encode(hit.position());
+            m_sortKeys[i].m_index = m_active[i];
+        }
+        std::sort(m_sortKeys.begin(), m_sortKeys.end());
+        
+        size_t numLive = 0;
+        for (size_t i = 0; i < m_sortKeys.size(); ++i)
+        {
+            unsigned int path = m_sortKeys[i].m_index;
+            if (shadePath(path))
+                m_active[numLive++] = path;
+        }
+        m_active.resize(numLive);
+    }
+    
+    // Trace the rays the light samples queued up, and add in the light they find
+    void traceShadowRays()
+    {
+        // Light samples: anything in the way, and there's no light
+        listAll(m_shadowRays.size(), m_shadowOrder);
+        sortRays(m_shadowRays, m_shadowOrder);
+        for (size_t i = 0; i < m_shadowOrder.size(); ++i)
+        {
+            unsigned int entry = m_shadowOrder[i];
+            if (!m_scene.doesIntersect(m_shadowRays[entry]))
+                m_pPaths[m_shadowPaths[entry]].m_result += m_shadowLight[entry];
+        }
+        
+        // BRDF samples: see which light they run into, if any
+        listAll(m_brdfRays.size(), m_brdfOrder);
+        sortRays(m_brdfRays, m_brdfOrder);
+        for (size_t i = 0; i < m_brdfOrder.size(); ++i)
+        {
+            unsigned int entry = m_brdfOrder[i];
+            Intersection lightIntersection(m_brdfRays[entry]);
+            if (!m_scene.intersect(lightIntersection) || !lightIntersection.m_pShape->isLight())
+                continue;
+            Light *pLightShape = (Light*) lightIntersection.m_pShape;
+            const Light *pTarget = m_brdfTargets[entry];
+            if (pTarget != NULL && pLightShape != pTarget)
+                continue;
+            float lightPdf = pLightShape->intersectPdf(lightIntersection);
+            if (lightPdf <= 0.0f)
+                continue;
+            
+            float brdfPdf = m_brdfPdfs[entry];
+            float weight;
+            if (pTarget != NULL)
+            {
+                // Two-sample MIS with the selected light's own sample
+                weight = powerHeuristic(1, brdfPdf, 1, lightPdf);
+            }
+            else
+            {
+                // One-sample MIS: any light counts, so the light tree says
+                // how likely light sampling was to pick it
+                float lightFraction = m_brdfLightFractions[entry];
+                lightPdf *= m_lights.pdf(m_brdfRays[entry].m_origin, m_brdfLitNormals[entry], pLightShape);
+                weight = 1.0f / (lightFraction * lightPdf + (1.0f - lightFraction) * brdfPdf);
+            }
+            m_pPaths[m_brdfPaths[entry]].m_result += pLightShape->emitted() * m_brdfLight[entry] * weight;
+        }
+        
+        m_shadowRays.clear();
+        m_shadowPaths.clear();
+        m_shadowLight.clear();
+        m_brdfRays.clear();
+        m_brdfPaths.clear();
+        m_brdfLight.clear();
+        m_brdfTargets.clear();
+        m_brdfPdfs.clear();
+        m_brdfLightFractions.clear();
+        m_brdfLitNormals.clear();
+    }
+    
+    
+    // One bounce of pathTrace() for a path whose ray hit something: returns
+    // whether the path carries on
+    bool shadePath(unsigned int path)
+    {
+        PathSample& sample = m_pPaths[path];
+        SamplerContainer& samplers = *sample.m_pSamplers;
+        const Intersection& intersection = m_hits[path];
+        const Ray& currentRay = m_rays[path];
+        Color& throughput = m_throughput[path];
+        unsigned int& numBounces = m_numBounces[path];
+        bool shareBrdfRay = samplers.m_integrator == kIntegratorSharedBrdfRay;
+        
+        // Emission when directly visible or via perfect specular bounces, or
+        // as the BRDF half of MIS for the last vertex with a shared BRDF ray
+        bool pastLastBounce = numBounces == samplers.m_maxRayDepth;
+        if (!pastLastBounce && (numBounces == 0 || numBounces == m_numDiracBounces[path]))
+        {
+            sample.m_result += throughput * ShadingRecord::emittance(intersection.m_pMaterial);
+        }
+        else if (shareBrdfRay && !m_lastBounceDirac[path] && intersection.m_pShape->isLight())
+        {
+            Light *pHitLight = (Light*) intersection.m_pShape;
+            float lightPdf = pHitLight->intersectPdf(intersection);
+            if (lightPdf > 0.0f)
+            {
+                lightPdf *= m_lights.pdf(m_lastPosition[path], m_lastLitNormal[path], pHitLight);
+                float misWeightBrdf = powerHeuristic(1, m_lastBrdfPdf[path], samplers.m_numLightSamples, lightPdf);
+                sample.m_result += throughput * pHitLight->emitted() * misWeightBrdf;
+            }
+        }
+        if (pastLastBounce)
+            return false;
+        
+        // Evaluate the material and intersection information at this bounce
+        Point position = intersection.position();
+        Vector normal = intersection.m_normal;
+        Vector outgoing = -currentRay.m_direction;
+        ShadingRecord shading;
+        shading.setup(intersection.m_pMaterial, position, normal, outgoing);
+        if (shading.brdf() == NULL)
+            return false;
+        
+        bool diracDistribution = shading.isDiracDistribution();
+        m_lastBounceDirac[path] = diracDistribution;
+        if (diracDistribution)
+            m_numDiracBounces[path]++;
+        
+        // Queue up the rays for direct lighting at this bounce; everything
+        // they bring back gets scaled by this (and averaged over the samples)
+        Vector litNormal = dot(normal, outgoing) < 0.0f ? -normal : normal;
+        if (!diracDistribution && samplers.m_numLightSamples > 0)
+        {
+            Color scale = throughput * intersection.m_colorModifier * shading.color() /
+                          (shading.brdfWeight() * float(samplers.m_numLightSamples));
+            for (size_t lightSampleIndex = 0; lightSampleIndex < samplers.m_numLightSamples; ++lightSampleIndex)
+            {
+                unsigned int finalLightSampleIndex = sample.m_pixelSampleIndex * samplers.m_numLightSamples +
+                                                     lightSampleIndex;
+                if (samplers.m_integrator == kIntegratorOneSampleMIS)
+                    queueOneStrategy(path, samplers, numBounces, finalLightSampleIndex,
+                                     position, normal, litNormal, shading, scale);
+                else
+                    queueLightAndBrdfSamples(path, samplers, numBounces, finalLightSampleIndex,
+                                             position, normal, litNormal, shading, scale);
+            }
+        }
+        
+        // Sample the BRDF to find the direction the next leg of the path goes in
+        float brdfSampleU, brdfSampleV;
+        samplers.m_bounceSamplers[numBounces]->sample2D(sample.m_pixelSampleIndex, brdfSampleU, brdfSampleV);
+        Vector incoming;
+        float incomingBrdfPdf = 0.0f;
+        float incomingBrdfResult = shading.sampleSA(incoming,
+                                                    brdfSampleU,
+                                                    brdfSampleV,
+                                                    incomingBrdfPdf);
+        if (incomingBrdfPdf <= 0.0f)
+            return false;
+        m_lastPosition[path] = position;
+        m_lastLitNormal[path] = litNormal;
+        m_lastBrdfPdf[path] = incomingBrdfPdf;
+        throughput *= intersection.m_colorModifier * shading.color() * incomingBrdfResult *
+                      (std::fabs(dot(-incoming, normal)) /
+                      (incomingBrdfPdf * shading.brdfWeight()));
+        m_rays[path] = Ray(position, -incoming, kRayTMax, currentRay.m_time);
+        
+        numBounces++;
+        
+        // Russian roulette, same as pathTrace()
+        if (numBounces >= samplers.m_rouletteMinBounces && numBounces < samplers.m_maxRayDepth)
+        {
+            float survival = std::min(1.0f, throughput.maxComponent());
+            float rouletteSample = samplers.m_rouletteSamplers[numBounces]->sample1D(sample.m_pixelSampleIndex);
+            if (rouletteSample >= survival)
+                return false;
+            throughput /= survival;
+        }
+        return numBounces < samplers.m_maxRayDepth || (shareBrdfRay && numBounces == samplers.m_maxRayDepth);
+    }
+    
+    // A light sample with MIS between the light and the BRDF (the BRDF half
+    // is left to the next leg of the path with a shared BRDF ray)
+    void queueLightAndBrdfSamples(unsigned int path,
+                                  SamplerContainer& samplers,
+                                  size_t numBounces,
+                                  unsigned int finalLightSampleIndex,
+                                  const Point& position,
+                                  const Vector& normal,
+                                  const Vector& litNormal,
+                                  const ShadingRecord& shading,
+                                  const Color& scale)
+    {
+        float time = m_pPaths[path].m_ray.m_time;
+        bool shareBrdfRay = samplers.m_integrator == kIntegratorSharedBrdfRay;
+        
+        float liu = samplers.m_lightSelectionSamplers[numBounces]->sample1D(finalLightSampleIndex);
+        Light *pLightShape = NULL;
+        float lightSelectionPdf = 0.0f;
+        if (!m_lights.sample(position, litNormal, liu, pLightShape, lightSelectionPdf))
+            return;
+        
+        float lsu, lsv;
+        samplers.m_lightSamplers[numBounces]->sample2D(finalLightSampleIndex, lsu, lsv);
+        float leu = samplers.m_lightElementSamplers[numBounces]->sample1D(finalLightSampleIndex);
+        Point lightPoint;
+        Vector lightNormal;
+        float lightPdf = 0.0f;
+        pLightShape->sampleSurface(position, normal, time, lsu, lsv, leu, lightPoint, lightNormal, lightPdf);
+        if (lightPdf > 0.0f)
+        {
+            Vector lightIncoming = position - lightPoint;
+            float lightDistance = lightIncoming.normalize();
+            float brdfPdf = 0.0f;
+            float brdfResult = shading.evaluateSA(lightIncoming, brdfPdf);
+            if (brdfResult > 0.0f && brdfPdf > 0.0f)
+            {
+                float misWeightLight = shareBrdfRay ?
+                    powerHeuristic(samplers.m_numLightSamples, lightPdf * lightSelectionPdf, 1, brdfPdf) :
+                    powerHeuristic(1, lightPdf, 1, brdfPdf);
+                m_shadowRays.push_back(Ray(position, -lightIncoming, lightDistance - kRayTMin, time));
+                m_shadowPaths.push_back(path);
+                m_shadowLight.push_back(pLightShape->emitted() * scale * brdfResult *
+                                        std::fabs(dot(-lightIncoming, normal)) *
+                                        misWeightLight / (lightPdf * lightSelectionPdf));
+            }
+        }
+        
+        if (shareBrdfRay)
+            return;
+        
+        float bsu, bsv;
+        samplers.m_brdfSamplers[numBounces]->sample2D(finalLightSampleIndex, bsu, bsv);
+        Vector brdfIncoming;
+        float brdfPdf = 0.0f;
+        float brdfResult = shading.sampleSA(brdfIncoming, bsu, bsv, brdfPdf);
+        if (brdfPdf > 0.0f && brdfResult > 0.0f)
+        {
+            queueBrdfRay(Ray(position, -brdfIncoming, kRayTMax, time), path,
+                         scale * brdfResult * std::fabs(dot(-brdfIncoming, normal)) /
+                         (brdfPdf * lightSelectionPdf),
+                         pLightShape, brdfPdf, 0.0f, litNormal);
+        }
+    }
+    
+    // A one-sample MIS light sample: either the light's sample or the BRDF's
+    void queueOneStrategy(unsigned int path,
+                          SamplerContainer& samplers,
+                          size_t numBounces,
+                          unsigned int finalLightSampleIndex,
+                          const Point& position,
+                          const Vector& normal,
+                          const Vector& litNormal,
+                          const ShadingRecord& shading,
+                          const Color& scale)
+    {
+        float time = m_pPaths[path].m_ray.m_time;
+        float lightFraction = shading.lightSampleFraction();
+        float strategyU = samplers.m_strategySamplers[numBounces]->sample1D(finalLightSampleIndex);
+        if (strategyU < lightFraction)
+        {
+            float liu = samplers.m_lightSelectionSamplers[numBounces]->sample1D(finalLightSampleIndex);
+            Light *pLightShape = NULL;
+            float lightSelectionPdf = 0.0f;
+            if (!m_lights.sample(position, litNormal, liu, pLightShape, lightSelectionPdf))
+                return;
+            
+            float lsu, lsv;
+            samplers.m_lightSamplers[numBounces]->sample2D(finalLightSampleIndex, lsu, lsv);
+            float leu = samplers.m_lightElementSamplers[numBounces]->sample1D(finalLightSampleIndex);
+            Point lightPoint;
+            Vector lightNormal;
+            float lightPdf = 0.0f;
+            pLightShape->sampleSurface(position, normal, time, lsu, lsv, leu, lightPoint, lightNormal, lightPdf);
+            if (lightPdf <= 0.0f)
+                return;
+            lightPdf *= lightSelectionPdf;
+            
+            Vector incoming = position - lightPoint;
+            float lightDistance = incoming.normalize();
+            float brdfPdf = 0.0f;
+            float brdfResult = shading.evaluateSA(incoming, brdfPdf);
+            if (brdfResult <= 0.0f)
+                return;
+            
+            m_shadowRays.push_back(Ray(position, -incoming, lightDistance - kRayTMin, time));
+            m_shadowPaths.push_back(path);
+            m_shadowLight.push_back(pLightShape->emitted() * scale * brdfResult *
+                                    std::fabs(dot(-incoming, normal)) /
+                                    (lightFraction * lightPdf + (1.0f - lightFraction) * brdfPdf));
+        }
+        else
+        {
+            float bsu, bsv;
+            samplers.m_brdfSamplers[numBounces]->sample2D(finalLightSampleIndex, bsu, bsv);
+            Vector incoming;
+            float brdfPdf = 0.0f;
+            float brdfResult = shading.sampleSA(incoming, bsu, bsv, brdfPdf);
+            if (brdfPdf <= 0.0f || brdfResult <= 0.0f)
+                return;
+            queueBrdfRay(Ray(position, -incoming, kRayTMax, time), path,
+                         scale * brdfResult * std::fabs(dot(-incoming, normal)),
+                         NULL, brdfPdf, lightFraction, litNormal);
+        }
+    }
+    
+    // A BRDF-sampled ray that counts if it runs into the target light (or
+    // any light, if there's no target)
+    void queueBrdfRay(const Ray& ray,
+                      unsigned int path,
+                      const Color& light,
+                      const Light *pTarget,
+                      float brdfPdf,
+                      float lightFraction,
+                      const Vector& litNormal)
+    {
+        m_brdfRays.push_back(ray);
+        m_brdfPaths.push_back(path);
+        m_brdfLight.push_back(light);
+        m_brdfTargets.push_back(pTarget);
+        m_brdfPdfs.push_back(brdfPdf);
+        m_brdfLightFractions.push_back(lightFraction);
+        m_brdfLitNormals.push_back(litNormal);
+    }
+    
+    // Put the rays listed in 'order' in Morton order
+    void sortRays(const std::vector<Ray>& rays, std::vector<unsigned int>& order)
+    {
+        BBox bounds;
+        for (size_t i = 0; i < order.size(); ++i)
+            bounds.expand(rays[order[i]].m_origin);
+        MortonEncoder encoder(bounds);
+        m_sortKeys.resize(order.size());
+        for (size_t i = 0; i < order.size(); ++i)
+        {
+            m_sortKeys[i].m_group = 0;
+            m_sortKeys[i].m_key = encoder.encode(rays[order[i]]);
+            m_sortKeys[i].m_index = order[i];
+        }
+        std::sort(m_sortKeys.begin(), m_sortKeys.end());
+        for (size_t i = 0; i < order.size(); ++i)
+            order[i] = m_sortKeys[i].m_index;
+    }
+    
+    // List every ray in a queue, for sorting
+    static void listAll(size_t count, std::vector<unsigned int>& order)
+    {
+        order.resize(count);
+        for (size_t i = 0; i < count; ++i)
+            order[i] = static_cast<unsigned int>(i);
+    }
+    
+    PathSample *m_pPaths;
+    ShapeSet& m_scene;
+    const LightTree& m_lights;
+    
+    // Path state, one entry per path (structure-of-arrays)
+    std::vector<Ray> m_rays;
+    std::vector<Intersection> m_hits;
+    std::vector<Color> m_throughput;
+    std::vector<unsigned int> m_numBounces;
+    std::vector<unsigned int> m_numDiracBounces;
+    std::vector<unsigned char> m_lastBounceDirac;
+    std::vector<Point> m_lastPosition;
+    std::vector<Vector> m_lastLitNormal;
+    std::vector<float> m_lastBrdfPdf;
+    // The paths still going
+    std::vector<unsigned int> m_active;
+    
+    // Light samples' shadow rays, and the light they bring if unblocked
+    std::vector<Ray> m_shadowRays;
+    std::vector<unsigned int> m_shadowPaths;
+    std::vector<Color> m_shadowLight;
+    std::vector<unsigned int> m_shadowOrder;
+    // BRDF samples' rays, and what's needed to weight the light they hit
+    std::vector<Ray> m_brdfRays;
+    std::vector<unsigned int> m_brdfPaths;
+    std::vector<Color> m_brdfLight;
+    std::vector<const Light*> m_brdfTargets;
+    std::vector<float> m_brdfPdfs;
+    std::vector<float> m_brdfLightFractions;
+    std::vector<Vector> m_brdfLitNormals;
+    std::vector<unsigned int> m_brdfOrder;
+    
+    std::vector<SortKey> m_sortKeys;
+};
+
+
+} // namespace
+
+
+void pathTraceBatch(std::vector<PathSample>& paths,
+                    ShapeSet& scene,
+                    const LightTree& lights)
+{
+    Wavefront wavefront(scene, lights);
+    for (size_t first = 0; first < paths.size(); first += kMaxWavefrontPaths)
+        wavefront.run(&paths[first], std::min(kMaxWavefrontPaths, paths.size() - first));
+}
+
+
+} // namespace Rayito
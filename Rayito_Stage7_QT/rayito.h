@@ -7,6 +7,9 @@
 #ifndef __RAYITO_H__
 #define __RAYITO_H__
 
+#include <string>
+#include <vector>
+
 #include "RMath.h"
 #include "RRay.h"
 #include "RMaterial.h"
@@ -38,6 +41,11 @@ public:
         return m_pixels[y * m_width + x];
     }
     
+    const Color& pixel(size_t x, size_t y) const
+    {
+        return m_pixels[y * m_width + x];
+    }
+    
 protected:
     size_t m_width, m_height;
     Color *m_pixels;
@@ -96,6 +104,45 @@ protected:
 };
 
 
+//
+// Integrators (how paths gather light at each bounce)
+//
+
+enum IntegratorMode
+{
+    // Each light sample traces a ray toward a light and a BRDF-sampled ray
+    // that might hit it, mixed with MIS, and a separate BRDF-sampled ray
+    // continues the path: up to three rays per bounce
+    kIntegratorSeparateBrdfRays = 0,
+    // The BRDF-sampled ray that continues the path is also the BRDF half of
+    // MIS: whatever light it hits is added in at the next vertex.  That's
+    // two rays per bounce (one per light sample, plus the next leg).
+    kIntegratorSharedBrdfRay,
+    // Each light sample picks just one of the light or BRDF strategies, with
+    // odds set by the BRDF, and weights it by both strategies' PDFs (one-sample
+    // MIS with the balance heuristic).  One ray per light sample, plus the
+    // next leg, like the shared mode, but the path itself is the same as the
+    // separate mode.
+    kIntegratorOneSampleMIS
+};
+
+
+//
+// Sample patterns (where the random numbers for each path come from)
+//
+
+enum SamplerMode
+{
+    // A correlated multi-jitter pattern for each use of random numbers, sized
+    // for the samples a pixel gets, and shuffled for every pixel
+    kSamplerCorrelatedMultiJitter = 0,
+    // One Owen-scrambled Sobol sequence, with a dimension for each use of
+    // random numbers; any sample of any pixel can be looked up directly, and
+    // sample counts don't have to be square
+    kSamplerSobol
+};
+
+
 //
 // Sampler container (for a given pixel, holds the samplers for all random features and bounces)
 //
@@ -106,16 +153,22 @@ struct SamplerContainer
     Sampler* m_lensSampler;
     Sampler* m_subpixelSampler;
     Sampler* m_timeSampler;
-    // This is sampled once per bounce to determine the next leg of the path
+    // These are sampled once per bounce to determine the next leg of the path,
+    // and whether the path survives Russian roulette to take it
     std::vector<Sampler*> m_bounceSamplers;
+    std::vector<Sampler*> m_rouletteSamplers;
     // These are sampled N times per bounce (once for each light sample)
     std::vector<Sampler*> m_lightSelectionSamplers;
     std::vector<Sampler*> m_lightElementSamplers;
     std::vector<Sampler*> m_lightSamplers;
     std::vector<Sampler*> m_brdfSamplers;
+    // (Only used by one-sample MIS, to pick the strategy for a light sample)
+    std::vector<Sampler*> m_strategySamplers;
     
     unsigned int m_numLightSamples;
     unsigned int m_maxRayDepth;
+    unsigned int m_rouletteMinBounces;
+    IntegratorMode m_integrator;
 };
 
 
@@ -128,20 +181,138 @@ struct SamplerContainer
 // along the way.
 Color pathTrace(const Ray& ray,
                 ShapeSet& scene,
-                std::vector<Shape*>& lights,
+                const LightTree& lights,
                 Rng& rng,
                 SamplerContainer& samplers,
                 unsigned int pixelSampleIndex);
 
+// One path for pathTraceBatch(): its starting ray, the sample patterns and
+// pixel sample index it would get from pathTrace(), and what it brings back
+struct PathSample
+{
+    Ray m_ray;
+    SamplerContainer *m_pSamplers;
+    unsigned int m_pixelSampleIndex;
+    Color m_result;
+};
+
+// Path trace a batch of paths together (wavefront style, a few hundred at a
+// time): each bounce is done for all of them at once, in stages, with the
+// rays sorted to keep the ones going through the same parts of the scene
+// together.  Each path comes out the same as pathTrace() would make it.
+void pathTraceBatch(std::vector<PathSample>& paths,
+                    ShapeSet& scene,
+                    const LightTree& lights);
+
+// Everything the user gets to pick for a render, besides the scene itself
+// (the camera settings are used by whoever makes the camera)
+struct RenderSettings
+{
+    size_t m_width, m_height;
+    unsigned int m_pixelSamplesHint;
+    // Sobol patterns take any sample count, so with kSamplerSobol this (when
+    // it isn't zero) is the exact number of samples per pixel, in place of
+    // pixelSamplesHint^2
+    unsigned int m_pixelSamples;
+    unsigned int m_lightSamplesHint;
+    unsigned int m_maxRayDepth;
+    // Paths that have made this many bounces play Russian roulette before
+    // each further one (the survivors are weighted up to make up for it)
+    unsigned int m_rouletteMinBounces;
+    IntegratorMode m_integrator;
+    SamplerMode m_sampler;
+    // Trace each tile's paths together with pathTraceBatch(), instead of one
+    // at a time (same image, but friendlier to the caches on big scenes)
+    bool m_wavefront;
+    // Adaptive sampling: pixels get at least pixelSamplesHint^2 samples (and
+    // 16 before they can stop), then keep getting more (up to
+    // maxPixelSamplesHint^2) until the noise around them drops below the
+    // threshold.  It's off unless the max is above pixelSamplesHint.
+    unsigned int m_maxPixelSamplesHint;
+    float m_noiseThreshold;
+    float m_fieldOfView;
+    float m_focalDistance;
+    float m_lensRadius;
+    float m_shutterOpen, m_shutterClose;
+    // Where the OBJ files used by the scenes live
+    std::string m_modelDirectory;
+    // Where the parsed OBJs (and their BVHs) are cached for next time; empty
+    // means the per-user cache directory, and the model directory keeps them
+    // next to the OBJs (see createFromOBJFile())
+    bool m_meshCache;
+    std::string m_meshCacheDirectory;
+    
+    // Same defaults as the GUI
+    RenderSettings()
+        : m_width(640), m_height(480),
+          m_pixelSamplesHint(1), m_pixelSamples(0), m_lightSamplesHint(1), m_maxRayDepth(3),
+          m_rouletteMinBounces(3), m_integrator(kIntegratorSeparateBrdfRays),
+          m_sampler(kSamplerCorrelatedMultiJitter), m_wavefront(false),
+          m_maxPixelSamplesHint(0), m_noiseThreshold(0.02f),
+          m_fieldOfView(30.0f), m_focalDistance(16.0f), m_lensRadius(0.0f),
+          m_shutterOpen(0.0f), m_shutterClose(1.0f),
+          m_modelDirectory("../models"),
+          m_meshCache(true), m_meshCacheDirectory() { }
+};
+
+// What a render cost, and how clean it came out.  Noise is the relative
+// standard error of a pixel's mean luminance, over the pixels with at least
+// two samples to estimate it from (zero if there are none).
+struct RenderStats
+{
+    // Seconds spent getting the scene ready to trace before the first pixel
+    // (prepare(), which builds or refits the BVHs, and the light tree)
+    float m_prepareTime;
+    unsigned long long m_samplesSpent;
+    float m_averageNoise;
+    float m_maxNoise;
+    size_t m_convergedPixels;
+    
+    RenderStats()
+        : m_prepareTime(0.0f), m_samplesSpent(0), m_averageNoise(0.0f), m_maxNoise(0.0f),
+          m_convergedPixels(0) { }
+};
+
+// Watches a progressive render.  After each pass it gets the running sum of
+// each pixel's samples and how many samples each pixel has (with adaptive
+// sampling, pixels that are done stop getting more); the buffers are the
+// render's own, so they are only valid during the call.  Return false to stop
+// the render there.
+class RenderProgress
+{
+public:
+    virtual ~RenderProgress() { }
+    
+    virtual bool passFinished(const Image& sampleSums,
+                              const std::vector<unsigned int>& pixelSamples,
+                              unsigned int samplesSoFar,
+                              unsigned int maxSamples) = 0;
+};
+
 // Generate a ray-traced image of the scene, with the given camera, resolution,
-// and sample settings
+// and sample settings.  With a progress object it renders progressively, one
+// sample per pixel at a time; the result is the same either way, unless the
+// render gets stopped early.
 Image* raytrace(ShapeSet& scene,
                 const Camera& cam,
-                size_t width,
-                size_t height,
-                unsigned int pixelSamplesHint,
-                unsigned int lightSamplesHint,
-                unsigned int maxRayDepth);
+                const RenderSettings& settings,
+                RenderProgress *pProgress = NULL,
+                RenderStats *pStats = NULL);
+
+
+//
+// Example scenes (shared by the GUI and the command-line renderer)
+//
+
+// Spheres, a cube and an OBJ mesh under an area light and a moving sphere light
+Image* renderExampleScene(const RenderSettings& settings,
+                          RenderProgress *pProgress = NULL,
+                          RenderStats *pStats = NULL);
+
+// Spheres and cubes falling and bouncing off the ground, with motion blur
+Image* renderBouncingScene(const RenderSettings& settings,
+                           RenderProgress *pProgress = NULL,
+                           RenderStats *pStats = NULL);
 
 
 } // namespace Rayito